@@ -4,7 +4,7 @@
 #
 #-------------------------------------------------
 
-QT       += core gui
+QT       += core gui concurrent
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
 TARGET = Leviathan
@@ -17,6 +17,7 @@ RESOURCES = leviathan_resources.qrc
 SOURCES += \
     globals.cpp \
     main.cpp \
+    mapexportcommand.cpp \
     cpputils/strings.cpp \
     cpputils/sysio.cpp \
     qtutils/checkableproxymodel.cpp \
@@ -65,14 +66,21 @@ SOURCES += \
     uoclientfiles/helpers.cpp \
     uoclientfiles/uoradarcol.cpp \
     uoclientfiles/uomap.cpp \
+    uoclientfiles/uomapblockcache.cpp \
+    uoclientfiles/uomapexporter.cpp \
+    uoclientfiles/uodifindex.cpp \
+    uoclientfiles/uomaptilepyramid.cpp \
     uoclientfiles/uostatics.cpp \
     uoclientfiles/colors.cpp \
     uoclientfiles/uonimmul.cpp \
     uoclientfiles/uoanim.cpp \
+    uoclientfiles/uobodydef.cpp \
     uoclientfiles/uoart.cpp \
     uoclientfiles/uohues.cpp \
     uoclientfiles/uoidx.cpp \
     uoclientfiles/uoanimuop.cpp \
+    uoclientfiles/uoppackagecache.cpp \
+    uoclientfiles/uolegacymulconverter.cpp \
     keystrokesender/keystrokesender_common.cpp \
     keystrokesender/keystrokesender_windows.cpp \
     keystrokesender/keystrokesender_linux.cpp \
@@ -82,6 +90,7 @@ SOURCES += \
 HEADERS  += \
     globals.h \
     logging.h \
+    mapexportcommand.h \
     version.h \
     cpputils/maps.h \
     cpputils/strings.h \
@@ -138,13 +147,20 @@ HEADERS  += \
     uoclientfiles/helpers.h \
     uoclientfiles/uoradarcol.h \
     uoclientfiles/uomap.h \
+    uoclientfiles/uomapblockcache.h \
+    uoclientfiles/uomapexporter.h \
+    uoclientfiles/uodifindex.h \
+    uoclientfiles/uomaptilepyramid.h \
     uoclientfiles/uostatics.h \
     uoclientfiles/uoanim.h \
     uoclientfiles/uoanimmul.h \
+    uoclientfiles/uobodydef.h \
     uoclientfiles/uoanimuop.h \
     uoclientfiles/uoart.h \
     uoclientfiles/uohues.h \
     uoclientfiles/uoidx.h \
+    uoclientfiles/uoppackagecache.h \
+    uoclientfiles/uolegacymulconverter.h \
     keystrokesender/keystrokesender_common.h \
     keystrokesender/keystrokesender_windows.h \
     keystrokesender/keystrokesender_linux.h \
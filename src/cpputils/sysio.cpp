@@ -7,8 +7,13 @@
 #else
     #include <dirent.h>     // To search files inside a directory
     #include <cstring>
+    #include <fcntl.h>      // To memory-map a file
+    #include <sys/mman.h>
+    #include <unistd.h>
 #endif
 #include <sys/stat.h>
+#include <cstdint>          // for SIZE_MAX
+#include <cstdio>           // for rename
 
 
 void standardizePath(std::string &s)
@@ -40,6 +45,28 @@ bool isValidDirectory(const std::string& directoryPath)
         return false;
 }
 
+bool renameReplacing(const std::string& sourcePath, const std::string& destPath)
+{
+#ifdef _WIN32
+    return (MoveFileExA(sourcePath.c_str(), destPath.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0);
+#else
+    return (rename(sourcePath.c_str(), destPath.c_str()) == 0);
+#endif
+}
+
+bool getFileStats(const std::string& filePath, unsigned long long* size, long long* lastModified)
+{
+    struct stat info;
+
+    if (stat( filePath.c_str(), &info ) != 0)
+        return false;
+    if (size)
+        *size = static_cast<unsigned long long>(info.st_size);
+    if (lastModified)
+        *lastModified = static_cast<long long>(info.st_mtime);
+    return true;
+}
+
 void getFilesInDirectorySub(std::vector<std::string> *out, std::string directory)
 {
     // This function checks recursively in the given folder.
@@ -114,3 +141,71 @@ void getFilesInDirectorySub(std::vector<std::string> *out, std::string directory
     closedir(dir);
 #endif
 }
+
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open(const std::string& filePath)
+{
+    close();
+
+#ifdef _WIN32
+    HANDLE hFile = CreateFileA(filePath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(hFile, &fileSize) || (fileSize.QuadPart <= 0) || (static_cast<unsigned long long>(fileSize.QuadPart) > SIZE_MAX))
+    {
+        CloseHandle(hFile);
+        return false;
+    }
+    HANDLE hMapping = CreateFileMappingA(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(hFile); // the mapping object keeps its own reference to the file
+    void* view = (hMapping != nullptr) ? MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    if (view == nullptr)
+    {
+        if (hMapping != nullptr)
+            CloseHandle(hMapping);
+        return false;
+    }
+    m_mappingHandle = hMapping;
+    m_size = size_t(fileSize.QuadPart);
+#else
+    const int fd = ::open(filePath.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    struct stat info;
+    if ((fstat(fd, &info) != 0) || (info.st_size <= 0) || (static_cast<unsigned long long>(info.st_size) > SIZE_MAX))
+    {
+        ::close(fd);
+        return false;
+    }
+    void* view = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);    // the mapping stays valid after closing the descriptor
+    if (view == MAP_FAILED)
+        return false;
+    m_size = size_t(info.st_size);
+#endif
+
+    m_data = static_cast<const char*>(view);
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (m_data == nullptr)
+        return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(m_data);
+    CloseHandle(m_mappingHandle);
+    m_mappingHandle = nullptr;
+#else
+    munmap(const_cast<char*>(m_data), m_size);
+#endif
+    m_data = nullptr;
+    m_size = 0;
+}
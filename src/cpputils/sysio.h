@@ -11,8 +11,39 @@ void standardizePath(std::string &s);   // Change back slash to forward slash an
 bool isValidFile(const std::string& filePath);
 bool isValidDirectory(const std::string& directoryPath);
 
+// rename a file, replacing the destination file if it exists, in a single (atomic, where supported) step.
+bool renameReplacing(const std::string& sourcePath, const std::string& destPath);
+
+// get size (in bytes) and last modification time (seconds since epoch) of a file. returns false if the file can't be accessed.
+bool getFileStats(const std::string& filePath, unsigned long long* size, long long* lastModified);
+
 // searches recursively for .scp files in a folder.
 void getFilesInDirectorySub(std::vector<std::string> *out, std::string directory);
 
 
+// read-only memory mapping of a whole file.
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::string& filePath);
+    void close();
+
+    bool isOpen() const         { return (m_data != nullptr); }
+    const char* data() const    { return m_data; }
+    size_t size() const         { return m_size; }
+
+private:
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+#ifdef _WIN32
+    void* m_mappingHandle = nullptr;
+#endif
+};
+
+
 #endif // SYSIO_H
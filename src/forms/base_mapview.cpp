@@ -11,16 +11,18 @@
 //#include <QDebug>
 
 #include "../uoclientfiles/uomap.h"
+#include "../uoclientfiles/uomaptilepyramid.h"
 #include "../uoclientfiles/uoradarcol.h"
 #include "../uoclientfiles/uostatics.h"
 #include "../globals.h"
+#include "../qtutils/delayedexecutiontimer.h"
 #include "subdlg_taskprogress.h"
 
 
 static const Qt::CursorShape kMapViewCursorShapeDefault = Qt::ArrowCursor;
 
 Base_MapView::Base_MapView() :
-    m_imgFutureWatcher(this)
+    m_imgFutureWatcher(this), m_tilePyramidBuildWatcher(this), m_viewportRenderWatcher(this), m_viewportRenderCancel(false)
 {
     m_parentWidget = nullptr;
     m_graphicsView = nullptr;
@@ -39,6 +41,10 @@ Base_MapView::Base_MapView() :
     m_giMap = nullptr;
     m_giSelectedPointCursor = nullptr;
     m_mapImage = nullptr;
+
+    m_viewportRenderTimer = new DelayedExecutionTimer(100, 20, this);
+    m_viewTilesGeneration = 0;
+    m_viewTilesPerRow = m_viewTilesPerColumn = 0;
 }
 
 void Base_MapView::setup(QWidget* parentWidget, QGraphicsView *graphicsView)
@@ -51,6 +57,10 @@ void Base_MapView::setup(QWidget* parentWidget, QGraphicsView *graphicsView)
     connect(this, SIGNAL(progressValChanged(int)), this, SLOT(progressValUpdate(int)));
 
     connect(&m_imgFutureWatcher, SIGNAL(finished()), this, SLOT(drawingFullDone()));
+    connect(&m_tilePyramidBuildWatcher, SIGNAL(finished()), this, SLOT(tilePyramidBuildDone()));
+    connect(m_viewportRenderTimer, SIGNAL(triggered()), this, SLOT(scheduleViewportRender()));
+    connect(&m_viewportRenderWatcher, SIGNAL(finished()), this, SLOT(scheduleViewportRender()));
+    connect(this, SIGNAL(viewTileRendered(uint,int,int,QImage)), this, SLOT(viewTileReady(uint,int,int,QImage)));
 
     // GraphicsView
     //  Set default cursor
@@ -67,6 +77,7 @@ Base_MapView::~Base_MapView()
 {
     //m_imgFutureWatcher.cancel(); // doesn't work for QtConcurrent::run
     m_imgFutureWatcher.waitForFinished(); // otherwise we'll crash, since the qimage class member is being written by the other thread
+    stopViewportRender();
 
     if (m_scene)
         delete m_scene;
@@ -129,9 +140,7 @@ void Base_MapView::setMapPlane(uint mapPlane)
         m_giSelectedPointCursor = nullptr;
     }
 
-    if (m_selectedMapData)
-        m_selectedMapData->freeDataCache();
-
+    // The blocks of the previous plane stay in the shared block cache, evicted only if we run out of budget.
     redrawMap();
 }
 
@@ -164,6 +173,10 @@ void Base_MapView::setDeltaZoom(double deltaZoom)
     }
     */
     m_graphicsView->scale(deltaZoom, deltaZoom);
+
+    // Zooming out shows tiles not rendered yet
+    if (!m_drawFull && m_scene)
+        m_viewportRenderTimer->trigger();
 }
 
 
@@ -210,12 +223,20 @@ void Base_MapView::redrawMap()
 
 bool Base_MapView::drawMapReset()
 {
+    // The viewport render worker uses the map data and the tiles bitmaps: stop it before changing them.
+    stopViewportRender();
+
     m_selectedMapData = g_UOMaps.empty() ? nullptr : g_UOMaps[m_mapPlane];
     if (!m_selectedMapData)
         return false;
     uocf::UOStatics *selectedStaticsData = g_UOStatics.empty() ? nullptr : g_UOStatics[m_mapPlane];
     m_selectedMapData->setCachePointers(g_UORadarCol, selectedStaticsData, g_UOHues);
 
+    // Use the pre-rendered radar tiles if we have them, otherwise start building them for the next time.
+    m_selectedTilePyramid = (m_mapPlane < g_UOMapTilePyramids.size()) ? g_UOMapTilePyramids[m_mapPlane] : nullptr;
+    if (m_selectedTilePyramid && !m_selectedTilePyramid->isLoaded() && !m_selectedTilePyramid->load())
+        buildTilePyramid();
+
     if (m_mapImage)
         delete m_mapImage;
     m_mapImage = nullptr;
@@ -234,10 +255,15 @@ bool Base_MapView::drawMapReset()
     unsigned mapWidthScaled = m_selectedMapData->getWidth(), mapHeightScaled = m_selectedMapData->getHeight();
     uocf::UOMap::scaleCoordsMapToImage(m_scaleFactor, &mapWidthScaled, &mapHeightScaled);
 
-    m_mapImage = new QImage(int(mapWidthScaled), int(mapHeightScaled), QImage::Format_RGB32);
-    m_mapImage->fill(uocf::UOMap::kUninitializedRGB);
+    m_viewImageSize = QSize(int(mapWidthScaled), int(mapHeightScaled));
+    resetViewTiles();
 
-    if (!m_drawFull)
+    if (m_drawFull)
+    {
+        m_mapImage = new QImage(int(mapWidthScaled), int(mapHeightScaled), QImage::Format_RGB32);
+        m_mapImage->fill(uocf::UOMap::kUninitializedRGB);
+    }
+    else
     {
         m_scene->setSceneRect(QRectF(0, 0, mapWidthScaled, mapHeightScaled));
         //m_scene->setSceneRect(QRectF(0, 0, int(mapWidthScaled / m_zoom), int(mapHeightScaled / m_zoom)));
@@ -252,6 +278,45 @@ bool Base_MapView::drawMapReset()
     return true;
 }
 
+bool Base_MapView::canUseTilePyramid() const
+{
+    return m_selectedTilePyramid && m_selectedTilePyramid->isLoaded() &&
+            (m_selectedTilePyramid->getMapWidth() == m_selectedMapData->getWidth()) &&
+            (m_selectedTilePyramid->getMapHeight() == m_selectedMapData->getHeight());
+}
+
+void Base_MapView::buildTilePyramid()
+{
+    // If a build failed, don't retry: it would likely fail again, rendering the whole map each time
+    if (m_tilePyramidBuildWatcher.isRunning() || m_selectedTilePyramid->isBuilding() || m_selectedTilePyramid->hasBuildFailed())
+        return;
+
+    // The worker keeps its own reference to the pyramid, which reads the client files on its own: both stay valid
+    //  if the client profile is reloaded or this view is destroyed meanwhile.
+    const std::shared_ptr<uocf::UOMapTilePyramid> pyramid = m_selectedTilePyramid;
+    auto build = [pyramid]() -> bool
+    {
+        return pyramid->build();
+    };
+
+    appendToLog("Pre-rendering the radar tiles for map" + std::to_string(m_mapPlane) + " in background...");
+    m_tilePyramidBuildWatcher.setFuture(QtConcurrent::run(build));
+}
+
+void Base_MapView::tilePyramidBuildDone()
+{
+    if (!m_tilePyramidBuildWatcher.result())
+        return;     // the pyramid is marked as failed, buildTilePyramid won't retry it
+    appendToLog("Radar tiles pre-rendered.");
+
+    // Load the new tiles if we are still showing the same map plane (the next redraw will use them),
+    //  otherwise build the tiles for the plane selected in the meantime.
+    if (!m_selectedTilePyramid || m_selectedTilePyramid->isLoaded() || m_selectedTilePyramid->isBuilding())
+        return;
+    if (!m_selectedTilePyramid->load())
+        buildTilePyramid();
+}
+
 void Base_MapView::drawMap()
 {
     if (m_drawFull)
@@ -260,13 +325,9 @@ void Base_MapView::drawMap()
     {
         const QScrollBar *hScroll = m_graphicsView->horizontalScrollBar();
         const QScrollBar *vScroll = m_graphicsView->verticalScrollBar();
-        const QPoint imageOffset(hScroll->value(), vScroll->value());
-        const QPoint imageOffsetScaledToMap = coordsFromViewToMap(imageOffset);
-
-        const QRect& viewGeometry = m_graphicsView->geometry();
-        const QPoint& viewSizeScaled = coordsFromViewToMap({viewGeometry.width(), viewGeometry.height()});
-        const QRect rectToDraw(imageOffsetScaledToMap.x(), imageOffsetScaledToMap.y(), viewSizeScaled.x(), viewSizeScaled.y());
-        drawMapPart(imageOffset, rectToDraw);
+        m_lastScrollPos = QPoint(hScroll->value(), vScroll->value());
+        m_scrollDirection = QPoint();
+        scheduleViewportRender();
     }
 }
 
@@ -286,7 +347,7 @@ void Base_MapView::drawMapFull()
     if (uint(m_mapPlane + 1) > g_UOMaps.size())
         return;
 
-    if (!m_selectedMapData)
+    if (!m_selectedMapData || !m_mapImage)
         return;
 
     m_progressDlg->setParent(m_parentWidget->window());
@@ -301,8 +362,13 @@ void Base_MapView::drawMapFull()
         emit progressValChanged(i);
     };
 
+    // Decide here, in the main thread: the pyramid is loaded only by the main thread.
+    const std::shared_ptr<uocf::UOMapTilePyramid> pyramid = canUseTilePyramid() ? m_selectedTilePyramid : nullptr;
     auto render = [=]() -> bool
     {
+      // The pre-rendered tiles, if available, just need to be copied
+      if (pyramid && pyramid->copyRectToImage(m_scaleFactor, m_mapImage, 0, 0, 0, 0, uint(m_mapImage->width()), uint(m_mapImage->height())))
+          return true;
       return m_selectedMapData->drawRectInImage(m_mapImage, 0, 0,
                                               emitUpdateSignal,
                                               0, 0, m_selectedMapData->getWidth(), m_selectedMapData->getHeight(),
@@ -319,9 +385,8 @@ void Base_MapView::drawingFullDone()
     m_progressDlg->close();
     m_parentWidget->setEnabled(true);
 
-    if (!m_selectedMapData)
+    if (!m_selectedMapData || !m_mapImage)
         return;
-    m_selectedMapData->freeDataCache();
 
     QGraphicsPixmapItem* item = new QGraphicsPixmapItem(QPixmap::fromImage(*m_mapImage));
 
@@ -340,87 +405,163 @@ void Base_MapView::drawingFullDone()
 
 void Base_MapView::scrollBarHorizontalChanged(int val)
 {
-    if (m_drawFull || !m_mapImage)
+    if (m_drawFull || !m_scene)
         return;
 
-    const QScrollBar *vScroll = m_graphicsView->verticalScrollBar();
-    const QPoint imageOffset(val, vScroll->value());
-    const QPoint imageOffsetScaledToMap = coordsFromViewToMap(imageOffset);
+    m_scrollDirection.setX((val > m_lastScrollPos.x()) ? 1 : ((val < m_lastScrollPos.x()) ? -1 : 0));
+    m_lastScrollPos.setX(val);
+    m_viewportRenderTimer->trigger();
+}
 
-    const QRect& viewGeometry = m_graphicsView->geometry();
-    //const QPoint viewSizeScaledToMap = coordsFromViewToMap({int(zoom * viewGeometry.width()), int(zoom * viewGeometry.height())});
-    const QPoint viewSizeScaledToMap = coordsFromViewToMap({viewGeometry.width(), viewGeometry.height()});
+void Base_MapView::scrollBarVerticalChanged(int val)
+{
+    if (m_drawFull || !m_scene)
+        return;
 
-    const QRect rectToDraw(imageOffsetScaledToMap.x(), imageOffsetScaledToMap.y(), viewSizeScaledToMap.x(), viewSizeScaledToMap.y());
-    drawMapPart(imageOffset, rectToDraw);
+    m_scrollDirection.setY((val > m_lastScrollPos.y()) ? 1 : ((val < m_lastScrollPos.y()) ? -1 : 0));
+    m_lastScrollPos.setY(val);
+    m_viewportRenderTimer->trigger();
 }
 
-void Base_MapView::scrollBarVerticalChanged(int val)
+void Base_MapView::stopViewportRender()
 {
-    if (m_drawFull || !m_mapImage)
+    if (!m_viewportRenderWatcher.isRunning())
         return;
+    m_viewportRenderCancel = true;
+    m_viewportRenderWatcher.waitForFinished();
+    m_viewportRenderCancel = false;
 
-    const QScrollBar *hScroll = m_graphicsView->horizontalScrollBar();
-    const QPoint imageOffset(hScroll->value(), val);
-    const QPoint imageOffsetScaledToMap = coordsFromViewToMap(imageOffset);
+    // The tiles it didn't reach will be scheduled again, when the watcher's finished signal arrives.
+    m_viewTilesPending.fill(false);
+}
 
-    const QRect& viewGeometry = m_graphicsView->geometry();
-    //const QPoint viewSizeScaledToMap = coordsFromViewToMap({int(zoom * viewGeometry.width()), int(zoom * viewGeometry.height())});
-    const QPoint viewSizeScaledToMap = coordsFromViewToMap({viewGeometry.width(), viewGeometry.height()});
+void Base_MapView::resetViewTiles()
+{
+    // Called when the scene is recreated, the tiles items are deleted with the old scene
+    ++m_viewTilesGeneration;
+    m_viewTilesPerRow = (m_viewImageSize.width() + kViewTileSize - 1) / kViewTileSize;
+    m_viewTilesPerColumn = (m_viewImageSize.height() + kViewTileSize - 1) / kViewTileSize;
+    const int tilesCount = m_drawFull ? 0 : (m_viewTilesPerRow * m_viewTilesPerColumn);
+    m_viewTilesValid.fill(false, tilesCount);
+    m_viewTilesPending.fill(false, tilesCount);
+    m_viewTiles.fill(nullptr, tilesCount);
+}
 
-    const QRect rectToDraw(imageOffsetScaledToMap.x(), imageOffsetScaledToMap.y(), viewSizeScaledToMap.x(), viewSizeScaledToMap.y());
-    drawMapPart(imageOffset, rectToDraw);
+void Base_MapView::evictViewTiles(const QRect& tilesToKeep)
+{
+    for (int tile_i = 0; tile_i < m_viewTiles.size(); ++tile_i)
+    {
+        if (!m_viewTilesValid.testBit(tile_i) || tilesToKeep.contains(tile_i % m_viewTilesPerRow, tile_i / m_viewTilesPerRow))
+            continue;
+        QGraphicsPixmapItem* item = m_viewTiles[tile_i];
+        m_scene->removeItem(item);
+        delete item;
+        m_viewTiles[tile_i] = nullptr;
+        m_viewTilesValid.clearBit(tile_i);
+    }
 }
 
-void Base_MapView::drawMapPart(const QPoint &imageOffset, const QRect &rectToDraw)
+void Base_MapView::scheduleViewportRender()
 {
-    if (m_mapPlane > uocf::UOMap::kMaxSupportedMap)
+    // Called when the scroll events calm down, and each time the worker finishes a batch (the viewport may have moved meanwhile).
+    if (m_drawFull || !m_selectedMapData || !m_scene || m_viewTiles.isEmpty())
         return;
-    if (uint(m_mapPlane + 1) > g_UOMaps.size())
+    if (m_viewportRenderWatcher.isRunning())
         return;
 
-    if (!m_selectedMapData)
+    // The scene has the size of the scaled map, so scene coordinates are image coordinates.
+    const QRect imageRect(QPoint(0, 0), m_viewImageSize);
+    const QRect visibleRect = m_graphicsView->mapToScene(m_graphicsView->viewport()->rect()).boundingRect().toAlignedRect() & imageRect;
+    if (visibleRect.isEmpty())
         return;
 
-    //static qulonglong rendercnt = 0;
-    //auto tStart = std::chrono::steady_clock::now();
-    unsigned int xRenderStart = unsigned(rectToDraw.x()), yRenderStart = unsigned(rectToDraw.y());
-    unsigned int renderWidth = unsigned(rectToDraw.width()), renderHeight = unsigned(rectToDraw.height());
-    m_selectedMapData->clipCoordsToMapSize(&xRenderStart, &yRenderStart, &renderWidth, &renderHeight);
-    m_selectedMapData->drawRectInImage(m_mapImage, imageOffset.x(), imageOffset.y(),
-                                     nullptr,
-                                     xRenderStart, yRenderStart, renderWidth, renderHeight,
-                                     m_scaleFactor, true);
-    //auto tEnd = std::chrono::steady_clock::now();
-    //qDebug() << "rendermap" << ++rendercnt << "-> ms" << std::chrono::duration_cast<std::chrono::milliseconds>(tEnd - tStart).count();
-
-    const QPoint pixmapSize = coordsFromMapToView(QPoint(int(renderWidth), int(renderHeight)));
-    QPixmap pix(pixmapSize.x(), pixmapSize.y());
-    //pix.fill(Qt::transparent); // fill with something, if we create a larger than needed pixmap
-    pix.fill(Qt::white); // transparent may be slower than white (which has no alpha?)
-    const QPoint copyDestOffset(0, 0);
-    const QRect copySourceRect(imageOffset.x(), imageOffset.y(), pixmapSize.x(), pixmapSize.y());
-    QPainter painter(&pix);
-    painter.drawImage(copyDestOffset, *m_mapImage, copySourceRect);
-    painter.end();
-    QGraphicsPixmapItem* item = new QGraphicsPixmapItem(pix);
-    //item->setPos(imageOffset / m_zoom);
-    item->setPos(imageOffset);
+    const int xTileLast = m_viewTilesPerRow - 1, yTileLast = m_viewTilesPerColumn - 1;
+    const int xVisibleFirst = visibleRect.left() / kViewTileSize, xVisibleLast = visibleRect.right() / kViewTileSize;
+    const int yVisibleFirst = visibleRect.top() / kViewTileSize, yVisibleLast = visibleRect.bottom() / kViewTileSize;
 
-    m_graphicsView->setDisabled(true);
+    // Render the visible tiles first, then a ring of one tile around them, extended ahead in the scroll direction.
+    auto prefetchBefore = [](int direction) { return (direction < 0) ? kViewTilesPrefetch : 1; };
+    auto prefetchAfter = [](int direction) { return (direction > 0) ? kViewTilesPrefetch : 1; };
+    const int xFirst = std::max(0, xVisibleFirst - prefetchBefore(m_scrollDirection.x()));
+    const int xLast = std::min(xTileLast, xVisibleLast + prefetchAfter(m_scrollDirection.x()));
+    const int yFirst = std::max(0, yVisibleFirst - prefetchBefore(m_scrollDirection.y()));
+    const int yLast = std::min(yTileLast, yVisibleLast + prefetchAfter(m_scrollDirection.y()));
 
-    m_scene->addItem(item);
-    if (m_giMap)
+    // Free the tiles we scrolled away from
+    evictViewTiles(QRect(QPoint(xFirst - kViewTilesKeep, yFirst - kViewTilesKeep), QPoint(xLast + kViewTilesKeep, yLast + kViewTilesKeep)));
+
+    QVector<QPoint> visibleTiles, prefetchTiles;
+    for (int yTile = yFirst; yTile <= yLast; ++yTile)
     {
-        if (m_giMap->scene() == m_scene)
-            m_scene->removeItem(m_giMap);
-        delete m_giMap;
+        for (int xTile = xFirst; xTile <= xLast; ++xTile)
+        {
+            const int tile_i = (yTile * m_viewTilesPerRow) + xTile;
+            if (m_viewTilesValid.testBit(tile_i) || m_viewTilesPending.testBit(tile_i))
+                continue;
+            const bool visible = (xTile >= xVisibleFirst) && (xTile <= xVisibleLast) && (yTile >= yVisibleFirst) && (yTile <= yVisibleLast);
+            (visible ? visibleTiles : prefetchTiles).append(QPoint(xTile, yTile));
+            m_viewTilesPending.setBit(tile_i);
+        }
     }
-    m_giMap = item;
+    if (visibleTiles.isEmpty() && prefetchTiles.isEmpty())
+        return;
+    visibleTiles += prefetchTiles;
+
+    // Decide here, in the main thread: the pyramid is loaded only by the main thread.
+    const std::shared_ptr<uocf::UOMapTilePyramid> pyramid = canUseTilePyramid() ? m_selectedTilePyramid : nullptr;
+    uocf::UOMap *mapData = m_selectedMapData;
+    const uint scaleFactor = m_scaleFactor;
+    const uint generation = m_viewTilesGeneration;
+    auto render = [this, visibleTiles, pyramid, mapData, scaleFactor, generation, imageRect]()
+    {
+        for (const QPoint& tile : visibleTiles)
+        {
+            if (m_viewportRenderCancel)
+                return;
+
+            // Each tile has its own image, allocated only when the tile is needed
+            const QRect tileRect = QRect(tile.x() * kViewTileSize, tile.y() * kViewTileSize, kViewTileSize, kViewTileSize) & imageRect;
+            QImage tileImage(tileRect.size(), QImage::Format_RGB32);
+            tileImage.fill(uocf::UOMap::kUninitializedRGB);
+
+            const bool copiedFromTiles = pyramid &&
+                    pyramid->copyRectToImage(scaleFactor, &tileImage, 0, 0,
+                                             uint(tileRect.x()), uint(tileRect.y()), uint(tileRect.width()), uint(tileRect.height()));
+            if (!copiedFromTiles)
+            {
+                unsigned int xMapStart = uint(tileRect.x()), yMapStart = uint(tileRect.y());
+                unsigned int width = uint(tileRect.width()), height = uint(tileRect.height());
+                uocf::UOMap::scaleCoordsImageToMap(scaleFactor, &xMapStart, &yMapStart);
+                uocf::UOMap::scaleCoordsImageToMap(scaleFactor, &width, &height);
+                mapData->clipCoordsToMapSize(&xMapStart, &yMapStart, &width, &height);
+                mapData->drawRectInImage(&tileImage, 0, 0, nullptr,
+                                         xMapStart, yMapStart, width, height, scaleFactor, true);
+            }
 
-    redrawSelectedPointCursor();
+            emit viewTileRendered(generation, tile.x(), tile.y(), tileImage);
+        }
+    };
+    m_viewportRenderWatcher.setFuture(QtConcurrent::run(render));
+}
+
+void Base_MapView::viewTileReady(uint generation, int xTile, int yTile, QImage tileImage)
+{
+    // Discard the tiles rendered for a scene that was reset in the meantime.
+    if ((generation != m_viewTilesGeneration) || !m_scene)
+        return;
 
-    m_graphicsView->setDisabled(false);
+    const int tile_i = (yTile * m_viewTilesPerRow) + xTile;
+    m_viewTilesPending.clearBit(tile_i);
+    if (m_viewTilesValid.testBit(tile_i))
+        return;
+
+    // The image isn't kept: once converted, the pixmap is all we need
+    QGraphicsPixmapItem* item = new QGraphicsPixmapItem(QPixmap::fromImage(tileImage));
+    item->setPos(xTile * kViewTileSize, yTile * kViewTileSize);
+    item->setZValue(-1);    // below the selected point cursor
+    m_scene->addItem(item);
+    m_viewTiles[tile_i] = item;
+    m_viewTilesValid.setBit(tile_i);
 }
 
 
@@ -445,6 +586,9 @@ bool Base_MapView::selectPoint(QPoint pointOnView)
         delete m_giSelectedPointCursor;
     m_giSelectedPointCursor = drawCursor(pointOnView, color);
 
+    // The map data caches aren't meant to be filled by two threads at once
+    stopViewportRender();
+
     m_selectedMapPoint = coordsFromViewToMap(pointOnView);
     m_selectedMapZ = m_selectedMapData->getTopZAtXY(unsigned(m_selectedMapPoint.x()), unsigned(m_selectedMapPoint.y()));
     return true;
@@ -452,7 +596,7 @@ bool Base_MapView::selectPoint(QPoint pointOnView)
 
 QGraphicsPixmapItem* Base_MapView::drawCursor(const QPoint& coordsOnView, const QColor &color)
 {
-    if (coordsOnView.isNull() || !m_mapImage)
+    if (coordsOnView.isNull() || !m_scene)
         return nullptr;
 
     const QSize cursorSize(14, 14);
@@ -3,13 +3,20 @@
 
 #include <QPoint>
 #include <QFutureWatcher>
+#include <QBitArray>
+#include <QImage>
+#include <QSize>
+#include <QVector>
+#include <atomic>
 #include <memory>
 
 
 namespace uocf {
 class UOMap;
+class UOMapTilePyramid;
 }
 class SubDlg_TaskProgress;
+class DelayedExecutionTimer;
 
 class QGraphicsScene;
 class QGraphicsPixmapItem;
@@ -39,13 +46,17 @@ signals:
     void mouseMoved(QPoint);
     void mouseClicked(QPoint);
     void progressValChanged(int i);
+    void viewTileRendered(uint generation, int xTile, int yTile, QImage tileImage);   // emitted by the viewport render worker
 
 public slots:
     void redrawMap();
     void progressValUpdate(int i);
     void drawingFullDone();
+    void tilePyramidBuildDone();
     void scrollBarHorizontalChanged(int val);
     void scrollBarVerticalChanged(int val);
+    void scheduleViewportRender();
+    void viewTileReady(uint generation, int xTile, int yTile, QImage tileImage);
 
 
 //private:
@@ -54,6 +65,7 @@ public:
 
     uint m_mapPlane;
     uocf::UOMap* m_selectedMapData;
+    std::shared_ptr<uocf::UOMapTilePyramid> m_selectedTilePyramid;
 
     bool m_drawFull;
     uint m_scaleFactor;
@@ -89,9 +101,13 @@ public:
     QPoint coordsFromViewToMap(const QPoint& graphicsViewCoords) const;
     QPoint coordsFromMapToView(const QPoint& graphicsViewCoords) const;
     bool drawMapReset();
+    bool canUseTilePyramid() const;
+    void buildTilePyramid();
     void drawMap();
     void drawMapFull();
-    void drawMapPart(const QPoint& imageOffset, const QRect& rectToDraw);
+    void stopViewportRender();
+    void resetViewTiles();
+    void evictViewTiles(const QRect& tilesToKeep);
 
     bool selectPoint(QPoint pointOnView);
     QGraphicsPixmapItem* drawCursor(const QPoint &coordsOnView, const QColor& color);
@@ -102,10 +118,30 @@ public:
     QGraphicsItem* m_giMap;
     QGraphicsItem* m_giSelectedPointCursor;
 
-    QImage* m_mapImage;
+    QImage* m_mapImage;     // only when drawing the whole map
     // For full & async map render
     QFutureWatcher<bool> m_imgFutureWatcher;
     QFuture<bool> m_imgFuture;
+    // For the background pre-rendering of the radar tiles
+    QFutureWatcher<bool> m_tilePyramidBuildWatcher;
+
+    // For the async viewport render, when we don't draw the whole map: there's no image of the whole map, it's split in square
+    //  tiles, each rendered in its own image by a worker and added to the scene as soon as it's ready. The tiles far from
+    //  the viewport are removed from the scene, so the memory used depends on the view size, not on the map size.
+    static constexpr int kViewTileSize = 256;       // in image pixels
+    static constexpr int kViewTilesPrefetch = 2;    // how many rows/columns of tiles to render ahead in the scroll direction
+    static constexpr int kViewTilesKeep = 2;        // how many rows/columns of tiles to keep around the rendered ones
+    DelayedExecutionTimer* m_viewportRenderTimer;   // coalesces the scroll events
+    QFutureWatcher<void> m_viewportRenderWatcher;
+    std::atomic<bool> m_viewportRenderCancel;
+    uint m_viewTilesGeneration;                     // incremented when the tiles are reset, to discard late tiles
+    QSize m_viewImageSize;                          // size of the scaled map, in image pixels
+    int m_viewTilesPerRow, m_viewTilesPerColumn;
+    QBitArray m_viewTilesValid;                     // one bit per tile: drawn and in the scene
+    QBitArray m_viewTilesPending;                   // one bit per tile: being rendered by the worker
+    QVector<QGraphicsPixmapItem*> m_viewTiles;      // scene items of the valid tiles (owned by the scene)
+    QPoint m_lastScrollPos;
+    QPoint m_scrollDirection;                       // -1, 0 or 1 on each axis
 };
 
 #endif // BASE_MAPVIEW_H
@@ -5,6 +5,7 @@
 #include <QStandardItem>
 #include <QGraphicsPixmapItem>
 #include <QKeyEvent>
+#include <QtConcurrent/QtConcurrent>
 
 #include "globals.h"
 #include "subdlg_searchobj.h"
@@ -55,11 +56,20 @@ MainTab_Chars::MainTab_Chars(QWidget *parent) :
     ui->splitter_img_lists->setStretchFactor(1,1);  // column 1: QGraphicsView
 
     m_subdlg_searchObj = std::make_unique<SubDlg_SearchObj>(window());
+
+    m_animPreviewCacheBytes = 0;
+    m_animCurrentFrame = 0;
+    m_animItem = nullptr;
+    m_animRequestedKey = m_animBuildingKey = AnimPreviewKey{-1, 0, 0, 0};
+    connect(&m_animTimer, SIGNAL(timeout()), this, SLOT(animTimerTick()));
+    connect(&m_animAtlasWatcher, SIGNAL(finished()), this, SLOT(animAtlasReady()));
 }
 
 
 MainTab_Chars::~MainTab_Chars()
 {
+    m_animTimer.stop();
+    m_animAtlasWatcher.waitForFinished();
     delete ui;
 
     delete m_organizer_model;
@@ -250,18 +260,150 @@ void MainTab_Chars::onManual_treeView_objList_selectionChanged(const QModelIndex
         hue = 0;
 
     g_UOAnim->setCachePointers(g_UOHues); // reset the right address (in case it has changed) to the hues to be used
-    QImage* frameimg = g_UOAnim->drawAnimFrame(id, 0, 1, 0, hue);
-    if (frameimg == nullptr)
+    m_animRequestedKey = AnimPreviewKey{id, 0, ui->spinBox_direction->value(), unsigned(hue)};
+    requestAnimPreview();
+}
+
+void MainTab_Chars::requestAnimPreview()
+{
+    if (m_animRequestedKey.bodyID < 0)
+        return;
+    if (m_animCurrent && (m_animCurrent->key == m_animRequestedKey))
         return;
 
-    QGraphicsPixmapItem* item = new QGraphicsPixmapItem(QPixmap::fromImage(*frameimg));
-    delete frameimg;
-    if (ui->graphicsView->scene() != nullptr)
-        delete ui->graphicsView->scene();
+    for (auto it = m_animPreviewCache.begin(); it != m_animPreviewCache.end(); ++it)
+    {
+        if ((*it)->key == m_animRequestedKey)
+        {
+            m_animPreviewCache.splice(m_animPreviewCache.begin(), m_animPreviewCache, it);   // move it to the front
+            showAnimPreview(m_animPreviewCache.front());
+            return;
+        }
+    }
+
+    // Not decoded yet. If we are already decoding something else, we'll come back here when it's done.
+    if (m_animAtlasWatcher.isRunning())
+        return;
+
+    m_animBuildingKey = m_animRequestedKey;
+    const AnimPreviewKey key = m_animBuildingKey;
+    uocf::UOAnim* anim = g_UOAnim;
+    auto buildAtlas = [anim, key]() -> std::shared_ptr<uocf::UOAnimAtlas>
+    {
+        auto atlas = std::make_shared<uocf::UOAnimAtlas>();
+        if (!anim->buildAnimAtlas(key.bodyID, key.action, key.direction, key.hue, atlas.get()))
+            return nullptr;
+        return atlas;
+    };
+    m_animAtlasWatcher.setFuture(QtConcurrent::run(buildAtlas));
+}
+
+void MainTab_Chars::releaseClientFiles()
+{
+    // The background decoding uses g_UOAnim, and the decoded previews belong to the old client files
+    m_animAtlasWatcher.waitForFinished();
+    clearAnimPreview();
+    m_animPreviewCache.clear();
+    m_animPreviewCacheBytes = 0;
+    m_animRequestedKey = m_animBuildingKey = AnimPreviewKey{-1, 0, 0, 0};
+}
+
+void MainTab_Chars::animAtlasReady()
+{
+    if (m_animBuildingKey.bodyID < 0)
+        return;     // decoded from the client files unloaded by releaseClientFiles
+
+    std::shared_ptr<uocf::UOAnimAtlas> atlas = m_animAtlasWatcher.result();
+    if (atlas != nullptr)
+    {
+        // Split the atlas in the pixmaps to be shown by the timer, we do it only once
+        auto preview = std::make_shared<AnimPreview>();
+        preview->key = m_animBuildingKey;
+        const QPixmap atlasPixmap = QPixmap::fromImage(*atlas->image);
+        for (const uocf::UOAnimAtlas::Frame& frame : atlas->frames)
+        {
+            const QPoint offset(-frame.xCenter, -(frame.yCenter + frame.height));
+            preview->frames.emplace_back(atlasPixmap.copy(frame.atlasX, 0, frame.width, frame.height));
+            preview->offsets.emplace_back(offset);
+            preview->bounds |= QRectF(offset, QSizeF(frame.width, frame.height));
+        }
+        preview->sizeBytes = size_t(atlas->image->bytesPerLine()) * size_t(atlas->image->height());
+
+        m_animPreviewCacheBytes += preview->sizeBytes;
+        m_animPreviewCache.emplace_front(preview);
+        while ((m_animPreviewCacheBytes > kAnimPreviewCacheMaxBytes) && (m_animPreviewCache.size() > 1))
+        {
+            m_animPreviewCacheBytes -= m_animPreviewCache.back()->sizeBytes;
+            m_animPreviewCache.pop_back();
+        }
+    }
+
+    if (m_animBuildingKey == m_animRequestedKey)
+    {
+        if (atlas != nullptr)
+            showAnimPreview(m_animPreviewCache.front());
+        else
+            clearAnimPreview();
+    }
+    else
+    {
+        // The selection has changed in the meanwhile
+        requestAnimPreview();
+    }
+}
+
+void MainTab_Chars::showAnimPreview(const std::shared_ptr<AnimPreview>& preview)
+{
+    clearAnimPreview();
+    m_animCurrent = preview;
+    m_animCurrentFrame = 0;
+
     QGraphicsScene* scene = new QGraphicsScene();
+    m_animItem = scene->addPixmap(preview->frames[0]);
+    m_animItem->setOffset(preview->offsets[0]);
+    scene->setSceneRect(preview->bounds);   // so that the view doesn't move while the frames change
     ui->graphicsView->setScene(scene);
-    scene->clear();
-    scene->addItem(item);
+
+    if (ui->checkBox_animate->isChecked() && (preview->frames.size() > 1))
+        m_animTimer.start(kAnimFrameIntervalMs);
+}
+
+void MainTab_Chars::clearAnimPreview()
+{
+    m_animTimer.stop();
+    m_animCurrent.reset();
+    m_animItem = nullptr;
+    if (ui->graphicsView->scene() != nullptr)
+    {
+        QGraphicsScene* scene = ui->graphicsView->scene();
+        ui->graphicsView->setScene(nullptr);
+        delete scene;
+    }
+}
+
+void MainTab_Chars::animTimerTick()
+{
+    if (!m_animCurrent || (m_animItem == nullptr))
+        return;
+    m_animCurrentFrame = (m_animCurrentFrame + 1) % int(m_animCurrent->frames.size());
+    m_animItem->setPixmap(m_animCurrent->frames[size_t(m_animCurrentFrame)]);
+    m_animItem->setOffset(m_animCurrent->offsets[size_t(m_animCurrentFrame)]);
+}
+
+void MainTab_Chars::on_checkBox_animate_toggled(bool checked)
+{
+    if (checked && m_animCurrent && (m_animCurrent->frames.size() > 1))
+        m_animTimer.start(kAnimFrameIntervalMs);
+    else
+        m_animTimer.stop();
+}
+
+void MainTab_Chars::on_spinBox_direction_valueChanged(int)
+{
+    if (m_animRequestedKey.bodyID < 0)
+        return;
+    m_animRequestedKey.direction = ui->spinBox_direction->value();
+    requestAnimPreview();
 }
 
 void MainTab_Chars::on_pushButton_collapseAll_clicked()
@@ -2,6 +2,10 @@
 #define MAINTAB_CHARS_H
 
 #include <QWidget>
+#include <QTimer>
+#include <QPixmap>
+#include <QFutureWatcher>
+#include <list>
 #include <memory>   // for smart pointers
 
 class SubDlg_SearchObj;
@@ -11,6 +15,10 @@ class ScriptSubsection;
 class ScriptObj;
 class QStandardItem;
 class QStandardItemModel;
+class QGraphicsPixmapItem;
+namespace uocf {
+    struct UOAnimAtlas;
+}
 
 
 namespace Ui {
@@ -25,6 +33,7 @@ public:
     explicit MainTab_Chars(QWidget *parent = nullptr);
     ~MainTab_Chars();
     void updateViews();
+    void releaseClientFiles();  // call it before reloading the client files
 
 protected:
     bool eventFilter(QObject* watched, QEvent* event);
@@ -43,6 +52,10 @@ private slots:
     void on_pushButton_search_back_clicked();
     void on_pushButton_search_next_clicked();
     void on_pushButton_spawner_clicked();
+    void on_checkBox_animate_toggled(bool checked);
+    void on_spinBox_direction_valueChanged(int);
+    void animAtlasReady();
+    void animTimerTick();
 
 private:
     Ui::MainTab_Chars *ui;
@@ -59,6 +72,45 @@ private:
     std::unique_ptr<ScriptSearch> m_scriptSearch;
 
     void doSearch (bool backwards);
+
+    // Animated preview: all the frames of the action are decoded in background in a single atlas, then the frames
+    //  are played by a timer. The last previews are kept, so that switching back to a direction doesn't decode it again,
+    //  until the client files are reloaded.
+    struct AnimPreviewKey
+    {
+        int bodyID;
+        int action;
+        int direction;
+        unsigned int hue;
+        bool operator==(const AnimPreviewKey& other) const {
+            return (bodyID == other.bodyID) && (action == other.action) && (direction == other.direction) && (hue == other.hue);
+        }
+    };
+    struct AnimPreview
+    {
+        AnimPreviewKey key;
+        std::vector<QPixmap> frames;
+        std::vector<QPoint> offsets;    // where to draw each frame, relative to the position of the character
+        QRectF bounds;                  // union of the frames rects
+        size_t sizeBytes;
+    };
+    static constexpr int kAnimFrameIntervalMs = 100;
+    static constexpr size_t kAnimPreviewCacheMaxBytes = 32 * 1024 * 1024;
+
+    std::list<std::shared_ptr<AnimPreview>> m_animPreviewCache;     // most recently used first
+    size_t m_animPreviewCacheBytes;
+    std::shared_ptr<AnimPreview> m_animCurrent;     // the preview being played
+    int m_animCurrentFrame;
+    QGraphicsPixmapItem* m_animItem;
+    QTimer m_animTimer;
+
+    AnimPreviewKey m_animRequestedKey;              // what we want to show
+    AnimPreviewKey m_animBuildingKey;               // what's being decoded in background
+    QFutureWatcher<std::shared_ptr<uocf::UOAnimAtlas>> m_animAtlasWatcher;
+
+    void requestAnimPreview();
+    void showAnimPreview(const std::shared_ptr<AnimPreview>& preview);
+    void clearAnimPreview();
 };
 
 
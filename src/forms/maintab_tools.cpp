@@ -3,6 +3,16 @@
 #include "dlg_huepicker.h"
 #include "dlg_worldmap.h"
 
+#include <QDir>
+#include <QFileDialog>
+#include <QFileInfo>
+#include <QtConcurrent/QtConcurrent>
+
+#include "../globals.h"
+#include "../uoppackage/uoppackage.h"
+#include "../uoclientfiles/uoart.h"
+#include "../uoclientfiles/uolegacymulconverter.h"
+
 
 MainTab_Tools::MainTab_Tools(QWidget *parent) :
     QWidget(parent),
@@ -12,10 +22,15 @@ MainTab_Tools::MainTab_Tools(QWidget *parent) :
     m_dlg_worldmap = nullptr;
 
     ui->setupUi(this);
+
+    connect(&m_verifyUOPWatcher, SIGNAL(finished()), this, SLOT(verifyUOPDone()));
+    connect(&m_convertUOPWatcher, SIGNAL(finished()), this, SLOT(convertUOPDone()));
 }
 
 MainTab_Tools::~MainTab_Tools()
 {
+    m_verifyUOPWatcher.waitForFinished();
+    m_convertUOPWatcher.waitForFinished();
     delete ui;
 
     delete m_dlg_huepicker;
@@ -35,3 +50,141 @@ void MainTab_Tools::on_pushButton_worldMap_clicked()
         m_dlg_worldmap = new Dlg_WorldMap();
     m_dlg_worldmap->show();
 }
+
+void MainTab_Tools::on_pushButton_verifyUOP_clicked()
+{
+    if (m_verifyUOPWatcher.isRunning())
+        return;
+    if (g_loadedClientProfile == -1)
+    {
+        appendToLog("Verify UOPs: no Client Profile loaded.");
+        return;
+    }
+
+    const std::string clientFolder = g_clientProfiles[g_loadedClientProfile].m_clientPath;
+    const QStringList packageNames = QDir(QString::fromStdString(clientFolder)).entryList(QStringList("*.uop"), QDir::Files, QDir::Name);
+    if (packageNames.isEmpty())
+    {
+        appendToLog("Verify UOPs: no UOP packages found in " + clientFolder);
+        return;
+    }
+
+    // Each package is verified in parallel by the UOP library, so we check one package at a time.
+    auto verifyPackages = [clientFolder, packageNames]() -> void
+    {
+        unsigned int badPackages = 0;
+        for (const QString& packageName : packageNames)
+        {
+            const std::string packagePath = clientFolder + packageName.toStdString();
+            uopp::UOPPackage package;
+            uopp::UOPError uopError;
+            unsigned int badFiles = 0;
+            if (!package.load(packagePath, &uopError))
+            {
+                ++badPackages;
+                appendToLog("Verify UOPs: can't load " + packagePath + uopError.buildErrorsString(true, true));
+                continue;
+            }
+            if (!package.verify(&uopError, &badFiles))
+            {
+                ++badPackages;
+                appendToLog("Verify UOPs: " + std::to_string(badFiles) + " bad files in " + packagePath + uopError.buildErrorsString(true, true));
+                continue;
+            }
+            appendToLog("Verify UOPs: " + packagePath + " OK.");
+        }
+        appendToLog("Verify UOPs: done. " + std::to_string(packageNames.size()) + " packages checked, " + std::to_string(badPackages) + " with errors.");
+    };
+
+    ui->pushButton_verifyUOP->setEnabled(false);
+    appendToLog("Verify UOPs: checking " + std::to_string(packageNames.size()) + " packages...");
+    m_verifyUOPWatcher.setFuture(QtConcurrent::run(verifyPackages));
+}
+
+void MainTab_Tools::verifyUOPDone()
+{
+    ui->pushButton_verifyUOP->setEnabled(true);
+}
+
+void MainTab_Tools::on_pushButton_extractUOP_clicked()
+{
+    if (m_convertUOPWatcher.isRunning())
+        return;
+
+    const QString uopPath = QFileDialog::getOpenFileName(this, "Select the UOP package to extract", QString(), "UOP packages (*.uop)");
+    if (uopPath.isEmpty())
+        return;
+    const QString outFolder = QFileDialog::getExistingDirectory(this, "Select the destination folder", QFileInfo(uopPath).absolutePath());
+    if (outFolder.isEmpty())
+        return;
+
+    const std::string uopPathStd = uopPath.toStdString();
+    const std::string outFolderStd = outFolder.toStdString();
+    auto extract = [uopPathStd, outFolderStd]() -> void
+    {
+        unsigned int extractedCount = 0;
+        const bool ok = uocf::UOLegacyMULConverter::extractUOP(uopPathStd, outFolderStd, &extractedCount);
+        appendToLog("Extract UOP: " + std::string(ok ? "done. " : "finished with errors. ") + std::to_string(extractedCount) + " files extracted to " + outFolderStd);
+    };
+
+    ui->pushButton_extractUOP->setEnabled(false);
+    ui->pushButton_convertUOP->setEnabled(false);
+    appendToLog("Extract UOP: extracting " + uopPathStd + "...");
+    m_convertUOPWatcher.setFuture(QtConcurrent::run(extract));
+}
+
+void MainTab_Tools::on_pushButton_convertUOP_clicked()
+{
+    if (m_convertUOPWatcher.isRunning())
+        return;
+
+    const QString inPath = QFileDialog::getOpenFileName(this, "Select the LegacyMUL UOP package or the MUL file to convert", QString(),
+                                                        "LegacyMUL files (*LegacyMUL.uop *.mul)");
+    if (inPath.isEmpty())
+        return;
+
+    uocf::UOLegacyMULConverter::FileType fileType;
+    if (!uocf::UOLegacyMULConverter::detectFileType(inPath.toStdString(), &fileType))
+    {
+        appendToLog("Convert LegacyMUL: unsupported file " + inPath.toStdString() + " (only art and gumpart can be converted).");
+        return;
+    }
+
+    const QString outFolder = QFileDialog::getExistingDirectory(this, "Select the destination folder", QFileInfo(inPath).absolutePath());
+    if (outFolder.isEmpty())
+        return;
+
+    // Convert in the direction given by the selected file, taking the other input file (if any) from the same folder.
+    const std::string inFolderStd = QFileInfo(inPath).absolutePath().toStdString() + '/';
+    const std::string outFolderStd = outFolder.toStdString() + '/';
+    const bool toMUL = inPath.endsWith(".uop", Qt::CaseInsensitive);
+    const std::string uopName = uocf::UOLegacyMULConverter::getUOPFileName(fileType);
+    const std::string mulName = uocf::UOLegacyMULConverter::getMULFileName(fileType);
+    const std::string idxName = uocf::UOLegacyMULConverter::getIdxFileName(fileType);
+    const std::string inPathStd = inPath.toStdString();
+    auto convert = [fileType, toMUL, inPathStd, inFolderStd, outFolderStd, uopName, mulName, idxName]() -> void
+    {
+        bool ok;
+        if (toMUL)
+            ok = uocf::UOLegacyMULConverter::convertUOPToMUL(fileType, inPathStd, outFolderStd + mulName, outFolderStd + idxName);
+        else
+            ok = uocf::UOLegacyMULConverter::convertMULToUOP(fileType, inFolderStd + mulName, inFolderStd + idxName, outFolderStd + uopName);
+        appendToLog(std::string("Convert LegacyMUL: ") + (ok ? "done." : "finished with errors."));
+    };
+
+    // The destination files are replaced only at the end of the conversion, but they may be the loaded client files:
+    //  unmap the art packages, otherwise on Windows they can't be replaced (in that case the old files are kept).
+    if (g_UOArt != nullptr)
+        g_UOArt->unloadUOPPackages();
+
+    ui->pushButton_extractUOP->setEnabled(false);
+    ui->pushButton_convertUOP->setEnabled(false);
+    appendToLog("Convert LegacyMUL: converting " + inPathStd + "...");
+    m_convertUOPWatcher.setFuture(QtConcurrent::run(convert));
+}
+
+void MainTab_Tools::convertUOPDone()
+{
+    ui->pushButton_extractUOP->setEnabled(true);
+    ui->pushButton_convertUOP->setEnabled(true);
+}
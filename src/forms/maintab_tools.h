@@ -2,6 +2,7 @@
 #define MAINTAB_Tools_H
 
 #include <QWidget>
+#include <QFutureWatcher>
 
 class Dlg_HuePicker;
 class Dlg_WorldMap;
@@ -21,11 +22,19 @@ public:
 private slots:
     void on_pushButton_huePicker_clicked();
     void on_pushButton_worldMap_clicked();
+    void on_pushButton_verifyUOP_clicked();
+    void verifyUOPDone();
+    void on_pushButton_extractUOP_clicked();
+    void on_pushButton_convertUOP_clicked();
+    void convertUOPDone();
 
 private:
     Ui::MainTab_Tools *ui;
     Dlg_HuePicker *m_dlg_huepicker;
     Dlg_WorldMap *m_dlg_worldmap;
+
+    QFutureWatcher<void> m_verifyUOPWatcher;
+    QFutureWatcher<void> m_convertUOPWatcher;   // used both by the extraction and the conversion
 };
 
 #endif // MAINTAB_Tools_H
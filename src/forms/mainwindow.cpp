@@ -235,6 +235,8 @@ void MainWindow::loadDefaultProfiles_Async()
     m_loadProgressDlg->setLabelText("Loading client files...");
 
     setEnabled(false);
+    if (clientProfileIdx != -1)
+        m_MainTab_Chars_inst->releaseClientFiles();
     m_futureTask = QtConcurrent::run(this, &MainWindow::loadDefaultProfiles_helper);
     m_futureWatcher.setFuture(m_futureTask);
 }
@@ -330,6 +332,7 @@ void MainWindow::loadClientProfile_Async(int index)
     m_loadProgressDlg->setLabelText("Loading client files...");
 
     setEnabled(false);
+    m_MainTab_Chars_inst->releaseClientFiles();
     m_futureTask = QtConcurrent::run(this, &MainWindow::loadClientProfile_helper, index);
     m_futureWatcher.setFuture(m_futureTask);
 }
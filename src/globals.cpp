@@ -6,6 +6,8 @@
 #include "uoclientfiles/uoanim.h"
 #include "uoclientfiles/uohues.h"
 #include "uoclientfiles/uomap.h"
+#include "uoclientfiles/uomapblockcache.h"
+#include "uoclientfiles/uomaptilepyramid.h"
 #include "uoclientfiles/uostatics.h"
 #include "uoclientfiles/uoradarcol.h"
 
@@ -62,8 +64,10 @@ uocf::UOArt         *g_UOArt        = nullptr;
 uocf::UOAnim        *g_UOAnim       = nullptr;
 uocf::UOHues        *g_UOHues       = nullptr;
 uocf::UORadarCol    *g_UORadarCol   = nullptr;
+uocf::UOMapBlockCache *g_UOMapBlockCache = nullptr;
 std::vector<uocf::UOMap *> g_UOMaps;
 std::vector<uocf::UOStatics *> g_UOStatics;
+std::vector<std::shared_ptr<uocf::UOMapTilePyramid>> g_UOMapTilePyramids;
 
 void loadClientFiles(std::function<void(int)> reportProgress)
 {
@@ -83,28 +87,38 @@ void loadClientFiles(std::function<void(int)> reportProgress)
     g_UOArt         = new uocf::UOArt (clientFolder);
     g_UOAnim        = new uocf::UOAnim(clientFolder, reportProgress);
 
+    if (!g_UOMapBlockCache)
+        g_UOMapBlockCache = new uocf::UOMapBlockCache();
+    g_UOMapBlockCache->setBudget(size_t(g_settings.m_mapCacheBudgetMB) * 1024 * 1024);
+
     g_UOMaps.resize(uocf::UOMap::kMaxSupportedMap + 1);
     g_UOStatics.resize(uocf::UOMap::kMaxSupportedMap + 1);
+    g_UOMapTilePyramids.assign(uocf::UOMap::kMaxSupportedMap + 1, nullptr);
     for (unsigned i = 0; i <= uocf::UOMap::kMaxSupportedMap; ++i)
     {
         try
         {
-            g_UOMaps[i] = new uocf::UOMap(clientFolder, i);
+            g_UOMaps[i] = new uocf::UOMap(clientFolder, i, g_UOMapBlockCache);
         }
         catch (uocf::InvalidStreamException)
         {
             g_UOMaps[i] = nullptr;
-            appendToLog("Can't open map" + std::to_string(i) + ".mul.");
+            appendToLog("Can't open map" + std::to_string(i) + "LegacyMUL.uop or map" + std::to_string(i) + ".mul.");
             continue;
         }
         catch (uocf::MalformedFileException)
         {
             g_UOMaps[i] = nullptr;
-            appendToLog("Invalid size for map" + std::to_string(i) + ".mul.");
+            appendToLog("Invalid size for the map" + std::to_string(i) + " data.");
             continue;
         }
         //catch (UnsupportedActionException)
 
+        // The pre-rendered radar tiles, if already built for these client files
+        g_UOMapTilePyramids[i] = std::make_shared<uocf::UOMapTilePyramid>(clientFolder, i);
+        if (g_UOMapTilePyramids[i]->load())
+            appendToLog("Loaded pre-rendered radar tiles for map" + std::to_string(i) + ".");
+
         try
         {
             g_UOStatics[i] = new uocf::UOStatics(clientFolder, i, g_UOMaps[i]->getWidth(), g_UOMaps[i]->getHeight());
@@ -2,6 +2,7 @@
 #define GLOBALS_H
 
 #include <functional>
+#include <memory>
 #include <vector>
 #include "settings/appsettings.h"
 #include "settings/clientprofile.h"
@@ -47,6 +48,8 @@ namespace uocf
     class UOAnim;
     class UOHues;
     class UOMap;
+    class UOMapBlockCache;
+    class UOMapTilePyramid;
     class UOStatics;
     class UORadarCol;
 }
@@ -54,8 +57,11 @@ extern uocf::UOArt  *g_UOArt;
 extern uocf::UOAnim *g_UOAnim;
 extern uocf::UOHues *g_UOHues;
 extern uocf::UORadarCol *g_UORadarCol;
+extern uocf::UOMapBlockCache *g_UOMapBlockCache;   // shared by all the map planes
 extern std::vector<uocf::UOMap *> g_UOMaps;
 extern std::vector<uocf::UOStatics *> g_UOStatics;
+// Shared pointers: a pyramid being built in a worker thread outlives a client profile reload.
+extern std::vector<std::shared_ptr<uocf::UOMapTilePyramid>> g_UOMapTilePyramids;
 
 void loadClientFiles(std::function<void(int)> reportProgress);
 
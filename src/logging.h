@@ -1,7 +1,7 @@
 #ifndef LOGGING_H
 #define LOGGING_H
 
-// To be included only by globals.cpp and maintab_log.cpp.
+// To be included only by globals.cpp, maintab_log.cpp and mapexportcommand.cpp.
 // This object is needed to send log messages between threads (since the UI can be modified only by its own thread)
 
 #include <QObject>
@@ -1,9 +1,17 @@
 #include "forms/mainwindow.h"
+#include "mapexportcommand.h"
 #include <QApplication>
 
 
 int main(int argc, char *argv[])
 {
+    // Batch commands don't need the GUI
+    if (isMapExportCommand(argc, argv))
+    {
+        QCoreApplication a(argc, argv);
+        return runMapExportCommand(a.arguments());
+    }
+
     QApplication a(argc, argv);
     MainWindow w;
     w.show();
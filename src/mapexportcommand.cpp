@@ -0,0 +1,238 @@
+#include "mapexportcommand.h"
+
+#include <QCommandLineParser>
+#include <QDir>
+#include <QElapsedTimer>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "globals.h"
+#include "logging.h"
+#include "cpputils/sysio.h"
+#include "uoclientfiles/exceptions.h"
+#include "uoclientfiles/uohues.h"
+#include "uoclientfiles/uomap.h"
+#include "uoclientfiles/uomapblockcache.h"
+#include "uoclientfiles/uomapexporter.h"
+#include "uoclientfiles/uoradarcol.h"
+#include "uoclientfiles/uostatics.h"
+
+
+static const char* kMapExportOption = "export-map";
+
+
+bool isMapExportCommand(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--export-map") == 0)
+            return true;
+    }
+    return false;
+}
+
+// Parse "all" or a number in [0, maxValue].
+static bool parseRange(const QString& value, unsigned int maxValue, std::vector<unsigned int>* values)
+{
+    values->clear();
+    if (value.compare("all", Qt::CaseInsensitive) == 0)
+    {
+        for (unsigned int i = 0; i <= maxValue; ++i)
+            values->push_back(i);
+        return true;
+    }
+    bool ok;
+    const unsigned int val = value.toUInt(&ok);
+    if (!ok || (val > maxValue))
+        return false;
+    values->push_back(val);
+    return true;
+}
+
+static std::string getDefaultClientPath()
+{
+    g_clientProfiles = ClientProfile::createFromJson();
+    for (const ClientProfile& profile : g_clientProfiles)
+    {
+        if (profile.m_defaultProfile)
+            return profile.m_clientPath;
+    }
+    return {};
+}
+
+int runMapExportCommand(const QStringList& arguments)
+{
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Render the radar map of the client to image files, without starting the GUI.");
+    parser.addHelpOption();
+    parser.addOptions({
+        {kMapExportOption,  "Export the map."},
+        {"client",          "Client folder (default: the one of the default Client Profile).", "path"},
+        {"plane",           "Map plane to export, or all of them (default: all).", "0-5|all", "all"},
+        {"scale",           "Scale factor (each one halves the image size), or all of them (default: 0).", "0-4|all", "0"},
+        {"format",          "Image format: png, or raw for headerless 24 bits RGB rows (default: png).", "png|raw", "png"},
+        {"no-statics",      "Draw only the terrain."},
+        {"no-hues",         "Don't apply the hues to the statics."},
+        {"out",             "Output folder, created if missing (default: current folder).", "path", "."},
+    });
+    parser.process(arguments);
+
+    std::vector<unsigned int> planes, scaleFactors;
+    if (!parseRange(parser.value("plane"), uocf::UOMap::kMaxSupportedMap, &planes))
+    {
+        fprintf(stderr, "Invalid map plane: %s\n", qUtf8Printable(parser.value("plane")));
+        return 1;
+    }
+    if (!parseRange(parser.value("scale"), uocf::UOMap::kScaleFactorMax, &scaleFactors))
+    {
+        fprintf(stderr, "Invalid scale factor: %s\n", qUtf8Printable(parser.value("scale")));
+        return 1;
+    }
+
+    uocf::UOMapExporter::Format format;
+    const QString formatName = parser.value("format").toLower();
+    if (formatName == "png")
+        format = uocf::UOMapExporter::Format::PNG;
+    else if (formatName == "raw")
+        format = uocf::UOMapExporter::Format::Raw;
+    else
+    {
+        fprintf(stderr, "Invalid format: %s\n", qUtf8Printable(formatName));
+        return 1;
+    }
+    const bool drawStatics = !parser.isSet("no-statics");
+    const bool applyHues = !parser.isSet("no-hues");
+
+    // Without the GUI, the log messages go to the console
+    QObject::connect(&g_logEventEmitter, &LogEventEmitter::requestAppend,
+                     [](const QString& text) { fprintf(stderr, "%s\n", qUtf8Printable(text)); });
+
+    std::string clientPath = parser.isSet("client") ? parser.value("client").toStdString() : getDefaultClientPath();
+    if (clientPath.empty())
+    {
+        fprintf(stderr, "No client folder given and no default Client Profile found.\n");
+        return 1;
+    }
+    standardizePath(clientPath);
+
+    const QString outFolder = parser.value("out");
+    if (!QDir().mkpath(outFolder))
+    {
+        fprintf(stderr, "Can't create the output folder %s\n", qUtf8Printable(outFolder));
+        return 1;
+    }
+
+    // UORadarCol doesn't complain about a missing file: it would just draw everything black
+    if (!isValidFile(clientPath + "radarcol.mul"))
+    {
+        fprintf(stderr, "Can't find radarcol.mul in %s\n", clientPath.c_str());
+        return 1;
+    }
+
+    std::unique_ptr<uocf::UORadarCol> radarcol;
+    std::unique_ptr<uocf::UOHues> hues;
+    try
+    {
+        radarcol = std::make_unique<uocf::UORadarCol>(clientPath + "radarcol.mul");
+        if (applyHues && drawStatics)
+            hues = std::make_unique<uocf::UOHues>(clientPath + "hues.mul");
+    }
+    catch (uocf::UOCFException& e)
+    {
+        fprintf(stderr, "Can't load the client files: %s\n", e.what());
+        return 1;
+    }
+
+    // The blocks of each plane are dropped from the cache when we move to the next one, so the memory used is bounded by
+    //  the cache budget plus a strip of the image.
+    uocf::UOMapBlockCache blockCache;
+    int failedCount = 0, exportedCount = 0;
+    for (unsigned int plane : planes)
+    {
+        // When exporting all the planes, skip the missing ones
+        if (!isValidFile(uocf::UOMap::getMapFilePath(clientPath, plane)))
+        {
+            if (planes.size() == 1)
+            {
+                fprintf(stderr, "Can't find map%u.\n", plane);
+                ++failedCount;
+            }
+            continue;
+        }
+
+        std::unique_ptr<uocf::UOMap> map;
+        try
+        {
+            map = std::make_unique<uocf::UOMap>(clientPath, plane, &blockCache);
+        }
+        catch (uocf::UOCFException& e)
+        {
+            // The file is there, but we can't read it (e.g. MalformedFileException)
+            fprintf(stderr, "Can't load map%u: %s\n", plane, e.what());
+            ++failedCount;
+            continue;
+        }
+
+        std::unique_ptr<uocf::UOStatics> statics;
+        if (drawStatics)
+        {
+            try
+            {
+                statics = std::make_unique<uocf::UOStatics>(clientPath, plane, map->getWidth(), map->getHeight());
+                statics->cacheIdxData();
+                statics->mapFile();
+            }
+            catch (uocf::UOCFException&)
+            {
+                fprintf(stderr, "Can't load statics%u, drawing only the terrain.\n", plane);
+                statics.reset();
+            }
+        }
+        map->setCachePointers(radarcol.get(), statics.get(), hues.get());
+        map->mapFile();     // with both files mapped, each strip is rendered by multiple threads
+
+        for (unsigned int scaleFactor : scaleFactors)
+        {
+            const QString filePath = QDir(outFolder).filePath(
+                        QString("map%1_scale%2.%3").arg(plane).arg(scaleFactor).arg(uocf::UOMapExporter::getFileExtension(format)));
+
+            QElapsedTimer timer;
+            timer.start();
+            bool exported;
+            try
+            {
+                exported = uocf::UOMapExporter::exportMap(map.get(), scaleFactor, bool(statics), format, filePath.toStdString());
+            }
+            catch (uocf::UOCFException& e)
+            {
+                fprintf(stderr, "%s\n", e.what());
+                exported = false;
+            }
+
+            if (!exported)
+            {
+                fprintf(stderr, "Can't export map%u at scale factor %u.\n", plane, scaleFactor);
+                ++failedCount;
+                continue;
+            }
+            unsigned int width = map->getWidth(), height = map->getHeight();
+            uocf::UOMap::scaleCoordsMapToImage(scaleFactor, &width, &height);
+            printf("Exported map%u at scale factor %u (%ux%u) to %s in %lld ms.\n",
+                   plane, scaleFactor, width, height, qUtf8Printable(filePath), timer.elapsed());
+            fflush(stdout);
+            ++exportedCount;
+        }
+
+        map->freeDataCache();
+    }
+
+    // Don't report success if we haven't found any map plane (e.g. wrong client folder)
+    if (exportedCount == 0)
+    {
+        fprintf(stderr, "No map exported from %s\n", clientPath.c_str());
+        return 1;
+    }
+    return (failedCount == 0) ? 0 : 1;
+}
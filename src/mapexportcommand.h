@@ -0,0 +1,14 @@
+#ifndef MAPEXPORTCOMMAND_H
+#define MAPEXPORTCOMMAND_H
+
+#include <QStringList>
+
+
+// Headless map export, run instead of the GUI when the program is started with --export-map.
+// Example: Leviathan --export-map --client /path/to/client --plane all --scale 2 --format png --out radar
+
+bool isMapExportCommand(int argc, char *argv[]);
+int runMapExportCommand(const QStringList& arguments);  // returns the process exit code
+
+
+#endif // MAPEXPORTCOMMAND_H
@@ -12,7 +12,7 @@
 
 
 AppSettings::AppSettings() :
-    m_loadDefaultProfilesAtStartup(true), m_customSpawnCmd(".spawn %1,%2,%3,%4,%5")
+    m_loadDefaultProfilesAtStartup(true), m_customSpawnCmd(".spawn %1,%2,%3,%4,%5"), m_mapCacheBudgetMB(256)
 {
 }
 
@@ -22,6 +22,7 @@ QJsonObject AppSettings::generateJsonObject()
     QJsonObject obj;
     obj["LoadDefaultProfilesAtStartup"] = m_loadDefaultProfilesAtStartup;
     obj["CustomSpawnCmd"] = QString::fromStdString(m_customSpawnCmd);
+    obj["MapCacheBudgetMB"] = int(m_mapCacheBudgetMB);
 
     return obj;
 }
@@ -60,6 +61,10 @@ bool AppSettings::updateFromJson()
     if (QJSONVAL_ISVALID(val))
         m_customSpawnCmd = val.toString().toStdString();
 
+    val = settingsObj["MapCacheBudgetMB"];
+    if (QJSONVAL_ISVALID(val) && (val.toInt() > 0))
+        m_mapCacheBudgetMB = unsigned(val.toInt());
+
     return true;
 }
 
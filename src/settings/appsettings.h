@@ -15,6 +15,7 @@ public:
 
     bool m_loadDefaultProfilesAtStartup;
     std::string m_customSpawnCmd;
+    unsigned int m_mapCacheBudgetMB;    // memory budget for the map and statics blocks cache
 };
 
 #endif // APPSETTINGS_H
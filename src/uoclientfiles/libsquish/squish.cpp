@@ -24,6 +24,8 @@
    -------------------------------------------------------------------------- */
 
 #include <string.h>
+#include <algorithm>
+#include <vector>
 #include "squish.h"
 #include "colourset.h"
 #include "maths.h"
@@ -40,7 +42,7 @@ static int FixFlags( int flags )
     // grab the flag bits
     int method = flags & ( kDxt1 | kDxt3 | kDxt5 | kBc4 | kBc5 );
     int fit = flags & ( kColourIterativeClusterFit | kColourClusterFit | kColourRangeFit );
-    int extra = flags & kWeightColourByAlpha;
+    int extra = flags & ( kWeightColourByAlpha | kSourceBGRA );
 
     // set defaults
     if ( method != kDxt3
@@ -231,6 +233,39 @@ void CompressImage( u8 const* rgba, int width, int height, void* blocks, int fla
     CompressImage(rgba, width, height, width*4, blocks, flags, metric);
 }
 
+static void DecompressBlockRow( u8* rgba, int width, int height, int pitch, u8 const* sourceBlock, int y, int flags )
+{
+    int bytesPerBlock = ( ( flags & ( kDxt1 | kBc4 ) ) != 0 ) ? 8 : 16;
+    int rows = ( height - y < 4 ) ? ( height - y ) : 4;
+    u8* targetRow = rgba + pitch*y;
+
+    for( int x = 0; x < width; x += 4 )
+    {
+        // decompress the block
+        u8 targetRgba[4*16];
+        Decompress( targetRgba, sourceBlock, flags );
+
+        // write the decompressed pixels to the correct image locations: whole rows of the block are copied
+        //  at once, only the blocks on the right border need clipping
+        int columns = ( width - x < 4 ) ? ( width - x ) : 4;
+        for( int py = 0; py < rows; ++py )
+        {
+            u8* targetPixel = targetRow + pitch*py + 4*x;
+            u8 const* sourcePixel = targetRgba + 16*py;
+            if( ( flags & kSourceBGRA ) == 0 )
+                memcpy( targetPixel, sourcePixel, 4*columns );
+            else
+            {
+                for( int px = 0; px < columns; ++px )
+                    CopyRGBA( sourcePixel + 4*px, targetPixel + 4*px, flags );
+            }
+        }
+
+        // advance
+        sourceBlock += bytesPerBlock;
+    }
+}
+
 void DecompressImage( u8* rgba, int width, int height, int pitch, void const* blocks, int flags )
 {
     // fix any bad flags
@@ -247,38 +282,7 @@ void DecompressImage( u8* rgba, int width, int height, int pitch, void const* bl
         int bytesPerBlock = ( ( flags & ( kDxt1 | kBc4 ) ) != 0 ) ? 8 : 16;
         sourceBlock += ( (y / 4) * ( (width + 3) / 4) ) * bytesPerBlock;
 
-        for( int x = 0; x < width; x += 4 )
-        {
-            // decompress the block
-            u8 targetRgba[4*16];
-            Decompress( targetRgba, sourceBlock, flags );
-
-            // write the decompressed pixels to the correct image locations
-            u8 const* sourcePixel = targetRgba;
-            for( int py = 0; py < 4; ++py )
-            {
-                for( int px = 0; px < 4; ++px )
-                {
-                    // get the target location
-                    int sx = x + px;
-                    int sy = y + py;
-
-                    // write if we're in the image
-                    if( sx < width && sy < height )
-                    {
-                        // copy the rgba value
-                        u8* targetPixel = rgba + pitch*sy + 4*sx;
-                        CopyRGBA(sourcePixel, targetPixel, flags);
-                    }
-
-                    // advance to the next pixel
-                    sourcePixel += 4;
-                }
-            }
-
-            // advance
-            sourceBlock += bytesPerBlock;
-        }
+        DecompressBlockRow( rgba, width, height, pitch, sourceBlock, y, flags );
     }
 }
 
@@ -287,6 +291,42 @@ void DecompressImage( u8* rgba, int width, int height, void const* blocks, int f
     DecompressImage( rgba, width, height, width*4, blocks, flags );
 }
 
+void DecompressImages( DecompressJob const* jobs, int count, bool parallel )
+{
+    // index the first block row of each image, so that the work can be split evenly between the threads
+    //  even when a single big texture is mixed with a lot of small ones
+    std::vector< int > firstRows( count + 1, 0 );
+    for( int i = 0; i < count; ++i )
+        firstRows[i + 1] = firstRows[i] + ( jobs[i].height + 3 )/4;
+    int totalRows = firstRows[count];
+    if( totalRows == 0 )
+        return;
+
+    // walk the batch by block row
+#ifdef _OPENMP
+#   pragma omp parallel for schedule( dynamic, 16 ) if( parallel )
+#else
+    (void)parallel;
+#endif
+    for( int row = 0; row < totalRows; ++row )
+    {
+        // find the image owning this row
+        int job = int( std::upper_bound( firstRows.begin(), firstRows.end(), row ) - firstRows.begin() ) - 1;
+        int firstRow = firstRows[job];
+        DecompressJob const& cur = jobs[job];
+        int flags = FixFlags( cur.flags );
+        int pitch = ( cur.pitch > 0 ) ? cur.pitch : cur.width*4;
+
+        // initialise the block input
+        int y = ( row - firstRow )*4;
+        u8 const* sourceBlock = reinterpret_cast< u8 const* >( cur.blocks );
+        int bytesPerBlock = ( ( flags & ( kDxt1 | kBc4 ) ) != 0 ) ? 8 : 16;
+        sourceBlock += ( (y / 4) * ( (cur.width + 3) / 4) ) * bytesPerBlock;
+
+        DecompressBlockRow( cur.rgba, cur.width, cur.height, pitch, sourceBlock, y, flags );
+    }
+}
+
 static double ErrorSq(double x, double y)
 {
     return (x - y) * (x - y);
@@ -279,6 +279,32 @@ void DecompressImage( u8* rgba, int width, int height, void const* blocks, int f
 
 // -----------------------------------------------------------------------------
 
+//! A single image to be decompressed by squish::DecompressImages.
+struct DecompressJob
+{
+    u8* rgba;               //!< Storage for the decompressed pixels.
+    int width;              //!< The width of the source image.
+    int height;             //!< The height of the source image.
+    int pitch;              //!< The pitch of the decompressed pixels (0 means width*4).
+    void const* blocks;     //!< The compressed DXT blocks.
+    int flags;              //!< Compression flags.
+};
+
+/*! @brief Decompresses a batch of images in memory.
+
+    @param jobs     The images to decompress.
+    @param count    The number of images in the batch.
+    @param parallel Split the block rows of the batch between threads (needs OpenMP).
+
+    Each image is decompressed as with squish::DecompressImage, directly into the
+    storage provided by the caller. The whole batch is walked by rows of 4x4 blocks,
+    so the overhead of a call is paid once for all the images and the rows can be
+    spread on all the cores, independently from the size of each single image.
+*/
+void DecompressImages( DecompressJob const* jobs, int count, bool parallel = true );
+
+// -----------------------------------------------------------------------------
+
 /*! @brief Computes MSE of an compressed image in memory.
 
     @param rgba      The original image pixels.
@@ -1,10 +1,14 @@
 #include "uoanim.h"
 
+#include <algorithm>    // for std::max
+#include <cstring>      // for memcpy
+#include <QImage>
+
 namespace uocf
 {
 
 UOAnim::UOAnim(const std::string &clientPath, std::function<void(int)> reportProgress) :
-    m_UOAnimMUL(clientPath), m_UOAnimUOP(clientPath, reportProgress)
+    m_bodyDef(clientPath), m_UOAnimMUL(clientPath, &m_bodyDef), m_UOAnimUOP(clientPath, reportProgress)
 {
     // Do not pass as a const reference reportProgress to the constructor: be sure to have at least one copy of it, in case
     //  the referred object isn't valid after some time
@@ -12,16 +16,90 @@ UOAnim::UOAnim(const std::string &clientPath, std::function<void(int)> reportPro
 
 void UOAnim::setCachePointers(UOHues* hues)
 {
+    // An atlas may be being built in a worker thread, reading the hues through these pointers.
+    std::lock_guard<std::mutex> lock(m_drawMutex);
     m_UOAnimMUL.m_UOHues = hues;
     m_UOAnimUOP.m_UOHues = hues;
 }
 
-QImage* UOAnim::drawAnimFrame(int bodyID, int action, int direction, int frame, unsigned int hueIndex)
+QImage* UOAnim::drawAnimFrame(int bodyID, int action, int direction, int frame, unsigned int hueIndex, UOAnimFrameInfo* frameInfo)
+{
+    std::lock_guard<std::mutex> lock(m_drawMutex);
+    return drawAnimFrameUnlocked(bodyID, action, direction, frame, hueIndex, frameInfo);
+}
+
+QImage* UOAnim::drawAnimFrameUnlocked(int bodyID, int action, int direction, int frame, unsigned int hueIndex, UOAnimFrameInfo* frameInfo)
 {
+    if ((direction < 0) || (direction > 7))
+        return nullptr;
+    const bool mirrored = (direction > 4);
+    if (mirrored)
+        direction = 8 - direction;
+
+    UOAnimFrameInfo info = {};
+    QImage* img;
     if (m_UOAnimUOP.animExists(bodyID))
-        return m_UOAnimUOP.drawAnimFrame(bodyID, action, direction, frame, hueIndex);
+        img = m_UOAnimUOP.drawAnimFrame(bodyID, action, direction, frame, hueIndex, &info);
     else
-        return m_UOAnimMUL.drawAnimFrame(bodyID, action, direction, frame, hueIndex);
+        img = m_UOAnimMUL.drawAnimFrame(bodyID, action, direction, frame, hueIndex, &info);
+    if (img == nullptr)
+        return nullptr;
+
+    if (mirrored)
+    {
+        *img = img->mirrored(true, false);
+        info.xCenter = img->width() - info.xCenter;
+    }
+    if (frameInfo)
+        *frameInfo = info;
+    return img;
+}
+
+bool UOAnim::buildAnimAtlas(int bodyID, int action, int direction, unsigned int hueIndex, UOAnimAtlas* atlas)
+{
+    std::lock_guard<std::mutex> lock(m_drawMutex);
+
+    // Decode every frame, the first one tells us how many they are
+    std::vector<std::unique_ptr<QImage>> frameImages;
+    atlas->frames.clear();
+    UOAnimFrameInfo info = {};
+    frameImages.emplace_back(drawAnimFrameUnlocked(bodyID, action, direction, 0, hueIndex, &info));
+    if (frameImages.front() == nullptr)
+        return false;
+    const unsigned int framesCount = std::max(1u, info.framesCount);
+
+    int atlasWidth = 0, atlasHeight = 0;
+    for (unsigned int frame = 0; frame < framesCount; ++frame)
+    {
+        if (frame > 0)
+            frameImages.emplace_back(drawAnimFrameUnlocked(bodyID, action, direction, int(frame), hueIndex, &info));
+        const QImage* img = frameImages.back().get();
+        if (img == nullptr)
+        {
+            atlas->frames.push_back(UOAnimAtlas::Frame{atlasWidth, 0, 0, 0, 0});   // keep the frames numbering
+            continue;
+        }
+        atlas->frames.push_back(UOAnimAtlas::Frame{atlasWidth, img->width(), img->height(), info.xCenter, info.yCenter});
+        atlasWidth += img->width();
+        atlasHeight = std::max(atlasHeight, img->height());
+    }
+
+    // Pack the frames side by side, copying them row by row
+    atlas->image = std::make_shared<QImage>(atlasWidth, atlasHeight, QImage::Format_ARGB32);
+    atlas->image->fill(0);
+    for (size_t i = 0; i < frameImages.size(); ++i)
+    {
+        const QImage* img = frameImages[i].get();
+        if (img == nullptr)
+            continue;
+        const QImage frameImg = img->convertToFormat(QImage::Format_ARGB32);
+        const UOAnimAtlas::Frame& frame = atlas->frames[i];
+        for (int y = 0; y < frame.height; ++y)
+        {
+            memcpy(atlas->image->scanLine(y) + (frame.atlasX * 4), frameImg.constScanLine(y), size_t(frame.width) * 4);
+        }
+    }
+    return true;
 }
 
 
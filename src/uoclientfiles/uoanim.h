@@ -2,7 +2,11 @@
 #define UOANIM_H
 
 #include <functional>   // for std::function (callback)
+#include <memory>
+#include <mutex>
+#include <vector>
 
+#include "uobodydef.h"
 #include "uoanimmul.h"
 #include "uoanimuop.h"
 
@@ -16,17 +20,53 @@ namespace uocf
 class UOHues;
 
 
+struct UOAnimFrameInfo
+{
+    // The frame is drawn with the point (xCenter, yCenter + image height) over the position of the character
+    int xCenter;
+    int yCenter;
+    unsigned int framesCount;   // frames of the action, in each direction
+};
+
+// All the frames of an action (in a given direction), decoded and packed side by side in a single image
+struct UOAnimAtlas
+{
+    struct Frame
+    {
+        int atlasX;     // position of the frame in the atlas (the frames are top-aligned)
+        int width;
+        int height;
+        int xCenter;
+        int yCenter;
+    };
+
+    std::shared_ptr<QImage> image;
+    std::vector<Frame> frames;
+};
+
+
 class UOAnim
 {
 public:
     UOAnim(const std::string& clientPath, std::function<void(int)> reportProgress = nullptr);
-    QImage* drawAnimFrame(int bodyID, int action, int direction, int frame, unsigned int hueIndex);
+
+    // Directions 5, 6, 7 are drawn by mirroring the directions 3, 2, 1.
+    // Both methods can be called from different threads.
+    QImage* drawAnimFrame(int bodyID, int action, int direction, int frame, unsigned int hueIndex, UOAnimFrameInfo* frameInfo = nullptr);
+    bool buildAnimAtlas(int bodyID, int action, int direction, unsigned int hueIndex, UOAnimAtlas* atlas);
 
     void setCachePointers(UOHues* hues);
+    const UOBodyDef& getBodyDef() const {
+        return m_bodyDef;
+    }
 
 private:
+    UOBodyDef m_bodyDef;    // declared before the readers using it
     UOAnimMUL m_UOAnimMUL;
     UOAnimUOP m_UOAnimUOP;
+    std::mutex m_drawMutex; // the readers keep their own caches (and hues pointers), which aren't thread-safe
+
+    QImage* drawAnimFrameUnlocked(int bodyID, int action, int direction, int frame, unsigned int hueIndex, UOAnimFrameInfo* frameInfo);
 };
 
 
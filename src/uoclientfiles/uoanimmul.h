@@ -2,7 +2,10 @@
 #define UOANIMMUL_H
 
 #include <string>
-#include <map>
+#include <memory>
+
+#include "../cpputils/sysio.h"
+#include "uoidx.h"
 
 
 class QImage;
@@ -12,46 +15,36 @@ namespace uocf
 {
 
 class UOHues;
+class UOBodyDef;
+struct UOAnimFrameInfo;
 
 
 class UOAnimMUL
 {
-     struct BodyDefEntry
-    {
-        int newID = 0;
-        int newHue = 0;
-        BodyDefEntry(int NewID, int NewHue)
-        {
-            newID = NewID;
-            newHue = NewHue;
-        }
-    };
-    struct BodyConvDefEntry
-    {
-        int newID = 0;
-        int newFileNum = 0;
-        BodyConvDefEntry(int NewID, int NewFileNum)
-        {
-            newID = NewID;
-            newFileNum = NewFileNum;
-        }
-    };
 public:
     UOHues* m_UOHues;
 private:
     std::string m_clientPath;
 
-    std::map<int,BodyDefEntry>       m_bodyDef;       // lookup key (int): oldID
-    std::map<int,BodyConvDefEntry>   m_bodyConvDef;   // lookup key (int): oldID
-
-    bool loadBodyDef();
-    bool loadBodyConvDef();
+    const UOBodyDef* m_bodyDef;     // owned by UOAnim
 
-    unsigned int getBodyLookupIndex(int body, int action, int direction, int animFileNumber);   // return the in-file index of the anim we want to show
+    // anim.mul/idx, anim2.mul/idx, ..., anim5.mul/idx: the idx is cached, the mul is memory-mapped
+    //  (or, if it can't be mapped, each animation group is read from the file).
+    struct AnimFile
+    {
+        std::unique_ptr<UOIdx> idx;
+        MappedFile mul;
+        std::string mulPath;
+        size_t mulSize = 0;
+        bool unavailable = false;   // missing or unreadable files: don't try to load them again at every draw
+    };
+    AnimFile m_animFiles[5];
+    static const char* getAnimFileName(int animFileNumber);
+    AnimFile* getAnimFile(int animFileNumber);
 
 public:
-    UOAnimMUL(const std::string& clientPath);
-    QImage* drawAnimFrame(int bodyID, int action, int direction, int frame, unsigned int hueIndex);
+    UOAnimMUL(const std::string& clientPath, const UOBodyDef* bodyDef);
+    QImage* drawAnimFrame(int bodyID, int action, int direction, int frame, unsigned int hueIndex, UOAnimFrameInfo* frameInfo = nullptr);
 };
 
 
@@ -1,5 +1,10 @@
 #include "uoanimuop.h"
+#include "uoanim.h"     // for UOAnimFrameInfo
 
+#include <cstdint>
+#include <cstdio>       // for snprintf, remove
+#include <cstring>      // for memcpy, memcmp
+#include <fstream>
 #include <QImage>
 #include <QGraphicsPixmapItem>
 
@@ -16,7 +21,7 @@ namespace uocf
 {
 
 UOAnimUOP::UOAnimUOP(const std::string &clientPath, std::function<void(int)> reportProgress) :
-    m_UOHues(nullptr), m_clientPath(clientPath), m_animationsMatrix{{}}, m_isInitializing(false)
+    m_UOHues(nullptr), m_clientPath(clientPath), m_animationsMatrix{{}}, m_isInitializing(false), m_animGroupCacheBytes(0)
 {
     buildAnimTable(reportProgress);
 }
@@ -32,14 +37,28 @@ void UOAnimUOP::buildAnimTable(const std::function<void(int)>& reportProgress)
 
     // We need to know which animations are in the uop files
 
+    // If they didn't change since the last time, we already know it.
+    PackageStats packageStats[kAnimUOPCount] = {};
+    for (int uopFile_i = 1; uopFile_i <= kAnimUOPCount; ++uopFile_i)
+    {
+        PackageStats& curStats = packageStats[uopFile_i - 1];
+        if (!getFileStats(getPackagePath(uopFile_i), &curStats.size, &curStats.lastModified))
+            curStats = PackageStats{};
+    }
+    if (loadIndexCache(packageStats))
+    {
+        LOG("Loaded UOP animations table from " + getIndexCachePath());
+        m_isInitializing = false;
+        return;
+    }
+
     LOG("Building UOP animations table...");
-    int progressVal = 0;
 
     // Parse anim data in each AnimationFrame*.uop
-    const int uopFileCount = 4;
+    const int uopFileCount = kAnimUOPCount;
     for (int uopFile_i = 1; uopFile_i <= uopFileCount; ++uopFile_i)
     {
-        std::string path = m_clientPath + "AnimationFrame" + std::to_string(uopFile_i) + ".uop";
+        std::string path = getPackagePath(uopFile_i);
 
         if (!isValidFile(path))
         {
@@ -48,83 +67,194 @@ void UOAnimUOP::buildAnimTable(const std::function<void(int)>& reportProgress)
         }
 
         // Read the data in order to access later to each file by its hash
-        m_animUOPs[uopFile_i - 1] = std::make_unique<uopp::UOPPackage>();
-        uopp::UOPPackage* package = m_animUOPs[uopFile_i - 1].get();
-        uopp::UOPError uopErrorQueue;
-        package->load(path, &uopErrorQueue);
-        if (uopErrorQueue.errorOccurred())   // check if there was an error when extracting the uop file
-        {
-            LOG("UOPPackage error!");
-            LOG(uopErrorQueue.buildErrorsString());
+        if (getAnimPackage(uopFile_i) == nullptr)
             return;
-        }
-
-        for (unsigned block_i = 0, block_max = package->getBlocksCount(); block_i < block_max; ++block_i)
-        {
-            const uopp::UOPBlock* curBlock = package->getBlock(block_i);
-            for (unsigned file_i = 0, file_max = curBlock->getFilesCount(); file_i < file_max; ++file_i)
-            {
-                const uopp::UOPFile* curFile = curBlock->getFile(file_i);
-                UOPAnimationData data = {};
-                data.animFileIdx = uopFile_i;
-                data.blockIdx = block_i;
-                data.fileIdx = file_i;
-                data.hash = curFile->getFileHash();
-                m_animationsData.emplace_back(std::move(data));
-            }
-
-            // it's so fast we can even do not report progress (or use OpenMP)...
-            /*
-            int progressValNow = ( ((block_i*100)/(block_max-1)) / (uopFileCount - uopFile_i + 1) );
-            if ( reportProgress && (progressValNow > progressVal) )
-            {
-                progressVal = progressValNow;
-                reportProgress(progressVal);    // it's a bit of a mess to pass the progress to the main Qt thread...
-            }
-            */
-        }
     }
 
     // Find the groups for each animation we have found
     //  (groups are different actions but they do not have sequential numbers)
 
-    progressVal = 0;
+    // First, hash every candidate name. This is the expensive part, and each name is independent from the others.
+    const int cellsCount = kAnimIdMax * kGroupIdMax;
+    std::vector<unsigned long long> cellHashes(size_t(cellsCount), 0);
+    #pragma omp parallel for schedule(static)   // split the workload between some threads with OpenMP!
+    for (int cell = 0; cell < cellsCount; ++cell)
+    {
+        const int animId = cell / kGroupIdMax, groupId = cell % kGroupIdMax;
+        char hashString[100];
+        snprintf(hashString, sizeof(hashString), "build/animationlegacyframe/%06i/%02i.bin", animId, groupId);
+        cellHashes[size_t(cell)] = uopp::hashFileName(hashString);
+    }
+    if (reportProgress)
+        reportProgress(50);
 
-    // It would be more logical to have animId as outer loop and groupId as inner loop, but the kGroupIdMax is < than kAnimIdMax,
-    //  so this way we assign work to the OpenMP threads (in its thread pool) less often (dunno if it actually causes overhead, but who knows...)
-    for (int groupId = 0; groupId < kGroupIdMax; ++groupId)
+    // Then look them up in the packages hash tables: each probe is O(1). If the same file is in more packages, the first one wins.
+    std::vector<int> foundCells;
+    for (int cell = 0; cell < cellsCount; ++cell)
     {
-        #pragma omp parallel for schedule(static)   // split the workload between some threads with OpenMP!
-        for (int animId = 0; animId < kAnimIdMax; ++animId)
+        for (int uopFile_i = 1; uopFile_i <= uopFileCount; ++uopFile_i)
         {
-            char hashString[100];
-            snprintf(hashString, sizeof(hashString), "build/animationlegacyframe/%06i/%02i.bin", animId, groupId);
-            unsigned long long hash = uopp::hashFileName(hashString);
-            int found = -1;
-            for (int i = 0, max = (int)m_animationsData.size(); i < max; ++i)
-            {
-                if (m_animationsData[i].hash == hash)
-                {
-                    found = i;
-                    break;
-                }
-            }
-            if (found != -1)
-               m_animationsMatrix[animId][groupId] = &m_animationsData[found];
+            const uopp::UOPPackage* package = m_animUOPs[uopFile_i - 1].get();
+            unsigned int block_i, file_i;
+            if (!package || !package->searchByHash(cellHashes[size_t(cell)], &block_i, &file_i))
+                continue;
+            UOPAnimationData data = {};
+            data.animFileIdx = uopFile_i;
+            data.blockIdx = block_i;
+            data.fileIdx = file_i;
+            data.hash = cellHashes[size_t(cell)];
+            m_animationsData.emplace_back(std::move(data));
+            foundCells.emplace_back(cell);
+            break;
         }
+    }
+
+    // m_animationsData won't be resized anymore, so now we can store the pointers to its elements
+    for (size_t i = 0; i < foundCells.size(); ++i)
+        m_animationsMatrix[foundCells[i] / kGroupIdMax][foundCells[i] % kGroupIdMax] = &m_animationsData[i];
+    if (reportProgress)
+        reportProgress(100);
 
-        if (reportProgress)
+    saveIndexCache(packageStats);
+    m_isInitializing = false;
+}
+
+std::string UOAnimUOP::getPackagePath(int animFileIdx) const
+{
+    return m_clientPath + "AnimationFrame" + std::to_string(animFileIdx) + ".uop";
+}
+
+uopp::UOPPackage* UOAnimUOP::getAnimPackage(int animFileIdx)
+{
+    // If the table was loaded from the cache, the packages are read only when we need to draw a frame from them.
+    std::unique_ptr<uopp::UOPPackage>& package = m_animUOPs[animFileIdx - 1];
+    if (package)
+        return package.get();
+
+    auto newPackage = std::make_unique<uopp::UOPPackage>();
+    uopp::UOPError uopErrorQueue;
+    newPackage->load(getPackagePath(animFileIdx), &uopErrorQueue);
+    if (uopErrorQueue.errorOccurred())   // check if there was an error when extracting the uop file
+    {
+        LOG("UOPPackage error!");
+        LOG(uopErrorQueue.buildErrorsString());
+        return nullptr;
+    }
+    newPackage->mapPackageFile();   // if it fails, loadFrameData falls back to reading from file streams
+
+    package = std::move(newPackage);
+    return package.get();
+}
+
+
+// Sidecar cache file layout: header, then entriesCount entries. Data is stored in the native (little endian) byte order.
+struct AnimIndexCacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t animIdMax;
+    uint32_t groupIdMax;
+    uint32_t entriesCount;
+    uint64_t packageSizes[4];
+    int64_t packageLastModified[4];
+};
+struct AnimIndexCacheEntry
+{
+    uint32_t cell;          // animId * kGroupIdMax + groupId
+    uint32_t animFileIdx;
+    uint32_t blockIdx;
+    uint32_t fileIdx;
+    uint64_t hash;
+};
+static constexpr char kAnimIndexCacheMagic[8] = {'L','V','A','N','I','M','I','X'};
+static constexpr uint32_t kAnimIndexCacheVersion = 1;
+
+std::string UOAnimUOP::getIndexCachePath() const
+{
+    // Stored in the working directory like our other settings files, with a different file for each client folder.
+    char fileName[64];
+    snprintf(fileName, sizeof(fileName), "UOPAnimIndex_%016llx.cache", uopp::hashFileName(m_clientPath));
+    return fileName;
+}
+
+bool UOAnimUOP::loadIndexCache(const PackageStats (&packageStats)[kAnimUOPCount])
+{
+    MappedFile cacheFile;
+    if (!cacheFile.open(getIndexCachePath()) || (cacheFile.size() < sizeof(AnimIndexCacheHeader)))
+        return false;
+
+    AnimIndexCacheHeader header;
+    memcpy(&header, cacheFile.data(), sizeof(header));
+    if ((memcmp(header.magic, kAnimIndexCacheMagic, sizeof(header.magic)) != 0) || (header.version != kAnimIndexCacheVersion) ||
+        (header.animIdMax != kAnimIdMax) || (header.groupIdMax != kGroupIdMax) ||
+        (cacheFile.size() != sizeof(AnimIndexCacheHeader) + (size_t(header.entriesCount) * sizeof(AnimIndexCacheEntry))))
+    {
+        return false;
+    }
+    for (int i = 0; i < kAnimUOPCount; ++i)
+    {
+        if ((header.packageSizes[i] != packageStats[i].size) || (header.packageLastModified[i] != packageStats[i].lastModified))
+            return false;
+    }
+
+    std::vector<UOPAnimationData> animationsData(header.entriesCount);
+    std::vector<uint32_t> cells(header.entriesCount);
+    const char* entryPtr = cacheFile.data() + sizeof(AnimIndexCacheHeader);
+    for (uint32_t i = 0; i < header.entriesCount; ++i, entryPtr += sizeof(AnimIndexCacheEntry))
+    {
+        AnimIndexCacheEntry entry;
+        memcpy(&entry, entryPtr, sizeof(entry));
+        if ((entry.cell >= uint32_t(kAnimIdMax * kGroupIdMax)) || (entry.animFileIdx < 1) || (entry.animFileIdx > kAnimUOPCount))
+            return false;
+        cells[i] = entry.cell;
+        animationsData[i] = UOPAnimationData{int(entry.animFileIdx), entry.blockIdx, entry.fileIdx, entry.hash};
+    }
+
+    m_animationsData = std::move(animationsData);
+    for (size_t i = 0; i < cells.size(); ++i)
+        m_animationsMatrix[cells[i] / kGroupIdMax][cells[i] % kGroupIdMax] = &m_animationsData[i];
+    return true;
+}
+
+void UOAnimUOP::saveIndexCache(const PackageStats (&packageStats)[kAnimUOPCount]) const
+{
+    AnimIndexCacheHeader header = {};
+    memcpy(header.magic, kAnimIndexCacheMagic, sizeof(header.magic));
+    header.version = kAnimIndexCacheVersion;
+    header.animIdMax = kAnimIdMax;
+    header.groupIdMax = kGroupIdMax;
+    header.entriesCount = uint32_t(m_animationsData.size());
+    for (int i = 0; i < kAnimUOPCount; ++i)
+    {
+        header.packageSizes[i] = packageStats[i].size;
+        header.packageLastModified[i] = packageStats[i].lastModified;
+    }
+
+    std::vector<AnimIndexCacheEntry> entries(m_animationsData.size());
+    for (int animId = 0; animId < kAnimIdMax; ++animId)
+    {
+        for (int groupId = 0; groupId < kGroupIdMax; ++groupId)
         {
-            int progressValNow = ( (groupId*100)/kGroupIdMax );
-            if ( progressValNow > progressVal )
-            {
-                progressVal = progressValNow;
-                reportProgress(progressVal);
-            }
+            const UOPAnimationData* data = m_animationsMatrix[animId][groupId];
+            if (data == nullptr)
+                continue;
+            const size_t i = size_t(data - m_animationsData.data());
+            entries[i] = AnimIndexCacheEntry{uint32_t(animId * kGroupIdMax + groupId), uint32_t(data->animFileIdx),
+                                             uint32_t(data->blockIdx), uint32_t(data->fileIdx), data->hash};
         }
+    }
 
+    const std::string cachePath = getIndexCachePath();
+    std::ofstream fout(cachePath, std::ios::out | std::ios::binary | std::ios::trunc);
+    fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    fout.write(reinterpret_cast<const char*>(entries.data()), std::streamsize(entries.size() * sizeof(AnimIndexCacheEntry)));
+    if (!fout.good())
+    {
+        // Not fatal: we'll just build the table again at the next launch.
+        fout.close();
+        remove(cachePath.c_str());
+        LOG("Can't write the UOP animations table cache " + cachePath);
     }
-    m_isInitializing = false;
 }
 
 bool UOAnimUOP::animExists(int animID)
@@ -140,39 +270,90 @@ bool UOAnimUOP::animExists(int animID)
     return false;
 }
 
-UOAnimUOP::UOPFrameData UOAnimUOP::loadFrameData(int animID, int groupID, int direction, int frame, std::vector<char>* decompressedData)
+const UOAnimUOP::UOPAnimGroup* UOAnimUOP::getAnimGroup(int animID, int groupID)
+{
+    for (auto it = m_animGroupCache.begin(); it != m_animGroupCache.end(); ++it)
+    {
+        if ((it->animID == animID) && (it->groupID == groupID))
+        {
+            m_animGroupCache.splice(m_animGroupCache.begin(), m_animGroupCache, it);   // move it to the front
+            return &m_animGroupCache.front();
+        }
+    }
+
+    UOPAnimGroup group;
+    if (!loadAnimGroup(animID, groupID, &group))
+        return nullptr;
+
+    m_animGroupCacheBytes += group.decompressedData.size();
+    m_animGroupCache.emplace_front(std::move(group));
+
+    // Evict the least recently used groups, but always keep the one we have just loaded
+    while ((m_animGroupCacheBytes > kAnimGroupCacheMaxBytes) && (m_animGroupCache.size() > 1))
+    {
+        m_animGroupCacheBytes -= m_animGroupCache.back().decompressedData.size();
+        m_animGroupCache.pop_back();
+    }
+    return &m_animGroupCache.front();
+}
+
+bool UOAnimUOP::loadAnimGroup(int animID, int groupID, UOPAnimGroup* group)
 {
     if (isInitializing())
-        return UOPFrameData{};
+        return false;
 
     UOPAnimationData* animData = m_animationsMatrix[animID][groupID];
+    if (animData == nullptr)
+        return false;
 
     // extract selected frame data from the UOP in memory
-    std::unique_ptr<uopp::UOPPackage>& animPkg = m_animUOPs[animData->animFileIdx - 1];
-    uopp::UOPFile* animFile = animPkg->getFileByIndex(animData->blockIdx, animData->fileIdx);
+    uopp::UOPPackage* animPkg = getAnimPackage(animData->animFileIdx);
+    if (animPkg == nullptr)
+        return false;
+    uopp::UOPFile* animFile = animPkg->getFileByIndex(unsigned(animData->blockIdx), unsigned(animData->fileIdx));
+    if ((animFile == nullptr) || (animFile->getFileHash() != animData->hash))
+    {
+        // The package was modified keeping the same size and timestamp, so the cached position is stale: search it again.
+        unsigned int block_i, file_i;
+        if (!animPkg->searchByHash(animData->hash, &block_i, &file_i))
+            return false;
+        animFile = animPkg->getFileByIndex(block_i, file_i);
+    }
 
-    unsigned int decDataSize = animFile->getDecompressedSize();
-    decompressedData->resize(decDataSize);
+    group->animID = animID;
+    group->groupID = groupID;
+    std::vector<char>* decompressedData = &group->decompressedData;
 
     uopp::UOPError uopErrorQueue;
-    std::ifstream fin = animPkg->getOpenedStream();
-    animFile->readPackedData(fin, &uopErrorQueue);
-    fin.close();
-    animFile->unpack(decompressedData, &uopErrorQueue);
-    animFile->freePackedData();
+    if (animPkg->isMapped())
+    {
+        // Inflate straight from the package mapping, without opening a stream for each request
+        animFile->unpack(decompressedData, &uopErrorQueue);
+    }
+    else
+    {
+        std::ifstream fin = animPkg->getOpenedStream();
+        animFile->readPackedData(fin, &uopErrorQueue);
+        fin.close();
+        animFile->unpack(decompressedData, &uopErrorQueue);
+        animFile->freePackedData();
+    }
 
     if (uopErrorQueue.errorOccurred())   // check if there was an error when extracting the uop file
     {
         LOG("UOPPackage error!");
         LOG(uopErrorQueue.buildErrorsString());
-        return UOPFrameData{};
+        return false;
     }
 
     const char* decData = decompressedData->data();
+    const size_t decDataSize = decompressedData->size();
     size_t decDataOff = 0;
 
     // read frame header
-
+    static constexpr size_t kHeaderSize = 40;
+    if (decDataSize < kHeaderSize)
+        return false;
     //format id?
     decDataOff += 4;
     //version
@@ -198,6 +379,9 @@ UOAnimUOP::UOPFrameData UOAnimUOP::loadFrameData(int animID, int groupID, int di
     uint frameAddress = 0;
     memcpy(&frameAddress, decData + decDataOff, 4);
 
+    // each frame header is 16 bytes long
+    if ((frameAddress > decDataSize) || (frameCount > (decDataSize - frameAddress) / 16))
+        return false;
     decDataOff = frameAddress;
 
 
@@ -205,8 +389,8 @@ UOAnimUOP::UOPFrameData UOAnimUOP::loadFrameData(int animID, int groupID, int di
 
     //  each frame of an animation (with given animID and groupID) has an header. the headers are stored sequentially
     //  and separatedly from the pixel data.
-    std::vector<UOPFrameData> frameDataVec;
-
+    group->frames.clear();
+    group->frames.reserve(frameCount);
     for (unsigned int frame_i = 0; frame_i < frameCount; ++frame_i)
     {
         UOPFrameData curFrameData;
@@ -223,40 +407,16 @@ UOAnimUOP::UOPFrameData UOAnimUOP::loadFrameData(int animID, int groupID, int di
         memcpy(&curFrameData.pixelDataOffset, decData + decDataOff, 4);
         decDataOff += 4;
 
-        /*
-        int vsize = frameDataVec.size();
-        if (vsize + 1 != curFrameData.frameId)
-        {
-            while (vsize + 1 != curFrameData.frameId)
-            {
-                frameDataVec.push_back(UOPFrameData{ });
-                ++vsize;
-            }
-        }
-        */
-        frameDataVec.emplace_back(std::move(curFrameData));
-    }
-    int vectorSize = (int)frameDataVec.size();
-    if (vectorSize < 50)
-    {
-        while (vectorSize != 50)
-        {
-            frameDataVec.emplace_back(UOPFrameData{ });
-            ++vectorSize;
-        }
+        group->frames.emplace_back(std::move(curFrameData));
     }
 
-    //unsigned dirFrameCount = pixelDataOffsets.size() / 5;   // 5 = number of directions
-    //unsigned dirFrameStartIdx = dirFrameCount * direction;
-    unsigned dirFrameStartIdx = (frameCount / 5) * direction;
-
-    // select the frame i want to display
-    UOPFrameData &frameData = frameDataVec[frame + dirFrameStartIdx];
-    return frameData;
+    // The frames are stored direction after direction (5 directions, the other 3 are mirrored)
+    group->framesPerDirection = frameCount / 5;
+    return true;
 }
 
 
-QImage* UOAnimUOP::drawAnimFrame(int bodyID, int action, int direction, int frame, unsigned int hueIndex)
+QImage* UOAnimUOP::drawAnimFrame(int bodyID, int action, int direction, int frame, unsigned int hueIndex, UOAnimFrameInfo* frameInfo)
 {
     if (isInitializing())
         return nullptr;
@@ -276,15 +436,25 @@ QImage* UOAnimUOP::drawAnimFrame(int bodyID, int action, int direction, int fram
             return nullptr;
     }
 
-    // get from the UOP file the raw frame data (which has the same encoding as the MUL frame data)
-    std::vector<char> decompressedData;    // buffer filled by loadFrameData, it will contain the decompressed animation data
-    UOPFrameData frameData = loadFrameData(bodyID, groupID, direction, frame, &decompressedData);
+    // get from the UOP file the raw frame data (which has the same encoding as the MUL frame data).
+    //  The decompressed group stays cached, so the other frames of this action won't need to be inflated again.
+    const UOPAnimGroup* animGroup = getAnimGroup(bodyID, groupID);
+    if (animGroup == nullptr)
+        return nullptr;
+    if ((frame < 0) || (direction < 0) || (unsigned(frame) >= animGroup->framesPerDirection))
+        return nullptr;
+    const size_t frameIdx = (animGroup->framesPerDirection * unsigned(direction)) + unsigned(frame);
+    if (frameIdx >= animGroup->frames.size())
+        return nullptr;
+    const UOPFrameData& frameData = animGroup->frames[frameIdx];
     if (frameData.pixelDataOffset == 0) // uninitialized --> error
         return nullptr;
 
-    const char* decData = decompressedData.data();
+    const char* decData = animGroup->decompressedData.data();
     size_t decDataOff = frameData.dataStart + frameData.pixelDataOffset;
-    size_t decDataSize = decompressedData.size();     // size of the decompressed data (in bytes)
+    size_t decDataSize = animGroup->decompressedData.size();     // size of the decompressed data (in bytes)
+    if (decDataOff + 512 + 8 > decDataSize)     // palette + frame header
+        return nullptr;
 
     int16_t palette[256];
     memcpy(&palette, decData + decDataOff, 512);
@@ -307,13 +477,15 @@ QImage* UOAnimUOP::drawAnimFrame(int bodyID, int action, int direction, int fram
 
     if (height == 0 || width == 0 || height > 800 || width > 800)
         return nullptr;
+    if (frameInfo)
+        *frameInfo = UOAnimFrameInfo{xCenter, yCenter, animGroup->framesPerDirection};
 
     QImage* img = new QImage((int)width, (int)height, QImage::Format_ARGB32);
     img->fill(0);
 
     bool applyToGrayOnly = false;   //(hueIndex & 0x8000) != 0;
 
-    while ( decDataOff < decDataSize )
+    while ( decDataOff + 4 <= decDataSize )
     {
         // For the header structure read inside UOAnimMUL.cpp
         uint32_t header = 0;
@@ -334,8 +506,11 @@ QImage* UOAnimUOP::drawAnimFrame(int bodyID, int action, int direction, int fram
         int X = xOffset + xCenter;
         int Y = yOffset + yCenter + height;
 
-        if (X < 0 || Y < 0 || Y >= height || X >= width)
+        if (X < 0 || Y < 0 || Y >= height || X >= width || (decDataOff + xRun > decDataSize))
+        {
+            decDataOff += xRun;     // skip this run's pixels
             continue;
+        }
 
         for ( unsigned k = 0; k < xRun; ++k )
         {
@@ -4,6 +4,7 @@
 #include <string>
 #include <vector>
 #include <functional>   // for std::function (callback)
+#include <list>
 #include <memory>
 
 
@@ -17,6 +18,7 @@ namespace uocf
 {
 
 class UOHues;
+struct UOAnimFrameInfo;
 
 
 class UOAnimUOP
@@ -36,6 +38,16 @@ class UOAnimUOP
         unsigned int pixelDataOffset = 0;
     };
 
+    // A decompressed animation group (all the frames of an action, for every direction), with its parsed frame table
+    struct UOPAnimGroup
+    {
+        int animID;
+        int groupID;
+        std::vector<char> decompressedData;
+        std::vector<UOPFrameData> frames;   // sorted by direction, then by frame
+        unsigned int framesPerDirection;
+    };
+
 public:
     UOAnimUOP(const std::string& clientPath, std::function<void (int)> reportProgress);
     ~UOAnimUOP();
@@ -44,12 +56,13 @@ public:
         return m_isInitializing;
     }
     bool animExists(int animID);
-    QImage* drawAnimFrame(int bodyID, int action, int direction, int frame, unsigned int hueIndex);
+    QImage* drawAnimFrame(int bodyID, int action, int direction, int frame, unsigned int hueIndex, UOAnimFrameInfo* frameInfo = nullptr);
 
     UOHues* m_UOHues;
 private:
     std::string m_clientPath;
-    std::unique_ptr<uopp::UOPPackage> m_animUOPs[4];
+    static const int kAnimUOPCount = 4;     // AnimationFrame1.uop to AnimationFrame4.uop
+    std::unique_ptr<uopp::UOPPackage> m_animUOPs[kAnimUOPCount];  // loaded only when needed (see getAnimPackage)
     std::vector<UOPAnimationData> m_animationsData;
 
     // sort animationsData by [animID][groupID]:
@@ -58,8 +71,28 @@ private:
     UOPAnimationData* m_animationsMatrix[kAnimIdMax][kGroupIdMax];  // the matrix is thread-safe if we aren't writing in the same position in different threads
     bool m_isInitializing;
 
+    struct PackageStats
+    {
+        unsigned long long size;
+        long long lastModified;
+    };
+
+    // The last decompressed groups are kept, so drawing the next frame of the same action costs only its pixel decoding
+    static const size_t kAnimGroupCacheMaxBytes = 64 * 1024 * 1024;
+    std::list<UOPAnimGroup> m_animGroupCache;   // most recently used first
+    size_t m_animGroupCacheBytes;
+
     void buildAnimTable(const std::function<void(int)>& reportProgress);
-    UOPFrameData loadFrameData(int animID, int groupID, int direction, int frame, std::vector<char>* decompressedData);
+    std::string getPackagePath(int animFileIdx) const;
+    uopp::UOPPackage* getAnimPackage(int animFileIdx);
+
+    // The resolved table is saved in a small sidecar file, which is valid as long as the packages keep the same size and
+    //  modification time. This way, at the next launch we don't need to read the packages to know which animations we have.
+    std::string getIndexCachePath() const;
+    bool loadIndexCache(const PackageStats (&packageStats)[kAnimUOPCount]);
+    void saveIndexCache(const PackageStats (&packageStats)[kAnimUOPCount]) const;
+    const UOPAnimGroup* getAnimGroup(int animID, int groupID);
+    bool loadAnimGroup(int animID, int groupID, UOPAnimGroup* group);
 };
 
 
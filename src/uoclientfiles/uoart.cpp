@@ -1,7 +1,6 @@
 #include "uoart.h"
 
 #include <fstream>
-#include <QFileInfo>
 #include <QImage>
 
 #include "../cpputils/sysio.h"
@@ -18,40 +17,130 @@ namespace uocf
 {
 
 UOArt::UOArt(const std::string &clientPath, UOHues *hues) :
-    m_clientPath(clientPath), m_lastFileType(ClientFileType::Uninitialized), m_UOHues(hues)
+    m_clientPath(clientPath), m_artFileType(ClientFileType::Uninitialized), m_UOHues(hues)
 {
+    resetFileIdTables();
 }
 
 UOArt::~UOArt() = default;
 
 void UOArt::setCachePointers(UOHues* hues)
 {
+    // This is called before every draw, but the pointer changes only when the client files are reloaded: only then check,
+    //  at the next draw, if the packages need to be reloaded too.
+    if (hues != m_UOHues)
+        resetFileIdTables();
     m_UOHues = hues;
 }
 
+void UOArt::resetFileIdTables()
+{
+    for (int i = 0; i < kClientFileTypeCount; ++i)
+    {
+        m_fileIdTables[i] = nullptr;
+        m_fileIdTablePackages[i] = nullptr;
+    }
+}
+
 QImage* UOArt::drawArt(unsigned int id, unsigned int hueIndex, bool partialHue)
 {
-    std::string EC_UOPPath = m_clientPath + kEC_UOPFile;
-    if (isValidFile(EC_UOPPath))
-        return drawArtEnhanced(false, id, hueIndex, partialHue);
+    // Pick the newer art file format only once, instead of checking which files exist at every draw.
+    //  It's resolved again only if the chosen package becomes unavailable.
+    if (m_artFileType == ClientFileType::Uninitialized)
+        m_artFileType = detectArtFileType();
+
+    switch (m_artFileType)
+    {
+        case ClientFileType::TextureUOP:        return drawArtEnhanced(false, id, hueIndex, partialHue);
+        case ClientFileType::LegacyTextureUOP:  return drawArtEnhanced(true, id, hueIndex, partialHue);
+        case ClientFileType::ArtLegacyMulUOP:   return drawArtClassic(true, id, hueIndex, partialHue);
+        default:                                return drawArtClassic(false, id, hueIndex, partialHue);
+    }
+}
+
+UOArt::ClientFileType UOArt::detectArtFileType() const
+{
+    if (isValidFile(m_clientPath + kEC_UOPFile))
+        return ClientFileType::TextureUOP;
+    if (isValidFile(m_clientPath + kEC_LegacyUOPFile))
+        return ClientFileType::LegacyTextureUOP;
+    if (isValidFile(m_clientPath + kCC_UOPFile))
+        return ClientFileType::ArtLegacyMulUOP;
+    return ClientFileType::ArtMUL;
+}
+
+void UOArt::unloadUOPPackages()
+{
+    resetFileIdTables();
+    m_uopPackages.clear();
+    m_artFileType = ClientFileType::Uninitialized;  // the art files may change, check again at the next draw which files we have
+}
 
-    std::string EC_LegacyUOPPath = m_clientPath + kEC_LegacyUOPFile;
-    if (isValidFile(EC_LegacyUOPPath))
-        return drawArtEnhanced(true, id, hueIndex, partialHue);
+const char* UOArt::getUOPFileName(ClientFileType fileType) // static
+{
+    switch (fileType)
+    {
+        case ClientFileType::TextureUOP:        return kEC_UOPFile;
+        case ClientFileType::LegacyTextureUOP:  return kEC_LegacyUOPFile;
+        case ClientFileType::ArtLegacyMulUOP:   return kCC_UOPFile;
+        default:                                return "";
+    }
+}
 
-    std::string CC_UOPPath = m_clientPath + kCC_UOPFile;
-    if (isValidFile(CC_UOPPath))
-        return drawArtClassic(true, id, hueIndex, partialHue);
+const char* UOArt::getUOPFileNameFormat(ClientFileType fileType) // static
+{
+    switch (fileType)
+    {
+        case ClientFileType::TextureUOP:        return "build/worldart/%08u.dds";
+        case ClientFileType::LegacyTextureUOP:  return "build/tileartlegacy/%08u.dds";
+        case ClientFileType::ArtLegacyMulUOP:   return "build/artlegacymul/%08u.tga";
+        default:                                return "";
+    }
+}
 
-    return drawArtClassic(false, id, hueIndex, partialHue);
+uopp::UOPFile* UOArt::getUOPFile(ClientFileType fileType, unsigned int id, uopp::UOPPackage** package, uopp::UOPError* uopError)
+{
+    // The package stays loaded alongside the others, and it's reloaded only if the file has changed.
+    // Along with it, the cache keeps an id -> file table, so we don't need to build and hash the packed file name at every draw.
+    //  Once resolved, the table is kept here, so that the following draws don't even need to build the package path and stat it.
+    const int typeIdx = int(fileType);
+    const UOPPackageCache::FileIdTable* fileIdTable = m_fileIdTables[typeIdx];
+    if (fileIdTable == nullptr)
+    {
+        unsigned int idCount = kEC_IdCount;
+        if (fileType == ClientFileType::ArtLegacyMulUOP)
+            idCount = kCC_IdCount;
+        fileIdTable = m_uopPackages.getFileIdTable(m_clientPath + getUOPFileName(fileType), getUOPFileNameFormat(fileType), idCount,
+                                                   &m_fileIdTablePackages[typeIdx], uopError);
+        if (fileIdTable == nullptr)
+        {
+            m_artFileType = ClientFileType::Uninitialized;  // check again at the next draw which files we have
+            if (package)
+                *package = nullptr;
+            return nullptr;
+        }
+        m_fileIdTables[typeIdx] = fileIdTable;
+    }
+    if (package)
+        *package = m_fileIdTablePackages[typeIdx];
+    return (id < fileIdTable->size()) ? (*fileIdTable)[id] : nullptr;
 }
 
-void UOArt::loadUOP(ClientFileType fileType, const QDateTime &lastModified, const std::string& uopPath, uopp::UOPError *uopError)
+// static
+bool UOArt::unpackUOPFile(uopp::UOPPackage* package, uopp::UOPFile* file, std::vector<char>* buffer, uopp::UOPDataView* view, uopp::UOPError* uopError)
 {
-    m_lastFileType = fileType;
-    m_uopLastModified = lastModified;
-    m_uopPackage = std::make_unique<uopp::UOPPackage>();
-    m_uopPackage->load(uopPath, uopError);
+    // If the package is mapped in memory, uncompressed files are accessed straight from the mapping,
+    //  the compressed ones are inflated from the mapping into the buffer.
+    if (package->isMapped())
+        return file->unpackView(buffer, view, uopError);
+
+    // Otherwise, read the packed data, unpack it into the buffer and free it, since it would be otherwise held by the UOPFile
+    //  until the package is unloaded.
+    std::ifstream fin = package->getOpenedStream();
+    const bool unpacked = fin.is_open() && file->readPackedData(fin, uopError) && file->unpack(buffer, uopError);
+    file->freePackedData();
+    *view = unpacked ? uopp::UOPDataView{buffer->data(), buffer->size()} : uopp::UOPDataView{nullptr, 0};
+    return unpacked;
 }
 
 QImage* UOArt::drawArtEnhanced(bool drawLegacy, unsigned int id, unsigned int hueIndex, bool partialHue)
@@ -64,17 +153,12 @@ QImage* UOArt::drawArtEnhanced(bool drawLegacy, unsigned int id, unsigned int hu
         id -= kItemsOffset;
 
     uopp::UOPError uopError;
+    uopp::UOPPackage* uopPackage = nullptr;
     uopp::UOPFile* uopFile = nullptr;
     if (!drawLegacy)
     {
         // Try to retrieve the TextureUOP image. If the image is missing, load it from the LegacyTextureUOP file
-        std::string uopPath_EnhancedTexture = m_clientPath + kEC_UOPFile;
-        QDateTime lastModified = QFileInfo(uopPath_EnhancedTexture.c_str()).lastModified();
-        if ((m_lastFileType != ClientFileType::TextureUOP) || (lastModified != m_uopLastModified))
-            loadUOP(ClientFileType::TextureUOP, lastModified, uopPath_EnhancedTexture, &uopError);
-
-        std::string packedFileName_EnhancedTexture = QString("build/worldart/%1.dds").arg(id, 8, 10, QChar('0')).toStdString();
-        uopFile = m_uopPackage->getFileByName(packedFileName_EnhancedTexture);
+        uopFile = getUOPFile(ClientFileType::TextureUOP, id, &uopPackage, &uopError);
         if (uopFile == nullptr)
         {
             // Not found from TextureUOP. Actually there's not a 1:1 correspondence between CC and EC art texture IDs,
@@ -85,38 +169,33 @@ QImage* UOArt::drawArtEnhanced(bool drawLegacy, unsigned int id, unsigned int hu
     }
     if (drawLegacy)
     {
-        std::string uopPath_LegacyTexture = m_clientPath + kEC_LegacyUOPFile;
-        QDateTime lastModified = QFileInfo(uopPath_LegacyTexture.c_str()).lastModified();
-        if ((m_lastFileType != ClientFileType::LegacyTextureUOP) || (lastModified != m_uopLastModified))
-            loadUOP(ClientFileType::LegacyTextureUOP, lastModified, uopPath_LegacyTexture, &uopError);
-
-        std::string packedFileName_LegacyTexture = QString("build/tileartlegacy/%1.dds").arg(id, 8, 10, QChar('0')).toStdString();
-        uopFile = m_uopPackage->getFileByName(packedFileName_LegacyTexture);
+        uopFile = getUOPFile(ClientFileType::LegacyTextureUOP, id, &uopPackage, &uopError);
     }
 
+    const char* uopFileName = getUOPFileName(drawLegacy ? ClientFileType::LegacyTextureUOP : ClientFileType::TextureUOP);
     if (uopFile == nullptr)
     {
-        LOG(QString("Error looking up %1 (requested id %2).").arg( (m_lastFileType == ClientFileType::TextureUOP ? kEC_UOPFile : kCC_UOPFile), id ).toStdString());
+        LOG(QString("Error looking up %1 (requested id %2).").arg(uopFileName).arg(id).toStdString());
         LOG(uopError.buildErrorsString());
         return nullptr;
     }
-    std::ifstream fin = m_uopPackage->getOpenedStream();
-    if (fin.bad())
+
+    // Compressed textures are inflated in our reusable scratch buffer, the others are decoded directly from the package mapping.
+    uopp::UOPDataView DDSData{nullptr, 0};
+    if (!unpackUOPFile(uopPackage, uopFile, &m_scratchBuffer, &DDSData, &uopError))
     {
-        LOG(QString("Error seeking from %1 (requested id %2).").arg( (m_lastFileType == ClientFileType::TextureUOP ? kEC_UOPFile : kCC_UOPFile), id ).toStdString());
+        LOG(QString("Error unpacking from %1 (requested id %2).").arg(uopFileName).arg(id).toStdString());
         LOG(uopError.buildErrorsString());
         return nullptr;
     }
 
-    auto* decompressedDataVec = new std::vector<char>();
-    if (!uopFile->readPackedData(fin, &uopError) || !uopFile->unpack(decompressedDataVec, &uopError))
+    if (DDSData.size < DDSInfo::kImageDataStartOffset)
     {
-        LOG(QString("Error unpacking from %1 (requested id %2).").arg( (m_lastFileType == ClientFileType::TextureUOP ? kEC_UOPFile : kCC_UOPFile), id ).toStdString());
-        LOG(uopError.buildErrorsString());
+        LOG(QString("Invalid DDS texture in %1 (requested id %2).").arg(uopFileName).arg(id).toStdString());
         return nullptr;
     }
 
-    const char* DDSDataPtr = decompressedDataVec->data();
+    const char* DDSDataPtr = DDSData.data;
     DDSInfo texInfo(DDSDataPtr);
     if (!texInfo.errorString.empty())
     {
@@ -124,27 +203,29 @@ QImage* UOArt::drawArtEnhanced(bool drawLegacy, unsigned int id, unsigned int hu
         return nullptr;
     }
 
+    const int squishFlags = (texInfo.textureFormat == DDSInfo::TextureFormat::DXT1) ? squish::kDxt1 : squish::kDxt5;
+    const size_t DDSDataSize = DDSInfo::kImageDataStartOffset + size_t(squish::GetStorageRequirements(texInfo.width, texInfo.height, squishFlags));
+    if ((texInfo.width <= 0) || (texInfo.height <= 0) || (DDSData.size < DDSDataSize))
+    {
+        LOG(QString("Truncated DDS texture in %1 (requested id %2).").arg(uopFileName).arg(id).toStdString());
+        return nullptr;
+    }
+
     // Decompress the DXT1(BC1)/DXT5(BC3) DDS image into plain RGBA32 (QImage::Format_RGBA8888) pixel data.
     // RGBA8888 will be returned independently from the compression of the source image (the concern of a different format
     //  was motivated by the fact that DXT1 doesn't preserve the alpha channel, so it actually has RGB888 data).
-    auto* decompressedImgBuf = new unsigned char[texInfo.height * texInfo.width * 4]; // I don't know the real max size, so let's just be generous.
-    squish::DecompressImage(decompressedImgBuf, texInfo.width, texInfo.height,
-                            (void const*)(DDSDataPtr + DDSInfo::kImageDataStartOffset),
-                            (texInfo.textureFormat == DDSInfo::TextureFormat::DXT1) ? squish::kDxt1 : squish:: kDxt5);
-
-    // Load pixel data into a QImage
-    //  The const cast for decompressedImgBuf is important! From Qt documentation:
-    // "Unlike the similar QImage constructor that takes a non-const data buffer, this version will never alter the
-    // contents of the buffer. For example, calling QImage::bits() will return a deep copy of the image, rather than
-    // the buffer passed to the constructor."
-    QImage imageBuf = QImage((const uchar*)decompressedImgBuf, texInfo.width, texInfo.height, QImage::Format_RGBA8888);
-    QImage* image = new QImage();
-    *image = imageBuf.copy();
-    // I exploit this behavior of the const-variant QImage constructor to perform a deep copy to our definitive QImage (image),
-    //  from the QImage (imageBuf) that used as internal buffer the pointer to our decompressedImgBuf.
-    // By doing so, our QImage will be independent from our buffer, so we can finally delete it.
-    // Without doing this, we'll encounter random crashes when the image is used.
-    delete[] decompressedImgBuf;
+    // The pixels are written directly in the QImage storage (respecting its scanline pitch), so no intermediate buffer is needed.
+    QImage* image = new QImage(texInfo.width, texInfo.height, QImage::Format_RGBA8888);
+    if (image->isNull())
+    {
+        // Allocation failed: the header asks for a texture too big
+        LOG(QString("Can't allocate a %1x%2 image for the DDS texture in %3 (requested id %4).")
+                .arg(texInfo.width).arg(texInfo.height).arg(uopFileName).arg(id).toStdString());
+        delete image;
+        return nullptr;
+    }
+    squish::DecompressImage(image->bits(), texInfo.width, texInfo.height, image->bytesPerLine(),
+                            static_cast<const void*>(DDSDataPtr + DDSInfo::kImageDataStartOffset), squishFlags);
 
     // Apply hue
     if (hueIndex)
@@ -169,41 +250,29 @@ bool UOArt::getClassicPixelData(bool drawFromUOP, unsigned int id, std::vector<c
     if (drawFromUOP)
     {
         // UOP
-        std::string CC_UOPPath = m_clientPath + kCC_UOPFile;
-        QDateTime lastModified = QFileInfo(CC_UOPPath.c_str()).lastModified();
         uopp::UOPError uopError;
-        if (lastModified != m_uopLastModified)
-        {
-            loadUOP(ClientFileType::TextureUOP, lastModified, CC_UOPPath, &uopError);
-            if (uopError.errorOccurred())
-            {
-                LOG(uopError.buildErrorsString());
-                return false;
-            }
-        }
-
-        std::string packedFileName = QString("build/artlegacymul/%1.tga").arg(id, 8, 10, QChar('0')).toStdString();
-        uopp::UOPFile* uopFile = m_uopPackage->getFileByName(packedFileName);
-        if (uopFile == nullptr)
+        uopp::UOPPackage* uopPackage = nullptr;
+        uopp::UOPFile* uopFile = getUOPFile(ClientFileType::ArtLegacyMulUOP, id, &uopPackage, &uopError);
+        if (uopPackage == nullptr)
         {
-            LOG(QString("Error looking up %1 (requested id %2).").arg(kCC_UOPFile, id).toStdString());
+            LOG(QString("Error loading %1.").arg(kCC_UOPFile).toStdString());
+            LOG(uopError.buildErrorsString());
             return false;
         }
-        std::ifstream fin = m_uopPackage->getOpenedStream();
-        if (fin.bad())
+        if (uopFile == nullptr)
         {
-            LOG(QString("Error seeking from %1 (requested id %2).").arg(kCC_UOPFile, id).toStdString());
+            LOG(QString("Error looking up %1 (requested id %2).").arg(kCC_UOPFile).arg(id).toStdString());
             return false;
         }
-
-        auto* decompressedDataVec = new std::vector<char>();
-        if (!uopFile->readPackedData(fin, &uopError) || !uopFile->unpack(decompressedDataVec, &uopError))
+        uopp::UOPDataView pixelData{nullptr, 0};
+        if (!unpackUOPFile(uopPackage, uopFile, data, &pixelData, &uopError))
         {
-            LOG(QString("Error unpacking from %1 (requested id %2).").arg(kCC_UOPFile, id).toStdString());
+            LOG(QString("Error unpacking from %1 (requested id %2).").arg(kCC_UOPFile).arg(id).toStdString());
             LOG(uopError.buildErrorsString());
             return false;
         }
-        *data = *uopFile->getDataVec();
+        if (pixelData.data != data->data())
+            data->assign(pixelData.data, pixelData.data + pixelData.size);    // it's a view on the package mapping
     }
     else
     {
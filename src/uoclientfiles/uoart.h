@@ -4,9 +4,9 @@
 #include <string>
 #include <vector>
 #include <memory>
-#include <QDateTime>
 
 #include "uoidx.h"
+#include "uoppackagecache.h"
 
 
 class QImage;
@@ -16,6 +16,8 @@ namespace uopp
 {
     class UOPError;
     class UOPPackage;
+    class UOPFile;
+    struct UOPDataView;
 }
 
 
@@ -46,22 +48,35 @@ private:
     static constexpr const char* kEC_UOPFile        = "Texture.uop";
     static constexpr const char* kEC_LegacyUOPFile  = "LegacyTexture.uop";
     static constexpr const char* kCC_UOPFile        = "artLegacyMUL.uop";
+    static constexpr unsigned int kEC_IdCount       = 0x10000;  // EC textures are indexed by item id (without kItemsOffset)
+    static constexpr unsigned int kCC_IdCount       = 0x14000;  // landtiles + items
 
 public:
     void setCachePointers(UOHues* hues);
+    void unloadUOPPackages();   // unmap the packages, so that the files can be replaced; they are loaded again at the next draw
 
     QImage* drawArt(unsigned int id, unsigned int hueIndex, bool partialHue);   // auto pick the newer art file format and draw the image
     QImage* drawArtEnhanced(bool drawLegacy, unsigned int id, unsigned int hueIndex, bool partialHue);
     QImage* drawArtClassic(bool drawFromUOP, unsigned int id, unsigned int hueIndex, bool partialHue);
     
 private:
-    void loadUOP(ClientFileType fileType, const QDateTime& lastModified, const std::string& uopPath, uopp::UOPError* uopError);
+    ClientFileType detectArtFileType() const;
+    static const char* getUOPFileName(ClientFileType fileType);
+    static const char* getUOPFileNameFormat(ClientFileType fileType);
+    uopp::UOPFile* getUOPFile(ClientFileType fileType, unsigned int id, uopp::UOPPackage** package, uopp::UOPError* uopError);
+    static bool unpackUOPFile(uopp::UOPPackage* package, uopp::UOPFile* file, std::vector<char>* buffer, uopp::UOPDataView* view, uopp::UOPError* uopError);
     bool getClassicPixelData(bool drawFromUOP, unsigned int id, std::vector<char> *data);
+    void resetFileIdTables();
 
     std::string m_clientPath;
-    ClientFileType m_lastFileType;
-    QDateTime m_uopLastModified;
-    std::unique_ptr<uopp::UOPPackage> m_uopPackage;
+    ClientFileType m_artFileType;       // newer art file format available, picked by drawArt
+    UOPPackageCache m_uopPackages;      // Texture.uop, LegacyTexture.uop and artLegacyMUL.uop are kept loaded at the same time
+    // Id tables resolved from m_uopPackages, indexed by ClientFileType, so that a draw doesn't need to stat the package and look it up.
+    //  They are owned by the package cache: reset them whenever the packages may be reloaded.
+    static constexpr int kClientFileTypeCount = int(ClientFileType::TextureUOP) + 1;
+    const UOPPackageCache::FileIdTable* m_fileIdTables[kClientFileTypeCount];
+    uopp::UOPPackage* m_fileIdTablePackages[kClientFileTypeCount];
+    std::vector<char> m_scratchBuffer;  // reused between draws to hold the inflated texture data
 
 public:
     UOHues* m_UOHues;
@@ -0,0 +1,239 @@
+#include "uobodydef.h"
+
+#include <fstream>
+#include <sstream>
+
+#include "../cpputils/strings.h"
+
+#include "../globals.h"
+#define LOG(x) appendToLog(x)
+
+
+namespace uocf
+{
+
+UOBodyDef::UOBodyDef(const std::string &clientPath) :
+    m_clientPath(clientPath)
+{
+    m_bodies.resize(kBodyIdMax);
+    for (int i = 0; i < kBodyIdMax; ++i)
+        m_bodies[i] = BodyEntry{i, 0, 0};
+
+    // Load Bodyconv.def first, since its definitions take precedence over the Body.def ones
+    loadBodyConvDef();
+    loadBodyDef();
+    buildMULLookupTable();
+}
+
+
+//--Body.def and BodyConv.def (source inspired by UOFiddler)
+
+
+bool UOBodyDef::loadBodyDef()
+{
+    LOG("Loading Body.def");
+
+    std::ifstream fileStream;
+    // it's fundamental to open the file in binary mode, otherwise tellg and seekg won't work properly...
+    fileStream.open(m_clientPath + "Body.def", std::ifstream::in | std::ifstream::binary);
+    if (!fileStream.is_open())
+    {
+        LOG("Error opening file Body.def");
+        return false;
+    }
+
+    std::vector<bool> bodyDefined(kBodyIdMax, false);
+    while ( !fileStream.eof() )
+    {
+        std::string line;
+        std::getline(fileStream, line);
+        if ( fileStream.bad() )
+            break;
+
+        strTrim(line);
+        if (line.empty())
+            continue;
+        if (line[0]=='#')   // commented line
+            continue;
+
+        // Format is: <ORIG BODY> {<NEW BODY>} <NEW HUE>
+        size_t index1 = line.find('{');
+        size_t index2 = line.find('}', index1 + 1);
+        size_t index3 = line.find('#', index2 + 1); // get rid of eventual comments at the end of the line
+        if ( (index1 == std::string::npos) || (index2 == std::string::npos) )
+            continue;
+
+        std::string param1 = line.substr(0, index1 - 1);
+        std::string param2 = line.substr(index1 + 1, index2 - index1 - 1);
+        std::string param3 = line.substr(index2 + 1, index3 - index2 - 1);
+        strTrim(param1);
+        strTrim(param2);
+        strTrim(param3);
+
+        size_t indexOf = param2.find(',');
+        if (indexOf != std::string::npos)
+        {
+            param2 = param2.substr(0, indexOf);
+            strTrim(param2);
+        }
+
+        int iParam1 = std::stoi(param1);
+        int iParam2 = std::stoi(param2);
+        int iParam3 = std::stoi(param3);
+
+        // As for Bodyconv.def, if a body is defined more than once, the first definition wins
+        if ((iParam1 < 0) || (iParam1 >= kBodyIdMax) || bodyDefined[iParam1])
+            continue;
+        bodyDefined[iParam1] = true;
+        if (m_bodies[iParam1].animFileNumber != 0)
+            continue;   // Bodyconv.def has the precedence
+        m_bodies[iParam1].newBodyID = iParam2;
+        m_bodies[iParam1].newHue = iParam3;
+    }
+
+    fileStream.close();
+    return true;
+}
+
+
+bool UOBodyDef::loadBodyConvDef()
+{
+    LOG("Loading BodyConv.def");
+
+/*
+    0 - 199 = Monsters
+    200 - 399 = Animals
+    400 + = Humans/Elves and Equipment
+
+    The maximum value for an index is 2048.
+*/
+
+    std::ifstream fileStream;
+    // it's fundamental to open the file in binary mode, otherwise tellg and seekg won't work properly...
+    fileStream.open(m_clientPath + "Bodyconv.def", std::ifstream::in | std::ifstream::binary);
+    if (!fileStream.is_open())
+    {
+        LOG("Error opening file Bodyconv.def");
+        return false;
+    }
+
+    while ( !fileStream.eof() )
+    {
+        std::string line;
+        std::getline(fileStream, line);
+        if ( fileStream.bad() )
+            break;
+
+        strTrim(line);
+        if (line.empty())
+            continue;
+        if (line[0]=='#')   // commented line
+            continue;
+
+        // Format is: <Object> <LBR expansion (anim2)> <AoS (anim3)> <SE (anim4)> <Mondain's Legacy (anim5)>
+        std::vector<std::string> params;
+        strSplit(line, params, " \t", true);
+        if (params.size() < 5)
+            continue;
+
+        int iParams[5];
+        for (int i = 0; i < 5; ++i)
+            std::istringstream(params[i]) >> iParams[i];
+
+        if (iParams[1] == 68)   // anim2
+            iParams[1] = 122;
+
+        int newAnimfile = 0;        // the count starts from 0, not 1 (so 1 -> anim2)
+        for (int i = 1; i < 5; ++i)
+        {
+            if (iParams[i] != -1)
+            {
+                newAnimfile = i;
+                break;
+            }
+        }
+        if (newAnimfile == 0)
+            continue;
+
+        if ((iParams[0] < 0) || (iParams[0] >= kBodyIdMax) || (m_bodies[iParams[0]].animFileNumber != 0))
+            continue;   // out of range, or already defined (the first definition wins)
+        m_bodies[iParams[0]] = BodyEntry{iParams[newAnimfile], 0, newAnimfile};
+    }
+
+    fileStream.close();
+    return true;
+}
+
+
+void UOBodyDef::buildMULLookupTable()
+{
+    m_mulBodyBaseIndex.resize(size_t(kAnimMULFilesCount) * kBodyIdMax);
+    for (int animFileNumber = 0; animFileNumber < kAnimMULFilesCount; ++animFileNumber)
+    {
+        for (int body = 0; body < kBodyIdMax; ++body)
+            m_mulBodyBaseIndex[size_t(animFileNumber * kBodyIdMax + body)] = computeMULBodyBaseIndex(animFileNumber, body);
+    }
+}
+
+// static
+unsigned int UOBodyDef::computeMULBodyBaseIndex(int animFileNumber, int body)
+{
+    // Stygian Abyss stuff is stored in animationframe*.uop.
+    // Every animation before Stygian Abyss is stored in anim mul/idx.
+
+    unsigned index = 0;
+    switch (animFileNumber)
+    {
+        default:
+        case 0:
+            if (body < 200)
+                index = body * 110;
+                // 200 * 110 = 22000 animation frame slots for hi detail animations
+            else if (body < 400)
+                index = 22000 + ((body - 200) * 65);
+                // 200 (which is 400 - 200) * 65 = 13000 slots for low detail anims
+            else
+                index = 35000 + ((body - 400) * 175);
+                // 35000 -> 22000 + 13000. Skip this much slots for equip anims
+            break;
+
+        case 1:
+            if (body < 200)
+                index = body * 110;
+            else
+                index = 22000 + ((body - 200) * 65);
+            break;
+
+        case 2:
+            if (body < 300)
+                index = body * 65;
+            else if (body < 400)
+                index = 33000 + ((body - 300) * 110);
+            else
+                index = 35000 + ((body - 400) * 175);
+            break;
+
+        case 3:
+            if (body < 200)
+                index = body * 110;
+            else if (body < 400)
+                index = 22000 + ((body - 200) * 65);
+            else
+                index = 35000 + ((body - 400) * 175);
+            break;
+
+        case 4:
+            if ((body < 200) && (body != 34)) // looks strange, though it works.
+                index = body * 110;
+            else if (body < 400)
+                index = 22000 + ((body - 200) * 65);
+            else
+                index = 35000 + ((body - 400) * 175);
+            break;
+    }
+
+    return index;
+}
+
+
+}
@@ -0,0 +1,61 @@
+#ifndef UOBODYDEF_H
+#define UOBODYDEF_H
+
+#include <string>
+#include <vector>
+
+
+namespace uocf
+{
+
+
+// Body.def and Bodyconv.def, compiled at load time into dense tables indexed by body ID, so that translating a body
+//  is a single array access. The tables are independent from the anim file format, so they can be shared between
+//  the MUL and UOP animation readers.
+class UOBodyDef
+{
+public:
+    static constexpr int kBodyIdMax = 4096;
+    static constexpr int kAnimMULFilesCount = 5;    // anim.mul, anim2.mul, ..., anim5.mul
+
+    struct BodyEntry
+    {
+        int newBodyID;
+        int newHue;             // 0: don't change the hue
+        int animFileNumber;     // 0: anim.mul, 1: anim2.mul, ...
+    };
+
+    UOBodyDef(const std::string& clientPath);
+
+    // Bodies not redefined by Body.def or Bodyconv.def (or out of range) translate to themselves, in anim.mul.
+    inline BodyEntry getBody(int bodyID) const noexcept {
+        if ((bodyID < 0) || (bodyID >= kBodyIdMax))
+            return BodyEntry{bodyID, 0, 0};
+        return m_bodies[bodyID];
+    }
+
+    // Returns the in-file index (in anim*.idx) of the given translated body, action and direction.
+    inline unsigned int getMULLookupIndex(int animFileNumber, int bodyID, int action, int direction) const noexcept {
+        // Directions 5, 6, 7 are the mirrored versions of 3, 2, 1
+        static constexpr unsigned int kDirectionSlot[8] = {0, 1, 2, 3, 4, 3, 2, 1};
+        return m_mulBodyBaseIndex[(animFileNumber * kBodyIdMax) + bodyID] + unsigned(action * 5) + kDirectionSlot[direction & 7];
+    }
+    inline bool isValidMULLookup(int animFileNumber, int bodyID) const noexcept {
+        return (animFileNumber >= 0) && (animFileNumber < kAnimMULFilesCount) && (bodyID >= 0) && (bodyID < kBodyIdMax);
+    }
+
+private:
+    std::string m_clientPath;
+    std::vector<BodyEntry> m_bodies;                // lookup key: original body ID
+    std::vector<unsigned int> m_mulBodyBaseIndex;   // lookup key: (anim file number * kBodyIdMax) + translated body ID
+
+    bool loadBodyDef();
+    bool loadBodyConvDef();
+    void buildMULLookupTable();
+    static unsigned int computeMULBodyBaseIndex(int animFileNumber, int body);
+};
+
+
+}
+
+#endif // UOBODYDEF_H
@@ -0,0 +1,76 @@
+#include "uodifindex.h"
+#include <algorithm>    // for std::stable_sort, std::min
+#include <cstring>      // for memcpy
+#include <fstream>
+#include <utility>      // for std::pair
+
+
+namespace uocf
+{
+
+
+bool UODifIndex::load(const std::string& listFilePath, unsigned int blocksCount, unsigned int maxPatchesCount)
+{
+    clear();
+
+    std::ifstream fin(listFilePath, std::ifstream::in | std::ifstream::binary);
+    if (!fin.is_open())
+        return false;
+
+    // The list is just an array of 4 bytes block indices
+    fin.seekg(0, std::ifstream::end);
+    const std::streamoff fileSize = fin.tellg();
+    fin.seekg(0, std::ifstream::beg);
+    const unsigned int listCount = std::min(unsigned(fileSize / 4), maxPatchesCount);
+    std::vector<char> buf(size_t(listCount) * 4);
+    fin.read(buf.data(), std::streamsize(buf.size()));
+    if (!fin.good())
+        return false;
+
+    // Sort the patches by block, keeping the list order for the same block: then the last one of each block is the one to keep.
+    std::vector<std::pair<unsigned int, unsigned int>> blockPatches;   // block index, patch index
+    blockPatches.reserve(listCount);
+    for (unsigned int patch_i = 0; patch_i < listCount; ++patch_i)
+    {
+        unsigned int blockIndex;
+        memcpy(&blockIndex, &buf[size_t(patch_i) * 4], 4);
+        if (blockIndex < blocksCount)
+            blockPatches.emplace_back(blockIndex, patch_i);
+    }
+    std::stable_sort(blockPatches.begin(), blockPatches.end(),
+        [](const std::pair<unsigned int, unsigned int>& a, const std::pair<unsigned int, unsigned int>& b) {
+            return a.first < b.first;
+        });
+
+    m_words.assign((size_t(blocksCount) + 63) / 64, Word{0, 0});
+    for (size_t i = 0; i < blockPatches.size(); ++i)
+    {
+        const unsigned int blockIndex = blockPatches[i].first;
+        if ((i + 1 < blockPatches.size()) && (blockPatches[i + 1].first == blockIndex))
+            continue;
+        m_words[blockIndex / 64].bits |= uint64_t(1) << (blockIndex % 64);
+        m_patches.push_back(blockPatches[i].second);
+    }
+
+    unsigned int rank = 0;
+    for (Word& word : m_words)
+    {
+        word.rank = rank;
+        rank += unsigned(std::bitset<64>(word.bits).count());
+    }
+
+    if (m_patches.empty())
+        clear();
+    return true;
+}
+
+void UODifIndex::clear()
+{
+    m_words.clear();
+    m_words.shrink_to_fit();
+    m_patches.clear();
+    m_patches.shrink_to_fit();
+}
+
+
+}
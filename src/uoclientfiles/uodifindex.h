@@ -0,0 +1,60 @@
+#ifndef UODIFINDEX_H
+#define UODIFINDEX_H
+
+#include <bitset>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+namespace uocf
+{
+
+
+// Lookup from a map block index to its patch in a difference file (mapdif*.mul, stadifi*.mul), built from the list file
+//  (mapdifl*.mul, stadifl*.mul), which holds the index of the patched block for each patch, in the order of the patches.
+// The patched blocks are marked in a bitmap, which also stores the count of the patched blocks preceding each 64 bits word:
+//  a lookup costs a population count, and the index takes 2 bits per map block plus 4 bytes per patched block.
+class UODifIndex
+{
+public:
+    static constexpr unsigned int kNoPatch = 0xFFFFFFFF;
+
+    // Only the first maxPatchesCount entries of the list are used (the patches actually stored in the data file).
+    // If a block is listed more than once, the last patch wins, as in the client. Returns false if the list can't be read.
+    bool load(const std::string& listFilePath, unsigned int blocksCount, unsigned int maxPatchesCount);
+    void clear();
+
+    inline bool isEmpty() const noexcept {
+        return m_patches.empty();
+    }
+    inline unsigned int getPatchedBlocksCount() const noexcept {
+        return unsigned(m_patches.size());
+    }
+
+    inline unsigned int getPatch(unsigned int blockIndex) const noexcept
+    {
+        const size_t word_i = blockIndex / 64;
+        if (word_i >= m_words.size())
+            return kNoPatch;
+        const Word& word = m_words[word_i];
+        const uint64_t blockBit = uint64_t(1) << (blockIndex % 64);
+        if ((word.bits & blockBit) == 0)
+            return kNoPatch;
+        return m_patches[word.rank + std::bitset<64>(word.bits & (blockBit - 1)).count()];
+    }
+
+private:
+    struct Word
+    {
+        uint64_t bits;
+        unsigned int rank;  // patched blocks in the previous words
+    };
+    std::vector<Word> m_words;
+    std::vector<unsigned int> m_patches;    // for each patched block, in block order, the index of its patch
+};
+
+
+}
+
+#endif // UODIFINDEX_H
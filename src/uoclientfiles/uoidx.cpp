@@ -69,7 +69,7 @@ bool UOIdx::getLookup(unsigned int id, Entry *idxEntry)
 {
     if (hasCache())
     {
-        if (id > m_cachedCount)
+        if (id >= m_cachedCount)
             return false;
         *idxEntry = m_cache[id];
         return true;
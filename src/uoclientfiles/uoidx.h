@@ -36,6 +36,9 @@ public:
     }
     void clearCache();
     void cacheData();
+    inline unsigned int getCachedCount() const noexcept {
+        return m_cachedCount;
+    }
 
     bool getLookup(unsigned int id, Entry *idxEntry);
 
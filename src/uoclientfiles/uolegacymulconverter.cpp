@@ -0,0 +1,462 @@
+#include "uolegacymulconverter.h"
+
+#include <algorithm>    // for std::min
+#include <cstdio>       // for snprintf, remove, rename
+#include <cstring>      // for memcpy
+#include <fstream>
+#include <utility>      // for std::pair
+#include <vector>
+#ifdef _OPENMP
+    #include <omp.h>
+#endif
+
+#include "../cpputils/strings.h"
+#include "../cpputils/sysio.h"
+#include "../uoppackage/uophash.h"
+#include "../uoppackage/uoppackage.h"
+#include "exceptions.h"
+#include "uoidx.h"
+
+#include "../globals.h"
+#define LOG(x) appendToLog(x)
+
+
+namespace uocf
+{
+
+
+// How many entries are unpacked in parallel before writing them to disk
+static unsigned int getWindowSize()
+{
+#ifdef _OPENMP
+    return unsigned(omp_get_max_threads()) * 64;
+#else
+    return 64;
+#endif
+}
+
+
+// static
+const UOLegacyMULConverter::FileTypeInfo& UOLegacyMULConverter::getFileTypeInfo(FileType fileType)
+{
+    static const FileTypeInfo kArtInfo =
+        {"artLegacyMUL.uop",        "art.mul",      "artidx.mul",   "build/artlegacymul/%08u.tga",      0x14000,    false};
+    static const FileTypeInfo kGumpartInfo =
+        {"gumpartLegacyMUL.uop",    "gumpart.mul",  "gumpidx.mul",  "build/gumpartlegacymul/%08u.tga",  0x10000,    true};
+
+    switch (fileType)
+    {
+        default:
+        case FileType::Art:     return kArtInfo;
+        case FileType::Gumpart: return kGumpartInfo;
+    }
+}
+
+// static
+const char* UOLegacyMULConverter::getUOPFileName(FileType fileType)
+{
+    return getFileTypeInfo(fileType).uopFileName;
+}
+
+// static
+const char* UOLegacyMULConverter::getMULFileName(FileType fileType)
+{
+    return getFileTypeInfo(fileType).mulFileName;
+}
+
+// static
+const char* UOLegacyMULConverter::getIdxFileName(FileType fileType)
+{
+    return getFileTypeInfo(fileType).idxFileName;
+}
+
+// static
+bool UOLegacyMULConverter::detectFileType(const std::string& fileName, FileType* fileType)
+{
+    std::string name = fileName.substr(fileName.find_last_of("/\\") + 1);  // npos + 1 == 0
+    strToLower(name);
+
+    for (FileType curType : {FileType::Art, FileType::Gumpart})
+    {
+        const FileTypeInfo& info = getFileTypeInfo(curType);
+        std::string uopName(info.uopFileName);
+        strToLower(uopName);
+        if ((name == uopName) || (name == info.mulFileName) || (name == info.idxFileName))
+        {
+            *fileType = curType;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Move each temporary file over its destination. The destination files are kept as .bak until all of them are replaced:
+//  if a rename fails, the ones already replaced are restored, so that we never leave a new mul paired with an old idx.
+// The destination files must not be memory-mapped (on Windows they couldn't be renamed).
+static bool replaceFiles(const std::vector<std::pair<std::string, std::string>>& tempAndDestPaths)
+{
+    std::vector<bool> hasBackup(tempAndDestPaths.size(), false);
+    auto rollback = [&tempAndDestPaths, &hasBackup](size_t filesCount)
+    {
+        for (size_t i = 0; i < filesCount; ++i)
+        {
+            const std::string& destPath = tempAndDestPaths[i].second;
+            if (hasBackup[i])
+                renameReplacing(destPath + ".bak", destPath);
+            else
+                remove(destPath.c_str());   // it didn't exist before
+        }
+    };
+
+    for (size_t i = 0; i < tempAndDestPaths.size(); ++i)
+    {
+        const std::string& tempPath = tempAndDestPaths[i].first;
+        const std::string& destPath = tempAndDestPaths[i].second;
+        if (isValidFile(destPath))
+        {
+            if (!renameReplacing(destPath, destPath + ".bak"))
+            {
+                LOG("Error replacing " + destPath + " (is it in use?)");
+                rollback(i);
+                return false;
+            }
+            hasBackup[i] = true;
+        }
+        if (!renameReplacing(tempPath, destPath))
+        {
+            LOG("Error replacing " + destPath);
+            rollback(i + 1);
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < tempAndDestPaths.size(); ++i)
+    {
+        if (hasBackup[i])
+            remove((tempAndDestPaths[i].second + ".bak").c_str());
+    }
+    return true;
+}
+
+// static
+bool UOLegacyMULConverter::convertUOPToMUL(FileType fileType, const std::string& uopPath, const std::string& mulPath, const std::string& idxPath)
+{
+    const FileTypeInfo& info = getFileTypeInfo(fileType);
+
+    uopp::UOPPackage package;
+    uopp::UOPError uopError;
+    if (!package.load(uopPath, &uopError))
+    {
+        LOG("Error loading " + uopPath);
+        LOG(uopError.buildErrorsString());
+        return false;
+    }
+
+    // With the package mapped in memory, each thread can unpack its entries without locking. If we can't map it, go single-threaded.
+    const bool mapped = package.mapPackageFile();
+    std::ifstream fin;
+    if (!mapped)
+        fin = package.getOpenedStream();
+
+    // Write to temporary files and replace the destination ones only at the end: they may be the files of the loaded client,
+    //  memory-mapped by the UOArt instance, and truncating a mapped file would crash the next read from the mapping.
+    const std::string tempMulPath = mulPath + ".tmp", tempIdxPath = idxPath + ".tmp";
+    auto removeTempFiles = [&tempMulPath, &tempIdxPath]()
+    {
+        remove(tempMulPath.c_str());
+        remove(tempIdxPath.c_str());
+    };
+    std::ofstream foutMul(tempMulPath, std::ios::out | std::ios::binary);
+    std::ofstream foutIdx(tempIdxPath, std::ios::out | std::ios::binary);
+    if (!foutMul.is_open() || !foutIdx.is_open())
+    {
+        LOG("Error opening (write) " + tempMulPath + " or " + tempIdxPath);
+        foutMul.close();
+        foutIdx.close();
+        removeTempFiles();
+        return false;
+    }
+
+    std::vector<UOIdx::Entry> idxEntries(info.idxEntriesCount, UOIdx::Entry{UOIdx::Entry::kInvalid, UOIdx::Entry::kInvalid, UOIdx::Entry::kInvalid});
+    const unsigned int filesCount = package.getFileCount();
+    unsigned int convertedCount = 0, errorsCount = 0;
+    unsigned long long mulOffset = 0;
+
+    enum EntryStatus : char { kMissing, kUnpacked, kError };
+    const unsigned int windowSize = getWindowSize();
+    std::vector<std::vector<char>> windowData(windowSize);
+    std::vector<char> windowStatus(windowSize);
+
+    for (unsigned int windowStart = 0; (windowStart < info.idxEntriesCount) && (convertedCount + errorsCount < filesCount); windowStart += windowSize)
+    {
+        const int windowEnd = int(std::min(info.idxEntriesCount, windowStart + windowSize));
+
+        #pragma omp parallel for schedule(dynamic) if(mapped)
+        for (int id = int(windowStart); id < windowEnd; ++id)
+        {
+            const unsigned int windowIdx = unsigned(id) - windowStart;
+            char packedFileName[64];
+            snprintf(packedFileName, sizeof(packedFileName), info.packedFileNameFormat, unsigned(id));
+            uopp::UOPFile* uopFile = package.getFileByName(packedFileName);
+            if (uopFile == nullptr)
+            {
+                windowStatus[windowIdx] = kMissing;
+                continue;
+            }
+
+            bool unpacked;
+            if (mapped)
+            {
+                unpacked = uopFile->unpack(&windowData[windowIdx]);
+            }
+            else
+            {
+                fin.clear();
+                unpacked = uopFile->readPackedData(fin) && uopFile->unpack(&windowData[windowIdx]);
+                uopFile->freePackedData();
+            }
+            windowStatus[windowIdx] = unpacked ? kUnpacked : kError;
+        }
+
+        // Write the unpacked entries in order
+        for (unsigned int id = windowStart; id < unsigned(windowEnd); ++id)
+        {
+            const unsigned int windowIdx = id - windowStart;
+            if (windowStatus[windowIdx] == kMissing)
+                continue;
+
+            const std::vector<char>& data = windowData[windowIdx];
+            const size_t headerSize = info.hasSizeHeader ? 8 : 0;
+            if ((windowStatus[windowIdx] == kError) || (data.size() < headerSize))
+            {
+                LOG("Error unpacking entry " + std::to_string(id) + " from " + uopPath);
+                ++errorsCount;
+                continue;
+            }
+
+            UOIdx::Entry& idxEntry = idxEntries[id];
+            idxEntry.lookup = unsigned(mulOffset);
+            idxEntry.size = unsigned(data.size() - headerSize);
+            idxEntry.extra = 0;
+            if (info.hasSizeHeader)
+            {
+                unsigned int width = 0, height = 0;
+                memcpy(&width, data.data(), 4);
+                memcpy(&height, data.data() + 4, 4);
+                idxEntry.extra = ((width & 0xFFFF) << 16) | (height & 0xFFFF);
+            }
+
+            foutMul.write(data.data() + headerSize, std::streamsize(idxEntry.size));
+            mulOffset += idxEntry.size;
+            ++convertedCount;
+        }
+
+        if (mulOffset >= UOIdx::Entry::kInvalid)
+        {
+            LOG("Error converting " + uopPath + ": the MUL file would exceed 4 GB");
+            foutMul.close();
+            foutIdx.close();
+            removeTempFiles();
+            return false;
+        }
+    }
+
+    // Write the whole idx file at once
+    std::vector<char> idxData(idxEntries.size() * UOIdx::Entry::kSize);
+    for (size_t i = 0; i < idxEntries.size(); ++i)
+    {
+        char* dest = idxData.data() + (i * UOIdx::Entry::kSize);
+        memcpy(dest,     &idxEntries[i].lookup, 4);
+        memcpy(dest + 4, &idxEntries[i].size,   4);
+        memcpy(dest + 8, &idxEntries[i].extra,  4);
+    }
+    foutIdx.write(idxData.data(), std::streamsize(idxData.size()));
+
+    foutMul.close();
+    foutIdx.close();
+    if (foutMul.fail() || foutIdx.fail())
+    {
+        LOG("Error writing " + tempMulPath + " or " + tempIdxPath);
+        removeTempFiles();
+        return false;
+    }
+    if (!replaceFiles({{tempMulPath, mulPath}, {tempIdxPath, idxPath}}))
+    {
+        removeTempFiles();
+        return false;
+    }
+    LOG("Converted " + std::to_string(convertedCount) + " entries from " + uopPath + " (" + std::to_string(errorsCount) + " errors).");
+    return (errorsCount == 0);
+}
+
+// static
+bool UOLegacyMULConverter::convertMULToUOP(FileType fileType, const std::string& mulPath, const std::string& idxPath, const std::string& uopPath)
+{
+    const FileTypeInfo& info = getFileTypeInfo(fileType);
+
+    // The MUL stays mapped until the package is saved: the entries are read from it (in parallel) only by finalizeAndSave.
+    MappedFile mul;
+    if (!mul.open(mulPath))
+    {
+        LOG("Error opening (read) " + mulPath);
+        return false;
+    }
+
+    UOIdx idx(idxPath);
+    try
+    {
+        idx.cacheData();
+    }
+    catch (const InvalidStreamException&)
+    {
+        LOG("Error reading " + idxPath);
+        return false;
+    }
+
+    uopp::UOPPackage package;
+    uopp::UOPError uopError;
+    unsigned int skippedCount = 0;
+    for (unsigned int id = 0, idxCount = idx.getCachedCount(); id < idxCount; ++id)
+    {
+        UOIdx::Entry idxEntry = {};
+        idx.getLookup(id, &idxEntry);
+        if ((idxEntry.lookup == UOIdx::Entry::kInvalid) || (idxEntry.size == 0) || (idxEntry.size == UOIdx::Entry::kInvalid))
+            continue;
+        if ((idxEntry.lookup > mul.size()) || (idxEntry.size > mul.size() - idxEntry.lookup))
+        {
+            ++skippedCount;
+            continue;
+        }
+
+        const char* entryData = mul.data() + idxEntry.lookup;
+        const unsigned int entrySize = idxEntry.size;
+        const bool hasSizeHeader = info.hasSizeHeader;
+        const unsigned int width = (idxEntry.extra >> 16) & 0xFFFF, height = idxEntry.extra & 0xFFFF;
+        auto provideData = [entryData, entrySize, hasSizeHeader, width, height](std::vector<char>* data) -> bool
+        {
+            const size_t headerSize = hasSizeHeader ? 8 : 0;
+            data->resize(headerSize + entrySize);
+            if (hasSizeHeader)
+            {
+                memcpy(data->data(),     &width,  4);
+                memcpy(data->data() + 4, &height, 4);
+            }
+            memcpy(data->data() + headerSize, entryData, entrySize);
+            return true;
+        };
+
+        char packedFileName[64];
+        snprintf(packedFileName, sizeof(packedFileName), info.packedFileNameFormat, id);
+        // The client's LegacyMUL packages are uncompressed
+        if (!package.addFile(provideData, uopp::hashFileName(packedFileName), uopp::CompressionFlag::None, true, &uopError, uopp::ZLibQuality::None))
+        {
+            LOG("Error adding entry " + std::to_string(id) + " from " + mulPath);
+            LOG(uopError.buildErrorsString());
+            return false;
+        }
+    }
+    if (skippedCount > 0)
+        LOG("Skipped " + std::to_string(skippedCount) + " entries pointing outside of " + mulPath);
+
+    // As for the MUL files, don't truncate the destination package: it may be memory-mapped by the UOArt instance.
+    const std::string tempUopPath = uopPath + ".tmp";
+    if (!package.finalizeAndSave(tempUopPath, &uopError))
+    {
+        LOG("Error saving " + tempUopPath);
+        LOG(uopError.buildErrorsString());
+        remove(tempUopPath.c_str());
+        return false;
+    }
+    if (!replaceFiles({{tempUopPath, uopPath}}))
+    {
+        remove(tempUopPath.c_str());
+        return false;
+    }
+    LOG("Converted " + std::to_string(package.getFileCount()) + " entries from " + mulPath + " to " + uopPath + ".");
+    return true;
+}
+
+// static
+bool UOLegacyMULConverter::extractUOP(const std::string& uopPath, const std::string& outFolder, unsigned int* extractedCount)
+{
+    uopp::UOPPackage package;
+    uopp::UOPError uopError;
+    if (!package.load(uopPath, &uopError))
+    {
+        LOG("Error loading " + uopPath);
+        LOG(uopError.buildErrorsString());
+        return false;
+    }
+
+    std::string outPath(outFolder);
+    standardizePath(outPath);
+
+    // With the package mapped in memory, each thread can unpack its blocks without locking. If we can't map it, go single-threaded.
+    const bool mapped = package.mapPackageFile();
+    std::ifstream fin;
+    if (!mapped)
+        fin = package.getOpenedStream();
+
+    const int blocksCount = int(package.getBlocksCount());
+    std::vector<unsigned int> blockExtracted(size_t(blocksCount), 0);
+    std::vector<unsigned int> blockErrors(size_t(blocksCount), 0);
+
+    #pragma omp parallel if(mapped)
+    {
+        std::vector<char> buffer;   // per-thread buffer to inflate the data
+
+        #pragma omp for schedule(dynamic)
+        for (int bl = 0; bl < blocksCount; ++bl)
+        {
+            uopp::UOPBlock* block = package.getBlock(unsigned(bl));
+            for (unsigned int fileIdx = 0, filesCount = block->getFilesCount(); fileIdx < filesCount; ++fileIdx)
+            {
+                uopp::UOPFile* uopFile = block->getFile(fileIdx);
+                uopp::UOPDataView data{nullptr, 0};
+                bool unpacked;
+                if (mapped)
+                {
+                    unpacked = uopFile->unpackView(&buffer, &data);   // no copies for uncompressed files
+                }
+                else
+                {
+                    fin.clear();
+                    unpacked = uopFile->readPackedData(fin) && uopFile->unpack(&buffer);
+                    uopFile->freePackedData();
+                    data = uopp::UOPDataView{buffer.data(), buffer.size()};
+                }
+
+                char outFileName[32];
+                snprintf(outFileName, sizeof(outFileName), "%016llx.dat", uopFile->getFileHash());
+                std::ofstream fout;
+                if (unpacked)
+                    fout.open(outPath + outFileName, std::ios::out | std::ios::binary);
+                if (!fout.is_open())
+                {
+                    ++blockErrors[size_t(bl)];
+                    continue;
+                }
+                fout.write(data.data, std::streamsize(data.size));
+                if (fout.bad())
+                    ++blockErrors[size_t(bl)];
+                else
+                    ++blockExtracted[size_t(bl)];
+            }
+        }
+    }
+
+    unsigned int extracted = 0, errors = 0;
+    for (int bl = 0; bl < blocksCount; ++bl)
+    {
+        extracted += blockExtracted[size_t(bl)];
+        errors += blockErrors[size_t(bl)];
+    }
+    if (extractedCount)
+        *extractedCount = extracted;
+    LOG("Extracted " + std::to_string(extracted) + " files from " + uopPath + " to " + outPath + " (" + std::to_string(errors) + " errors).");
+    return (errors == 0);
+}
+
+
+}
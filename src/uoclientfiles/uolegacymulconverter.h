@@ -0,0 +1,49 @@
+#ifndef UOLEGACYMULCONVERTER_H
+#define UOLEGACYMULCONVERTER_H
+
+#include <string>
+
+
+namespace uocf
+{
+
+
+// Conversion between the legacy MUL + IDX files and the *LegacyMUL.uop packages, and bulk extraction of UOP packages.
+// The entries are processed in parallel, reading the input through a memory mapping and streaming the output to disk in order.
+class UOLegacyMULConverter
+{
+public:
+    enum class FileType
+    {
+        Art,        // art.mul + artidx.mul         <-> artLegacyMUL.uop
+        Gumpart     // gumpart.mul + gumpidx.mul    <-> gumpartLegacyMUL.uop
+    };
+
+    static const char* getUOPFileName(FileType fileType);
+    static const char* getMULFileName(FileType fileType);
+    static const char* getIdxFileName(FileType fileType);
+    static bool detectFileType(const std::string& fileName, FileType* fileType);  // from the name of any of the files above
+
+    static bool convertUOPToMUL(FileType fileType, const std::string& uopPath, const std::string& mulPath, const std::string& idxPath);
+    static bool convertMULToUOP(FileType fileType, const std::string& mulPath, const std::string& idxPath, const std::string& uopPath);
+
+    // Write each file of the package in outFolder, naming it after its hash (the original file names aren't stored in the package).
+    static bool extractUOP(const std::string& uopPath, const std::string& outFolder, unsigned int* extractedCount = nullptr);
+
+private:
+    struct FileTypeInfo
+    {
+        const char* uopFileName;
+        const char* mulFileName;
+        const char* idxFileName;
+        const char* packedFileNameFormat;   // printf format, taking the entry id
+        unsigned int idxEntriesCount;
+        bool hasSizeHeader;                 // in the UOP, the data starts with width and height (in the MUL they are in the idx extra field)
+    };
+    static const FileTypeInfo& getFileTypeInfo(FileType fileType);
+};
+
+
+}
+
+#endif // UOLEGACYMULCONVERTER_H
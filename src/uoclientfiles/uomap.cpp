@@ -1,9 +1,19 @@
 #include "uomap.h"
 
 #include <QImage>
+#include <algorithm> // for std::min, std::max
+#include <atomic>
 #include <cmath>    // for pow
+#include <cstdio>   // for snprintf
 #include <cstring>  // for memcpy
-
+#include <vector>
+#ifdef _OPENMP
+    #include <omp.h>
+#endif
+
+#include "../uoppackage/uoppackage.h"
+#include "../uoppackage/uopfile.h"
+#include "../uoppackage/uophash.h"
 #include "exceptions.h"
 #include "uoradarcol.h"
 #include "uostatics.h"
@@ -13,23 +23,18 @@ namespace uocf
 {
 
 
-UOMap::UOMap(const std::string& clientPath, unsigned int fileIndex) :
+UOMap::UOMap(const std::string& clientPath, unsigned int fileIndex, UOMapBlockCache* blockCache) :
     m_clientPath(clientPath),
     m_fileIndex(fileIndex),
     m_UORadarcol(nullptr), m_UOStatics(nullptr), m_UOHues(nullptr)
 {
-    m_filePath = m_clientPath + "/map" + std::to_string(fileIndex) + ".mul";
-
-    openStream();
-    m_stream.seekg(0, std::ifstream::end);
-    std::streamoff size = m_stream.tellg();
-    closeStream();
+    const unsigned long long dataSize = setupFile();
 
     switch (fileIndex)
     {
         case 0:
         case 1:
-            if (size <= 77070336) // pre-ML
+            if (dataSize <= 77070336) // pre-ML
             {
                 m_width = 6144;
                 m_height = 4096;
@@ -65,36 +70,123 @@ UOMap::UOMap(const std::string& clientPath, unsigned int fileIndex) :
             throw UnsupportedActionException("UOMap", m_filePath);
     }
 
-    unsigned mapBlocks = (m_width * m_height) / MapBlock::kCellsPerBlock;
-    unsigned mapFileExpectedSize = MapBlock::kSize * mapBlocks;
-    if (size < mapFileExpectedSize)
-        throw MalformedFileException("UOMap", m_filePath);
-
-    m_cachedMapBlocksCount = m_cachedStaticsBlocksCount = 0;
-    setupDataCache();
+    init(blockCache, dataSize);
 }
 
 
-UOMap::UOMap(const std::string& clientPath, unsigned int fileIndex, unsigned int width, unsigned int height) :
+UOMap::UOMap(const std::string& clientPath, unsigned int fileIndex, unsigned int width, unsigned int height, UOMapBlockCache* blockCache) :
     m_clientPath(clientPath),
     m_fileIndex(fileIndex),
     m_width(width), m_height(height),
     m_UORadarcol(nullptr), m_UOStatics(nullptr), m_UOHues(nullptr)
 {
-    m_filePath = m_clientPath + "/map" + std::to_string(fileIndex) + ".mul";
+    init(blockCache, setupFile());
+}
+
+UOMap::~UOMap()
+{
+    m_blockCache->dropOwner(m_blockCacheOwnerId);
+}
 
-    openStream();
-    m_stream.seekg(0, std::ifstream::end);
-    std::streamoff size = m_stream.tellg();
-    closeStream();
+// static
+std::string UOMap::getUOPFilePath(const std::string& clientPath, unsigned int fileIndex)
+{
+    return clientPath + "/map" + std::to_string(fileIndex) + "LegacyMUL.uop";
+}
+
+// static
+std::string UOMap::getMapFilePath(const std::string& clientPath, unsigned int fileIndex)
+{
+    const std::string uopPath = getUOPFilePath(clientPath, fileIndex);
+    return isValidFile(uopPath) ? uopPath : (clientPath + "/map" + std::to_string(fileIndex) + ".mul");
+}
+
+unsigned long long UOMap::setupFile()
+{
+    m_filePath = getMapFilePath(m_clientPath, m_fileIndex);
+    m_uopChunkOffsets.clear();
+
+    if (m_filePath != getUOPFilePath(m_clientPath, m_fileIndex))
+    {
+        openStream();
+        m_stream.seekg(0, std::ifstream::end);
+        const std::streamoff size = m_stream.tellg();
+        closeStream();
+        return (size > 0) ? (unsigned long long)size : 0;
+    }
 
-    unsigned mapBlocks = (m_width * m_height) / MapBlock::kCellsPerBlock;
-    unsigned mapFileExpectedSize = MapBlock::kSize * mapBlocks;
-    if (size < mapFileExpectedSize)
+    // The chunks are named build/map<index>legacymul/<chunk>.dat. Hash their names only here, once: afterwards a block
+    //  is found by its chunk and the offset inside it, and read through the same stream or mapping of the MUL path.
+    uopp::UOPPackage package;
+    uopp::UOPError uopError;
+    if (!package.load(m_filePath, &uopError) || uopError.errorOccurred())
+        throw InvalidStreamException("UOMap", "Couldn't load the UOP package " + m_filePath);
+
+    static constexpr unsigned long long kChunkSize = (unsigned long long)kUOPBlocksPerChunk * MapBlock::kSize;
+    const std::string chunkNamePrefix = "build/map" + std::to_string(m_fileIndex) + "legacymul/";
+    unsigned long long dataSize = 0;
+    for (unsigned int chunk_i = 0; ; ++chunk_i)
+    {
+        char chunkName[16];
+        snprintf(chunkName, sizeof(chunkName), "%08u.dat", chunk_i);
+        unsigned int block, index;
+        if (!package.searchByHash(uopp::hashFileName(chunkNamePrefix + chunkName), &block, &index))
+            break;
+
+        const uopp::UOPFile* chunk = package.getFileByIndex(block, index);
+        // Only the last chunk can be shorter, and the data can't be compressed, or we couldn't read it in place
+        if (!chunk || (chunk->getCompression() != uopp::CompressionFlag::None) ||
+                (dataSize % kChunkSize != 0) || (chunk->getCompressedSize() > kChunkSize))
+        {
+            throw MalformedFileException("UOMap", m_filePath);
+        }
+        m_uopChunkOffsets.push_back(chunk->getDataBlockAddress() + chunk->getDataBlockLength());
+        dataSize += chunk->getCompressedSize();
+    }
+    if (m_uopChunkOffsets.empty())
+        throw MalformedFileException("UOMap", m_filePath);
+    return dataSize;
+}
+
+void UOMap::init(UOMapBlockCache* blockCache, unsigned long long dataSize)
+{
+    const unsigned mapBlocks = (m_width * m_height) / MapBlock::kCellsPerBlock;
+    const unsigned long long mapDataExpectedSize = (unsigned long long)MapBlock::kSize * mapBlocks;
+    if ((mapBlocks == 0) || (dataSize < mapDataExpectedSize))
         throw MalformedFileException("UOMap", m_filePath);
+    m_fileMinSize = getBlockFileOffset(mapBlocks - 1) + MapBlock::kSize;
+
+    loadDifFiles();
 
-    m_cachedMapBlocksCount = m_cachedStaticsBlocksCount = 0;
-    setupDataCache();
+    // Nothing is allocated here: the blocks are cached page by page, when they are needed.
+    if (!blockCache)
+    {
+        m_ownBlockCache = std::make_unique<UOMapBlockCache>();
+        blockCache = m_ownBlockCache.get();
+    }
+    m_blockCache = blockCache;
+    m_blockCacheOwnerId = m_blockCache->registerOwner();
+}
+
+void UOMap::loadDifFiles()
+{
+    // Blocks patched by the server through mapdifl*.mul + mapdif*.mul. The patches file is usually small, so it's mapped
+    //  for the whole lifetime of the map and read by readBlock without locking.
+    m_difIndex.clear();
+    m_difMappedFile.close();
+
+    const std::string index = std::to_string(m_fileIndex);
+    const std::string listFilePath = m_clientPath + "/mapdifl" + index + ".mul";
+    if (!isValidFile(listFilePath) || !m_difMappedFile.open(m_clientPath + "/mapdif" + index + ".mul"))
+        return;
+
+    const unsigned mapBlocks = (m_width * m_height) / MapBlock::kCellsPerBlock;
+    const unsigned patchesCount = unsigned(m_difMappedFile.size() / MapBlock::kSize);
+    if (!m_difIndex.load(listFilePath, mapBlocks, patchesCount) || m_difIndex.isEmpty())
+    {
+        m_difIndex.clear();
+        m_difMappedFile.close();
+    }
 }
 
 void UOMap::setCachePointers(UORadarCol* radarcol, UOStatics *statics_optional, UOHues *hues_optional)
@@ -119,32 +211,34 @@ void UOMap::closeStream()
     m_stream.close();
 }
 
-
-void UOMap::setupDataCache()
+bool UOMap::mapFile()
 {
-    if (!m_cachedMapBlocksCount)
+    if (m_mappedFile.isOpen())
+        return true;
+    if (!m_mappedFile.open(m_filePath))
+        return false;
+    // The constructor checked the file size, but it may have changed since then.
+    if (m_mappedFile.size() < m_fileMinSize)
     {
-        m_cachedMapBlocksCount = (m_width * m_height) / MapBlock::kCellsPerBlock;
-        m_cachedMapBlocks = std::make_unique<MapBlock[]>(m_cachedMapBlocksCount);
-        for (unsigned i = 0; i < m_cachedMapBlocksCount; ++i)
-            m_cachedMapBlocks[i].initialized = false;
+        m_mappedFile.close();
+        return false;
     }
+    return true;
+}
 
-    if (!m_cachedStaticsBlocksCount)
-    {
-        m_cachedStaticsBlocksCount = (m_width * m_height) / StaticsBlock::kTilesPerBlock;
-        m_cachedStaticsBlocks = std::make_unique<StaticsBlock[]>(m_cachedStaticsBlocksCount);
-        for (unsigned i = 0; i < m_cachedStaticsBlocksCount; ++i)
-            m_cachedStaticsBlocks[i].initialized = false;
-    }
+void UOMap::unmapFile()
+{
+    m_mappedFile.close();
 }
 
+
 void UOMap::freeDataCache()
 {
-    m_cachedMapBlocksCount = 0;
-    m_cachedMapBlocks.reset(nullptr);
-    m_cachedStaticsBlocksCount = 0;
-    m_cachedStaticsBlocks.reset(nullptr);
+    m_blockCache->dropOwner(m_blockCacheOwnerId);
+
+    unmapFile();
+    if (m_UOStatics)
+        m_UOStatics->unmapFile();
 }
 
 
@@ -156,20 +250,30 @@ unsigned int UOMap::getBlockIndex(unsigned int xTile, unsigned int yTile) const
     return (xBlock * yBlockCount) + yBlock;
 }
 
-const MapBlock* UOMap::getCacheMapBlock(unsigned int x, unsigned int y)
+UOMapBlockCache::PagePtr UOMap::getCachePage(unsigned int xTile, unsigned int yTile, unsigned int* blockInPage)
 {
-    if (!m_cachedMapBlocksCount)
-        setupDataCache();
+    const unsigned xBlock = xTile / MapBlock::kCellsPerRow;
+    const unsigned yBlock = yTile / MapBlock::kCellsPerColumn;
+    const unsigned yBlockCount = m_height / MapBlock::kCellsPerColumn;
+    const unsigned yPageCount = (yBlockCount + UOMapBlockCache::kPageBlocksPerColumn - 1) / UOMapBlockCache::kPageBlocksPerColumn;
+
+    const unsigned xPage = xBlock / UOMapBlockCache::kPageBlocksPerRow;
+    const unsigned yPage = yBlock / UOMapBlockCache::kPageBlocksPerColumn;
+    *blockInPage = ((yBlock % UOMapBlockCache::kPageBlocksPerColumn) * UOMapBlockCache::kPageBlocksPerRow) +
+            (xBlock % UOMapBlockCache::kPageBlocksPerRow);
+    return m_blockCache->getPage(m_blockCacheOwnerId, (xPage * yPageCount) + yPage);
+}
 
-    const unsigned int index = getBlockIndex(x, y);
-    MapBlock* mapBlock = &m_cachedMapBlocks[index];
+const MapBlock* UOMap::getCacheMapBlock(UOMapBlockCache::Page* page, unsigned int blockInPage, unsigned int xTile, unsigned int yTile)
+{
+    MapBlock* mapBlock = &page->mapBlocks[blockInPage];
     if (!mapBlock->initialized)
     {
-        bool openClose = !isStreamOpened();
+        bool openClose = !isFileMapped() && !isStreamOpened();
         if (openClose)
             openStream();
 
-        *mapBlock = readBlock(index);
+        *mapBlock = readBlock(getBlockIndex(xTile, yTile));
 
         if (openClose)
             closeStream();
@@ -178,28 +282,39 @@ const MapBlock* UOMap::getCacheMapBlock(unsigned int x, unsigned int y)
     return mapBlock;
 }
 
-const StaticsBlock* UOMap::getCacheStaticsBlock(unsigned int x, unsigned int y)
+const StaticsBlock* UOMap::getCacheStaticsBlock(UOMapBlockCache::Page* page, unsigned int blockInPage, unsigned int xTile, unsigned int yTile)
 {
-    const unsigned int index = m_UOStatics->getBlockIndex(x, y);
-
-    const UOIdx::Entry staticsBlockIdxEntry = m_UOStatics->readIdxToBlock(index);
-    if (staticsBlockIdxEntry.lookup == UOIdx::Entry::kInvalid)
-        return nullptr;
-
-    if (!m_cachedStaticsBlocksCount)
-        setupDataCache();
-
-    StaticsBlock *staticsBlock = &m_cachedStaticsBlocks[index];
+    // Check the cached block first: when drawing at a high scale factor we visit a lot of blocks just once or twice,
+    //  and looking up the idx of each one again would cost as much as the draw.
+    StaticsBlock *staticsBlock = &page->staticsBlocks[blockInPage];
     if (!staticsBlock->initialized)
     {
-        bool openClose = !m_UOStatics->isStreamOpened();
+        const unsigned int index = m_UOStatics->getBlockIndex(xTile, yTile);
+
+        bool patched;
+        const UOIdx::Entry staticsBlockIdxEntry = m_UOStatics->readIdxToBlock(index, &patched);
+        if (staticsBlockIdxEntry.lookup == UOIdx::Entry::kInvalid)
+        {
+            // No statics here: cache it as an empty block
+            staticsBlock->entriesCount = 0;
+            staticsBlock->initialized = true;
+            return staticsBlock;
+        }
+
+        bool openClose = !m_UOStatics->isFileMapped() && !m_UOStatics->isStreamOpened();
         if (openClose)
             m_UOStatics->openStream();
 
-        *staticsBlock = m_UOStatics->readBlock(staticsBlockIdxEntry);
+        *staticsBlock = m_UOStatics->readBlock(staticsBlockIdxEntry, patched);
 
         if (openClose)
             m_UOStatics->closeStream();
+
+        size_t staticsBytes = staticsBlock->entriesCount * sizeof(StaticsEntry);
+        if (staticsBlock->topItems)
+            staticsBytes += StaticsBlock::kTilesPerBlock * sizeof(unsigned short);
+        if (staticsBytes)
+            m_blockCache->addPageBytes(page, staticsBytes);
     }
 
     return staticsBlock;
@@ -219,7 +334,7 @@ const MapCell& UOMap::getCellFromBlock(const MapBlock& block, unsigned int xTile
 
 const MapCell& UOMap::readCell(unsigned int xTile, unsigned int yTile)
 {
-    if (!m_stream.is_open())
+    if (!isFileMapped() && !m_stream.is_open())
         throw InvalidStreamException("UOMap", "getCell accessing closed stream.");
 
     const MapBlock& block = readBlock(getBlockIndex(xTile, yTile));
@@ -228,12 +343,10 @@ const MapCell& UOMap::readCell(unsigned int xTile, unsigned int yTile)
 
 MapBlock UOMap::readBlock(unsigned int index)
 {
-    if (!m_stream.is_open())
+    const bool mapped = isFileMapped();
+    if (!mapped && !m_stream.is_open())
         throw InvalidStreamException("UOMap", "readBlock accessing closed stream.");
 
-    static const int kMapBlockSize = 4 + (MapBlock::kCellsPerBlock * 3);
-    m_stream.seekg(index * kMapBlockSize);
-
     MapBlock block;
     block.initialized = false;
     /*
@@ -244,8 +357,27 @@ MapBlock UOMap::readBlock(unsigned int index)
         m_stream.read(reinterpret_cast<char*>(&block.cells[i].z), 1);
     }
     */
-    char buf[4 + (3 * MapBlock::kCellsPerBlock)];
-    m_stream.read(buf, sizeof(buf));
+    char streamBuf[MapBlock::kSize];
+    const char* buf;
+    // The patched blocks come from the difference file, the others from the map file
+    const unsigned int difPatch = m_difIndex.getPatch(index);
+    const bool fromStream = !mapped && (difPatch == UODifIndex::kNoPatch);
+    if (difPatch != UODifIndex::kNoPatch)
+    {
+        // the index contains only the patches inside the file
+        buf = m_difMappedFile.data() + (size_t(difPatch) * MapBlock::kSize);
+    }
+    else if (mapped)
+    {
+        // mapFile checked that the file is big enough for all the blocks
+        buf = m_mappedFile.data() + getBlockFileOffset(index);
+    }
+    else
+    {
+        m_stream.seekg(std::streamoff(getBlockFileOffset(index)));
+        m_stream.read(streamBuf, sizeof(streamBuf));
+        buf = streamBuf;
+    }
 
     unsigned off = 0;
     memcpy(&block.header, buf, 4);  off += 4;
@@ -255,7 +387,7 @@ MapBlock UOMap::readBlock(unsigned int index)
         memcpy(&block.cells[i].z,  buf + off, 1);   off += 1;
     }
 
-    if (!m_stream.good())
+    if (fromStream && !m_stream.good())
         throw InvalidStreamException("UOMap", "readBlock I/O error");
 
     block.initialized = true;
@@ -265,8 +397,14 @@ MapBlock UOMap::readBlock(unsigned int index)
 
 char UOMap::getTopZAtXY(unsigned int x, unsigned int y)
 {
-    const MapBlock *mb = getCacheMapBlock(x, y);
-    const StaticsBlock *sb = !m_UOStatics ? nullptr : getCacheStaticsBlock(x, y);
+    // The map may have been shown only through the pre-rendered tiles, so drawRectInImage hasn't cached the idx yet
+    if (m_UOStatics && !m_UOStatics->hasIdxCache())
+        m_UOStatics->cacheIdxData();
+
+    unsigned int blockInPage;
+    const UOMapBlockCache::PagePtr page = getCachePage(x, y, &blockInPage);
+    const MapBlock *mb = getCacheMapBlock(page.get(), blockInPage, x, y);
+    const StaticsBlock *sb = !m_UOStatics ? nullptr : getCacheStaticsBlock(page.get(), blockInPage, x, y);
 
     const char zTile = getCellFromBlock(*mb, x, y).z;
     if (sb)
@@ -309,6 +447,95 @@ void UOMap::clipCoordsToMapSize(unsigned int *xMapStart, unsigned int *yMapStart
         *height = m_height - *yMapStart;
 }
 
+struct UOMap::DrawRectParams
+{
+    uchar *imageBits;
+    int imageBytesPerLine;
+    int xImageOffset, yImageOffset;
+    unsigned int xMapStart, yMapStart;
+    unsigned int scaleFactor;
+    int colFirst, colEnd;
+    bool drawStatics;
+};
+
+// Draw the pixel rows from rowStart to rowEnd, which have to sample map tiles belonging to the same row of map blocks.
+// Different rows of blocks touch different map and statics blocks, so they can be drawn by different threads,
+//  as long as the files are mapped (readBlock doesn't touch the streams). The block cache is thread safe, and the pages
+//  we are using stay alive even if they get evicted in the meantime.
+void UOMap::drawBlockRowInImage(const DrawRectParams& params, int rowStart, int rowEnd)
+{
+    const unsigned scaleFactor = params.scaleFactor;
+    const unsigned step = 1u << scaleFactor;
+    const unsigned yMap = params.yMapStart + (unsigned(rowStart) << scaleFactor);
+    const unsigned yInBlock = yMap & (MapBlock::kCellsPerColumn - 1);
+
+    // Consecutive blocks in the row usually lie in the same cache page
+    UOMapBlockCache::PagePtr page;
+    unsigned pageRowEnd = 0;
+
+    for (int col = params.colFirst; col < params.colEnd; )
+    {
+        const unsigned xMap = params.xMapStart + (unsigned(col) << scaleFactor);
+        const unsigned xInBlock = xMap & (MapBlock::kCellsPerRow - 1);
+        const int colBlockEnd = std::min(params.colEnd, col + int((MapBlock::kCellsPerRow - xInBlock + step - 1) >> scaleFactor));
+
+        unsigned blockInPage;
+        if (!page || (xMap >= pageRowEnd))
+        {
+            page = getCachePage(xMap, yMap, &blockInPage);
+            constexpr unsigned kPageWidth = UOMapBlockCache::kPageBlocksPerRow * MapBlock::kCellsPerRow;
+            pageRowEnd = (xMap - (xMap % kPageWidth)) + kPageWidth;
+        }
+        else
+        {
+            blockInPage = ((yMap / MapBlock::kCellsPerColumn) % UOMapBlockCache::kPageBlocksPerColumn) * UOMapBlockCache::kPageBlocksPerRow +
+                    ((xMap / MapBlock::kCellsPerRow) % UOMapBlockCache::kPageBlocksPerRow);
+        }
+
+        const MapBlock *mapBlock = getCacheMapBlock(page.get(), blockInPage, xMap, yMap);
+        const StaticsBlock *staticsBlock = params.drawStatics ? getCacheStaticsBlock(page.get(), blockInPage, xMap, yMap) : nullptr;
+        if (staticsBlock && (staticsBlock->entriesCount == 0))
+            staticsBlock = nullptr;
+
+        unsigned yCell = yInBlock;
+        for (int r = rowStart; r < rowEnd; ++r, yCell += step)
+        {
+            QRgb *scanLine = reinterpret_cast<QRgb*>(params.imageBits + ((params.yImageOffset + r) * params.imageBytesPerLine)) + params.xImageOffset;
+            const MapCell *cellsRow = &mapBlock->cells[yCell * MapBlock::kCellsPerRow];
+
+            unsigned xCell = xInBlock;
+            for (int c = col; c < colBlockEnd; ++c, xCell += step)
+            {
+                const MapCell& mapCell = cellsRow[xCell];
+                bool drawingLandtile = true;
+                ARGB32 tileColor;
+
+                // Get highest static tile at coordinates
+                StaticsEntry highestStatic;
+                if (staticsBlock && staticsBlock->getTopItem(&highestStatic, static_cast<unsigned char>(xCell), static_cast<unsigned char>(yCell)))
+                {
+                    if (highestStatic.z >= mapCell.z)
+                    {
+                        drawingLandtile = false;
+                        tileColor = m_UORadarcol->getItemColor32(highestStatic.id);
+
+                        // Do we need to hue it?
+                        if (m_UOHues && (highestStatic.hue > 0))
+                            tileColor = m_UOHues->getHueEntry(highestStatic.hue - 1).applyToColor32(tileColor);
+                    }
+                }
+                if (drawingLandtile)
+                    tileColor = m_UORadarcol->getLandColor32(mapCell.id);
+
+                // Draw tile
+                scanLine[c] = tileColor.getVal();
+            }
+        }
+
+        col = colBlockEnd;
+    }
+}
+
 bool UOMap::drawRectInImage(QImage *image, int xImageOffset, int yImageOffset, std::function<void (int)> reportProgress,
                             unsigned int xMapStart, unsigned int yMapStart, unsigned int width, unsigned int height,
                             unsigned int scaleFactor, bool drawStatics)
@@ -316,6 +543,10 @@ bool UOMap::drawRectInImage(QImage *image, int xImageOffset, int yImageOffset, s
     if (!m_UORadarcol)
         throw NoCachePtrException("UOMap");
 
+    // We write straight into the scanlines, so we need 32 bits per pixel (RGB32 or ARGB32).
+    if (image->depth() != 32)
+        return false;
+
     if (scaleFactor > kScaleFactorMax)
         scaleFactor = kScaleFactorMax;
     //else if (scaleFactor < kScaleFactorMin)
@@ -329,122 +560,88 @@ bool UOMap::drawRectInImage(QImage *image, int xImageOffset, int yImageOffset, s
             m_UOStatics->cacheIdxData();
     }
 
-    const int destImageWidth = image->width(), destImageHeight = image->height();
-
     unsigned widthScaled = width, heightScaled = height;
     scaleCoordsMapToImage(scaleFactor, &widthScaled, &heightScaled);
 
-    const unsigned long long pixelsToDraw = widthScaled * heightScaled;
-    unsigned long long pixelsDrawn = 0;
-    int progressVal = 0;
+    // We draw one pixel every (1 << scaleFactor) tiles, both horizontally and vertically: the pixel (col, row) of the drawn
+    //  rect samples the map tile (xMapStart + (col << scaleFactor), yMapStart + (row << scaleFactor)).
+    // Clip the pixel rect to the destination image.
+    const int colFirst = std::max(0, -xImageOffset);
+    const int rowFirst = std::max(0, -yImageOffset);
+    const int colEnd = std::min(int(widthScaled), image->width() - xImageOffset);
+    const int rowEnd = std::min(int(heightScaled), image->height() - yImageOffset);
+    if ((colFirst >= colEnd) || (rowFirst >= rowEnd))
+        return true;
+
+    // Split the rows in bands, one for each row of map blocks: each band is a unit of work for the threads.
+    const unsigned step = 1u << scaleFactor;
+    std::vector<int> bandStarts;
+    for (int row = rowFirst; row < rowEnd; )
+    {
+        bandStarts.push_back(row);
+        const unsigned yInBlock = (yMapStart + (unsigned(row) << scaleFactor)) & (MapBlock::kCellsPerColumn - 1);
+        // How many of the sampled rows fall inside this block row?
+        row = std::min(rowEnd, row + int((MapBlock::kCellsPerColumn - yInBlock + step - 1) >> scaleFactor));
+    }
+    bandStarts.push_back(rowEnd);
+    const int bandsCount = int(bandStarts.size()) - 1;
+
+    // Render in parallel only if every thread can read the blocks without touching the streams.
+    // If a file can't be mapped (e.g. address space exhausted on a 32 bits build) we fall back to the streams and stay serial:
+    //  there's a single std::ifstream per file, with its own read position, which can't be shared between threads, and
+    //  opening a stream per thread would cost more than what we would gain.
+    bool parallel = mapFile();
+    if (parallel && drawStatics)
+        parallel = m_UOStatics->mapFile();
+    if (parallel)
+    {
+        if (isStreamOpened())
+            closeStream();
+        if (drawStatics && m_UOStatics->isStreamOpened())
+            m_UOStatics->closeStream();
+    }
+    else
+    {
+        if (!isFileMapped() && !isStreamOpened())
+            openStream();
+        if (drawStatics && !m_UOStatics->isFileMapped() && !m_UOStatics->isStreamOpened())
+            m_UOStatics->openStream();
+    }
 
-    int xImage = 0, yImage = 0;
-    int xTileRelative = -1, yTileRelative = -1;
+    const DrawRectParams params = {image->bits(), image->bytesPerLine(), xImageOffset, yImageOffset,
+                                   xMapStart, yMapStart, scaleFactor, colFirst, colEnd, drawStatics};
 
-    for (unsigned x = xMapStart, xEnd = xMapStart + width; x < xEnd; ++x)
+    // The workers only bump a counter, the progress is reported by the calling thread (the master thread of the team)
+    //  to avoid contention and concurrent calls to the callback.
+    std::atomic<int> bandsDone(0);
+    int progressVal = 0;
+    auto updateProgress = [&]()
     {
-        if ((xImage >= int(widthScaled)) || (xImage >= destImageWidth))
-            break;
-
-        if (scaleFactor)
+        const int progressValNow = int( (bandsDone.load(std::memory_order_relaxed) * 100LL) / bandsCount );
+        if (progressValNow > progressVal)
         {
-            ++xTileRelative;
-            // since we want the modulo for a power of 2, we can use the AND operator
-            if ((scaleFactor == 1) && (xTileRelative & 1))//(xTileRelative % 2))
-                continue;
-            if ((scaleFactor == 2) && (xTileRelative & 3))//(xTileRelative % 4))
-                continue;
-            if ((scaleFactor == 3) && (xTileRelative & 7))//(xTileRelative % 8))
-                continue;
-            if ((scaleFactor == 4) && (xTileRelative & 15))//(xTileRelative % 16))
-                continue;
-            xTileRelative = 0;
+            progressVal = progressValNow;
+            reportProgress(progressVal);
         }
+    };
 
-        yImage = -1;
-        for (unsigned y = yMapStart, yEnd = yMapStart + height; y < yEnd; ++y)
-        {
-            if ((yImage >= int(heightScaled)) || (yImage >= destImageHeight))
-                break;
-
-            if (scaleFactor)
-            {
-                ++yTileRelative;
-                if ((scaleFactor == 1) && (yTileRelative & 1))//(yTileRelative % 2))
-                    continue;
-                if ((scaleFactor == 2) && (yTileRelative & 3))//(yTileRelative % 4))
-                    continue;
-                if ((scaleFactor == 3) && (yTileRelative & 7))//(yTileRelative % 8))
-                    continue;
-                if ((scaleFactor == 4) && (yTileRelative & 15))//(yTileRelative % 16))
-                    continue;
-                yTileRelative = 0;
-            }
-
-            ++yImage;
-
-            const uint pixelVal = image->pixel(xImageOffset + xImage, yImageOffset + yImage);
-            // new qimage is manually initialized by fill(kUninitializedRGB), if the color is different, no need to redraw existing pixel
-            if ((pixelVal & 0x00FFFFFF) == kUninitializedRGB) // ignore alpha bits to check if the pixel color is pure white
-            {
-                // Get map block
-                if (!isStreamOpened())
-                    openStream();
-
-                const MapBlock* mapBlock = getCacheMapBlock(x, y);
-
-                // Get map cell
-                const MapCell& mapCell = getCellFromBlock(*mapBlock, x, y);
-                bool drawingLandtile = true;
-                ARGB32 tileColor;
-
-                if (drawStatics)
-                {
-                    if (!m_UOStatics->isStreamOpened())
-                        m_UOStatics->openStream();
-
-                    // Get statics block
-                    const StaticsBlock *staticsBlock = getCacheStaticsBlock(x, y);
-                    if (staticsBlock)
-                    {
-                        // Get highest static tile at coordinates
-                        StaticsEntry highestStatic;
-                        if (m_UOStatics->getTopItemFromBlock(&highestStatic, *staticsBlock, x, y))
-                        {
-                            if (highestStatic.z >= mapCell.z)
-                            {
-                                drawingLandtile = false;
-                                tileColor = m_UORadarcol->getItemColor32(highestStatic.id);
-
-                                // Do we need to hue it?
-                                if (m_UOHues && (highestStatic.hue > 0))
-                                    tileColor = m_UOHues->getHueEntry(highestStatic.hue - 1).applyToColor32(tileColor);
-                            }
-                        }
-                    }
-                }
-                if (drawingLandtile)
-                    tileColor = m_UORadarcol->getLandColor32(mapCell.id);
-
-                // Draw tile
-                image->setPixel(xImageOffset + xImage, yImageOffset + yImage, tileColor.getVal());
-            }
-
-            // Report progress
-            if (reportProgress)
-            {
-                ++pixelsDrawn;
-                const int progressValNow = int( (pixelsDrawn * 100) / pixelsToDraw);
-                if (progressValNow > progressVal)
-                {
-                    progressVal = progressValNow;
-                    reportProgress(progressVal);
-                }
-            }
-        }
-        ++xImage;
+    #pragma omp parallel for schedule(dynamic) if(parallel)
+    for (int band = 0; band < bandsCount; ++band)
+    {
+        drawBlockRowInImage(params, bandStarts[size_t(band)], bandStarts[size_t(band) + 1]);
+        bandsDone.fetch_add(1, std::memory_order_relaxed);
+
+#ifdef _OPENMP
+        if (reportProgress && (omp_get_thread_num() == 0))
+#else
+        if (reportProgress)
+#endif
+            updateProgress();
     }
 
+    if (reportProgress)
+        updateProgress();
+
     if (isStreamOpened())
         closeStream();
     if (drawStatics && m_UOStatics->isStreamOpened())
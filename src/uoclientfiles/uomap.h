@@ -1,8 +1,11 @@
 #ifndef UOMAP_H
 #define UOMAP_H
 
+#include "uodifindex.h"
+#include "uomapblockcache.h"
 #include "uostatics.h"
 #include <functional>
+#include <vector>
 
 class QRect;
 class QImage;
@@ -43,13 +46,24 @@ public:
     static constexpr unsigned int kMaxSupportedMap = 5;
     static constexpr unsigned int kScaleFactorMin = 0;
     static constexpr unsigned int kScaleFactorMax = 4;
+    // In map*LegacyMUL.uop the map data is split in uncompressed files (chunks) of this many blocks, in the same order of the MUL
+    static constexpr unsigned int kUOPBlocksPerChunk = 4096;
 
-    // better using a virtually unused color on the map, to avoid unnecessary redrawings
+    // background of the images not drawn yet (drawRectInImage always draws every pixel of the rect, the callers keep track
+    //  of which parts are drawn)
     static constexpr unsigned int kUninitializedRGB = 0x00ff70; //0xF0F0F0; // aa(ignore alpha value) rr gg bb
 
 
-    UOMap(const std::string& clientPath, unsigned int fileIndex);
-    UOMap(const std::string& clientPath, unsigned int fileIndex, unsigned int width, unsigned int height); // for custom sized maps
+    // If no block cache is given, the map gets a private one, with the default budget.
+    UOMap(const std::string& clientPath, unsigned int fileIndex, UOMapBlockCache* blockCache = nullptr);
+    UOMap(const std::string& clientPath, unsigned int fileIndex, unsigned int width, unsigned int height,  // for custom sized maps
+          UOMapBlockCache* blockCache = nullptr);
+    ~UOMap();
+    // The file the map data is read from: map*LegacyMUL.uop if present (like the client does), otherwise map*.mul.
+    static std::string getMapFilePath(const std::string& clientPath, unsigned int fileIndex);
+    inline bool isUOP() const {
+        return !m_uopChunkOffsets.empty();
+    }
     void setCachePointers(UORadarCol* radarcol, UOStatics* statics_optional = nullptr, UOHues* hues_optional = nullptr);
 
     inline bool isStreamOpened() const {
@@ -57,7 +71,13 @@ public:
     }
     void openStream();
     void closeStream();
-    void setupDataCache();
+    // While the file is mapped, readBlock reads from the mapping instead of the stream, and it can be called by multiple threads.
+    bool mapFile();
+    void unmapFile();
+    inline bool isFileMapped() const {
+        return m_mappedFile.isOpen();
+    }
+    // Drop the cached blocks of this map and release the file mappings.
     void freeDataCache();
 
     inline unsigned int getWidth() const {
@@ -68,8 +88,12 @@ public:
     }
 
     unsigned int getBlockIndex(unsigned int xTile, unsigned int yTile) const noexcept;
-    const MapBlock*     getCacheMapBlock(unsigned int x, unsigned int y);
-    const StaticsBlock *getCacheStaticsBlock(unsigned int x, unsigned int y);
+    // Position of the block in the map file
+    inline unsigned long long getBlockFileOffset(unsigned int index) const noexcept {
+        if (m_uopChunkOffsets.empty())
+            return (unsigned long long)index * MapBlock::kSize;
+        return m_uopChunkOffsets[index / kUOPBlocksPerChunk] + ((unsigned long long)(index % kUOPBlocksPerChunk) * MapBlock::kSize);
+    }
 
     const MapCell&  getCellFromBlock(const MapBlock& block, unsigned int xTile, unsigned int yTile) const;
     const MapCell&  readCell(unsigned int xTile, unsigned int yTile);
@@ -93,21 +117,38 @@ public:
                      unsigned int scaleFactor = 1, bool drawStatics = true);
 
 private:
+    // Find the map file and return the size of the map data it contains; for the UOP, locate the chunks inside the package.
+    unsigned long long setupFile();
+    static std::string getUOPFilePath(const std::string& clientPath, unsigned int fileIndex);
+    void init(UOMapBlockCache* blockCache, unsigned long long dataSize);
+    void loadDifFiles();
+    // Get the cache page holding the block at the given coordinates, and the position of the block inside it.
+    UOMapBlockCache::PagePtr getCachePage(unsigned int xTile, unsigned int yTile, unsigned int* blockInPage);
+    const MapBlock*     getCacheMapBlock(UOMapBlockCache::Page* page, unsigned int blockInPage, unsigned int xTile, unsigned int yTile);
+    const StaticsBlock *getCacheStaticsBlock(UOMapBlockCache::Page* page, unsigned int blockInPage, unsigned int xTile, unsigned int yTile);
+
+    struct DrawRectParams;
+    void drawBlockRowInImage(const DrawRectParams& params, int rowStart, int rowEnd);
+
     std::string m_clientPath;
     std::string m_filePath;
     unsigned int m_fileIndex;
     unsigned int m_width, m_height;
 
     std::ifstream m_stream;
+    MappedFile m_mappedFile;
+    unsigned long long m_fileMinSize;   // to contain all the blocks
+    std::vector<unsigned long long> m_uopChunkOffsets;  // UOP only: where the data of each chunk starts in the package
+    UODifIndex m_difIndex;          // blocks patched by mapdif*.mul
+    MappedFile m_difMappedFile;
     UORadarCol *m_UORadarcol;
     UOStatics *m_UOStatics;
     UOHues *m_UOHues;
     //UOTiledata
 
-    unsigned int m_cachedMapBlocksCount;
-    std::unique_ptr<MapBlock[]> m_cachedMapBlocks;
-    unsigned int m_cachedStaticsBlocksCount;
-    std::unique_ptr<StaticsBlock[]> m_cachedStaticsBlocks;
+    std::unique_ptr<UOMapBlockCache> m_ownBlockCache;
+    UOMapBlockCache* m_blockCache;
+    unsigned int m_blockCacheOwnerId;
 };
 
 
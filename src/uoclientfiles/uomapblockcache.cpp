@@ -0,0 +1,129 @@
+#include "uomapblockcache.h"
+#include "uomap.h"
+
+
+namespace uocf
+{
+
+
+UOMapBlockCache::Page::Page() :
+    mapBlocks(std::make_unique<MapBlock[]>(kBlocksPerPage)),        // value-initialized: no block is initialized
+    staticsBlocks(std::make_unique<StaticsBlock[]>(kBlocksPerPage)),
+    m_bytes(sizeof(Page) + (kBlocksPerPage * (sizeof(MapBlock) + sizeof(StaticsBlock)))),
+    m_cached(false)
+{
+}
+
+UOMapBlockCache::Page::~Page() = default;
+
+
+UOMapBlockCache::UOMapBlockCache(size_t budgetBytes) :
+    m_budget(budgetBytes), m_usedBytes(0), m_lastOwnerId(0)
+{
+}
+
+void UOMapBlockCache::setBudget(size_t budgetBytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_budget = budgetBytes;
+    evictUnlocked(nullptr);
+}
+
+size_t UOMapBlockCache::getBudget() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_budget;
+}
+
+size_t UOMapBlockCache::getUsedBytes() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_usedBytes;
+}
+
+unsigned int UOMapBlockCache::registerOwner()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return ++m_lastOwnerId;
+}
+
+void UOMapBlockCache::dropOwner(unsigned int ownerId)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto it = m_lru.begin(); it != m_lru.end(); )
+    {
+        if ((it->first >> 32) != ownerId)
+        {
+            ++it;
+            continue;
+        }
+        Page* page = it->second.get();
+        page->m_cached = false;
+        m_usedBytes -= page->m_bytes;
+        m_pages.erase(it->first);
+        it = m_lru.erase(it);
+    }
+}
+
+void UOMapBlockCache::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto& entry : m_lru)
+        entry.second->m_cached = false;
+    m_lru.clear();
+    m_pages.clear();
+    m_usedBytes = 0;
+}
+
+UOMapBlockCache::PagePtr UOMapBlockCache::getPage(unsigned int ownerId, unsigned int pageIndex)
+{
+    const Key key = makeKey(ownerId, pageIndex);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto found = m_pages.find(key);
+    if (found != m_pages.end())
+    {
+        // Move it to the front of the LRU list
+        m_lru.splice(m_lru.begin(), m_lru, found->second);
+        return found->second->second;
+    }
+
+    PagePtr page = std::make_shared<Page>();
+    page->m_cached = true;
+    m_usedBytes += page->m_bytes;
+    m_lru.emplace_front(key, page);
+    m_pages.emplace(key, m_lru.begin());
+
+    evictUnlocked(page.get());
+    return page;
+}
+
+void UOMapBlockCache::addPageBytes(Page* page, size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    page->m_bytes += bytes;
+    if (!page->m_cached)
+        return;     // already evicted, it will be freed when the last user releases it
+    m_usedBytes += bytes;
+    evictUnlocked(page);
+}
+
+void UOMapBlockCache::evictUnlocked(const Page* keep)
+{
+    // Walk from the least recently used page, skipping the one we are using
+    auto it = m_lru.end();
+    while ((m_usedBytes > m_budget) && (it != m_lru.begin()))
+    {
+        --it;
+        Page* page = it->second.get();
+        if (page == keep)
+            continue;
+        page->m_cached = false;
+        m_usedBytes -= page->m_bytes;
+        m_pages.erase(it->first);
+        it = m_lru.erase(it);
+    }
+}
+
+
+}
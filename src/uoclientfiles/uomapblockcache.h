@@ -0,0 +1,82 @@
+#ifndef UOMAPBLOCKCACHE_H
+#define UOMAPBLOCKCACHE_H
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+
+namespace uocf
+{
+
+struct MapBlock;
+struct StaticsBlock;
+
+
+// Sparse cache of map and statics blocks, shared by all the map planes.
+// The blocks are grouped in pages of 8x8 blocks, allocated only when a block inside them is requested and
+//  evicted (least recently used first) when the memory used by the cache exceeds the budget.
+class UOMapBlockCache
+{
+public:
+    static constexpr unsigned int kPageBlocksPerRow = 8;
+    static constexpr unsigned int kPageBlocksPerColumn = 8;
+    static constexpr unsigned int kBlocksPerPage = kPageBlocksPerRow * kPageBlocksPerColumn;
+    static constexpr size_t kDefaultBudget = size_t(256) * 1024 * 1024;
+
+    struct Page
+    {
+        Page();
+        ~Page();    // not inlined: MapBlock is incomplete here
+
+        // Blocks are stored left to right, top to bottom. Each block is read from the files by the UOMap owning the page.
+        std::unique_ptr<MapBlock[]> mapBlocks;
+        std::unique_ptr<StaticsBlock[]> staticsBlocks;
+
+    private:
+        friend class UOMapBlockCache;
+        size_t m_bytes;     // guarded by the cache mutex
+        bool m_cached;      // guarded by the cache mutex
+    };
+    // A page stays valid as long as someone holds a pointer to it, even if in the meantime it's evicted from the cache.
+    using PagePtr = std::shared_ptr<Page>;
+
+    UOMapBlockCache(size_t budgetBytes = kDefaultBudget);
+
+    void setBudget(size_t budgetBytes);
+    size_t getBudget() const;
+    size_t getUsedBytes() const;
+
+    // Each map plane gets its own id, used to tell apart its pages.
+    unsigned int registerOwner();
+    // Discard all the pages of an owner.
+    void dropOwner(unsigned int ownerId);
+    void clear();
+
+    // Get a page of the owner, allocating it if it isn't in the cache. Thread safe.
+    PagePtr getPage(unsigned int ownerId, unsigned int pageIndex);
+    // Account the memory allocated by the owner to load the blocks of a page (statics entries). Thread safe.
+    void addPageBytes(Page* page, size_t bytes);
+
+private:
+    using Key = unsigned long long;
+    using LRUList = std::list<std::pair<Key, PagePtr>>;
+
+    static Key makeKey(unsigned int ownerId, unsigned int pageIndex) noexcept {
+        return (Key(ownerId) << 32) | pageIndex;
+    }
+    void evictUnlocked(const Page* keep);
+
+    mutable std::mutex m_mutex;
+    size_t m_budget;
+    size_t m_usedBytes;
+    unsigned int m_lastOwnerId;
+    LRUList m_lru;      // most recently used at the front
+    std::unordered_map<Key, LRUList::iterator> m_pages;
+};
+
+
+}
+
+#endif // UOMAPBLOCKCACHE_H
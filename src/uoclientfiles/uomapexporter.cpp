@@ -0,0 +1,284 @@
+#include "uomapexporter.h"
+
+#include <QImage>
+#include <algorithm>    // for std::min
+#include <cstdio>       // for remove
+#include <fstream>
+#include <memory>
+#include <vector>
+
+#include "../cpputils/sysio.h"
+#include "../uoppackage/zlib.h"
+#include "uomap.h"
+
+#include "../globals.h"
+#define LOG(x) appendToLog(x)
+
+
+namespace uocf
+{
+
+
+// Writes the image to the file a row at a time, each row being 24 bits RGB.
+class ImageRowWriter
+{
+public:
+    virtual ~ImageRowWriter() = default;
+    virtual bool open(const std::string& filePath, unsigned int width, unsigned int height) = 0;
+    virtual bool writeRow(const unsigned char* rgbRow) = 0;
+    virtual bool close() = 0;
+
+protected:
+    std::ofstream m_fout;
+    unsigned int m_rowBytes = 0;
+};
+
+class RawRowWriter : public ImageRowWriter
+{
+public:
+    bool open(const std::string& filePath, unsigned int width, unsigned int /*height*/) override
+    {
+        m_rowBytes = width * 3;
+        m_fout.open(filePath, std::ios::out | std::ios::binary | std::ios::trunc);
+        return m_fout.is_open();
+    }
+    bool writeRow(const unsigned char* rgbRow) override
+    {
+        m_fout.write(reinterpret_cast<const char*>(rgbRow), std::streamsize(m_rowBytes));
+        return m_fout.good();
+    }
+    bool close() override
+    {
+        m_fout.close();
+        return !m_fout.fail();
+    }
+};
+
+// The rows are deflated as they come, and each time the output buffer is full it's written as an IDAT chunk.
+class PNGRowWriter : public ImageRowWriter
+{
+public:
+    ~PNGRowWriter() override
+    {
+        if (m_zInitialized)
+            deflateEnd(&m_zStream);
+    }
+
+    bool open(const std::string& filePath, unsigned int width, unsigned int height) override
+    {
+        m_rowBytes = width * 3;
+        m_fout.open(filePath, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!m_fout.is_open())
+            return false;
+
+        static constexpr unsigned char kSignature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+        m_fout.write(reinterpret_cast<const char*>(kSignature), sizeof(kSignature));
+
+        unsigned char ihdr[13];
+        putBigEndian(ihdr, width);
+        putBigEndian(ihdr + 4, height);
+        ihdr[8] = 8;    // bit depth
+        ihdr[9] = 2;    // color type: RGB
+        ihdr[10] = 0;   // compression method: deflate
+        ihdr[11] = 0;   // filter method: adaptive (we use filter type None for every row)
+        ihdr[12] = 0;   // no interlace
+        writeChunk("IHDR", ihdr, sizeof(ihdr));
+
+        m_zStream = z_stream{};
+        if (deflateInit(&m_zStream, Z_DEFAULT_COMPRESSION) != Z_OK)
+            return false;
+        m_zInitialized = true;
+        m_outBuffer.resize(kOutBufferSize);
+        m_zStream.next_out = m_outBuffer.data();
+        m_zStream.avail_out = uInt(m_outBuffer.size());
+        m_rowBuffer.resize(size_t(m_rowBytes) + 1);
+        m_rowBuffer[0] = 0;     // filter type: None
+        return m_fout.good();
+    }
+
+    bool writeRow(const unsigned char* rgbRow) override
+    {
+        std::copy(rgbRow, rgbRow + m_rowBytes, m_rowBuffer.begin() + 1);
+        m_zStream.next_in = m_rowBuffer.data();
+        m_zStream.avail_in = uInt(m_rowBuffer.size());
+        while (m_zStream.avail_in > 0)
+        {
+            if (deflate(&m_zStream, Z_NO_FLUSH) != Z_OK)
+                return false;
+            if ((m_zStream.avail_out == 0) && !flushOutBuffer())
+                return false;
+        }
+        return m_fout.good();
+    }
+
+    bool close() override
+    {
+        int zResult;
+        do
+        {
+            zResult = deflate(&m_zStream, Z_FINISH);
+            if ((zResult != Z_OK) && (zResult != Z_STREAM_END))
+                return false;
+            if (!flushOutBuffer())
+                return false;
+        } while (zResult != Z_STREAM_END);
+        deflateEnd(&m_zStream);
+        m_zInitialized = false;
+
+        writeChunk("IEND", nullptr, 0);
+        m_fout.close();
+        return !m_fout.fail();
+    }
+
+private:
+    static constexpr size_t kOutBufferSize = 256 * 1024;
+
+    static void putBigEndian(unsigned char* dest, uint32_t val)
+    {
+        dest[0] = static_cast<unsigned char>(val >> 24);
+        dest[1] = static_cast<unsigned char>(val >> 16);
+        dest[2] = static_cast<unsigned char>(val >> 8);
+        dest[3] = static_cast<unsigned char>(val);
+    }
+
+    void writeChunk(const char* type, const unsigned char* data, uint32_t size)
+    {
+        unsigned char buf[4];
+        putBigEndian(buf, size);
+        m_fout.write(reinterpret_cast<const char*>(buf), 4);
+        m_fout.write(type, 4);
+        uLong crc = crc32(0, reinterpret_cast<const Bytef*>(type), 4);
+        if (size > 0)
+        {
+            m_fout.write(reinterpret_cast<const char*>(data), std::streamsize(size));
+            crc = crc32(crc, data, size);
+        }
+        putBigEndian(buf, uint32_t(crc));
+        m_fout.write(reinterpret_cast<const char*>(buf), 4);
+    }
+
+    bool flushOutBuffer()
+    {
+        const uint32_t size = uint32_t(m_outBuffer.size() - m_zStream.avail_out);
+        if (size > 0)
+            writeChunk("IDAT", m_outBuffer.data(), size);
+        m_zStream.next_out = m_outBuffer.data();
+        m_zStream.avail_out = uInt(m_outBuffer.size());
+        return m_fout.good();
+    }
+
+    z_stream m_zStream = {};
+    bool m_zInitialized = false;
+    std::vector<unsigned char> m_outBuffer;
+    std::vector<unsigned char> m_rowBuffer;     // filter type byte + pixels
+};
+
+
+// static
+const char* UOMapExporter::getFileExtension(Format format)
+{
+    return (format == Format::PNG) ? "png" : "rgb";
+}
+
+// static
+bool UOMapExporter::exportMap(UOMap* map, unsigned int scaleFactor, bool drawStatics, Format format, const std::string& filePath,
+                              std::function<void (int)> reportProgress)
+{
+    if (scaleFactor > UOMap::kScaleFactorMax)
+        scaleFactor = UOMap::kScaleFactorMax;
+
+    unsigned int width = map->getWidth(), height = map->getHeight();
+    UOMap::scaleCoordsMapToImage(scaleFactor, &width, &height);
+    if ((width == 0) || (height == 0))
+        return false;
+
+    // Write to a temporary file, replacing the destination one only when the export succeeds:
+    //  a failed export doesn't leave a truncated image, nor destroys the one from a previous export.
+    const std::string tempPath = filePath + ".tmp";
+    std::unique_ptr<ImageRowWriter> writer;
+    if (format == Format::PNG)
+        writer = std::make_unique<PNGRowWriter>();
+    else
+        writer = std::make_unique<RawRowWriter>();
+    auto discardTempFile = [&writer, &tempPath]()
+    {
+        writer.reset();     // close the file first
+        remove(tempPath.c_str());
+    };
+    if (!writer->open(tempPath, width, height))
+    {
+        LOG("Error opening (write) " + tempPath);
+        discardTempFile();
+        return false;
+    }
+
+    // The only big allocation: one strip of the image. The blocks are kept in the map block cache, which has its own budget.
+    QImage strip(int(width), int(kStripHeight), QImage::Format_RGB32);
+    std::vector<unsigned char> rgbRow(size_t(width) * 3);
+    const unsigned int stripsCount = (height + kStripHeight - 1) / kStripHeight;
+    try
+    {
+        for (unsigned int strip_i = 0; strip_i < stripsCount; ++strip_i)
+        {
+            const unsigned int yStripStart = strip_i * kStripHeight;
+            const unsigned int stripHeight = std::min(kStripHeight, height - yStripStart);
+
+            unsigned int xMapStart = 0, yMapStart = yStripStart;
+            unsigned int mapWidth = width, mapHeight = stripHeight;
+            UOMap::scaleCoordsImageToMap(scaleFactor, &xMapStart, &yMapStart);
+            UOMap::scaleCoordsImageToMap(scaleFactor, &mapWidth, &mapHeight);
+            map->clipCoordsToMapSize(&xMapStart, &yMapStart, &mapWidth, &mapHeight);
+            if (!map->drawRectInImage(&strip, 0, 0, nullptr, xMapStart, yMapStart, mapWidth, mapHeight, scaleFactor, drawStatics))
+            {
+                discardTempFile();
+                return false;
+            }
+
+            for (unsigned int y = 0; y < stripHeight; ++y)
+            {
+                const QRgb* scanLine = reinterpret_cast<const QRgb*>(strip.constScanLine(int(y)));
+                unsigned char* rgb = rgbRow.data();
+                for (unsigned int x = 0; x < width; ++x)
+                {
+                    const QRgb pixel = scanLine[x];
+                    *rgb++ = static_cast<unsigned char>(pixel >> 16);
+                    *rgb++ = static_cast<unsigned char>(pixel >> 8);
+                    *rgb++ = static_cast<unsigned char>(pixel);
+                }
+                if (!writer->writeRow(rgbRow.data()))
+                {
+                    LOG("Error writing " + tempPath);
+                    discardTempFile();
+                    return false;
+                }
+            }
+
+            if (reportProgress)
+                reportProgress(int(((strip_i + 1) * 100) / stripsCount));
+        }
+    }
+    catch (...)
+    {
+        // Reading the map blocks can throw
+        discardTempFile();
+        throw;
+    }
+
+    if (!writer->close())
+    {
+        LOG("Error writing " + tempPath);
+        discardTempFile();
+        return false;
+    }
+    writer.reset();
+    if (!renameReplacing(tempPath, filePath))
+    {
+        LOG("Error replacing " + filePath);
+        remove(tempPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+}
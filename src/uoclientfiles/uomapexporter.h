@@ -0,0 +1,37 @@
+#ifndef UOMAPEXPORTER_H
+#define UOMAPEXPORTER_H
+
+#include <functional>
+#include <string>
+
+
+namespace uocf
+{
+
+class UOMap;
+
+
+// Render a whole map plane to an image file, without holding the whole image in memory: the map is rendered in strips of
+//  rows by UOMap::drawRectInImage (split among threads when the map and statics files are mapped), and each strip is
+//  written to the file before rendering the next one.
+class UOMapExporter
+{
+public:
+    enum class Format
+    {
+        PNG,    // 24 bits RGB
+        Raw     // 24 bits RGB, rows from top to bottom, no header
+    };
+    static constexpr unsigned int kStripHeight = 256;  // image rows rendered at once
+
+    static const char* getFileExtension(Format format);
+
+    // The map needs the cache pointers set: it draws the statics and applies the hues only if set.
+    static bool exportMap(UOMap* map, unsigned int scaleFactor, bool drawStatics, Format format, const std::string& filePath,
+                          std::function<void (int)> reportProgress = nullptr);
+};
+
+
+}
+
+#endif // UOMAPEXPORTER_H
@@ -0,0 +1,333 @@
+#include "uomaptilepyramid.h"
+
+#include <QImage>
+#include <algorithm>    // for std::min, std::max
+#include <cstdint>
+#include <cstdio>       // for remove, rename
+#include <cstring>      // for memcmp, memcpy
+#include <fstream>
+#include <memory>
+#include <vector>
+
+#include "../uoppackage/uophash.h"
+#include "exceptions.h"
+#include "uohues.h"
+#include "uoradarcol.h"
+#include "uostatics.h"
+
+#include "../globals.h"
+#define LOG(x) appendToLog(x)
+
+
+namespace uocf
+{
+
+
+// Sidecar file layout: header, then the tiles of each level, from scale factor 0 to kScaleFactorMax.
+// Data is stored in the native (little endian) byte order.
+static constexpr int kFingerprintFilesCount = 10;   // map, statics, staidx, radarcol, hues and the difference files
+struct MapTilePyramidHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t tileSize;
+    uint32_t levelsCount;
+    uint32_t mapWidth;
+    uint32_t mapHeight;
+    uint32_t reserved;
+    uint64_t fileSizes[kFingerprintFilesCount];
+    int64_t fileLastModified[kFingerprintFilesCount];
+};
+static constexpr char kMapTilePyramidMagic[8] = {'L','V','M','A','P','T','I','L'};
+static constexpr uint32_t kMapTilePyramidVersion = 2;
+static constexpr size_t kTileBytes = size_t(UOMapTilePyramid::kTileSize) * UOMapTilePyramid::kTileSize * sizeof(uint16_t);
+
+static void getFingerprint(const std::string& clientPath, unsigned int fileIndex, MapTilePyramidHeader* header)
+{
+    const std::string index = std::to_string(fileIndex);
+    const std::string filePaths[kFingerprintFilesCount] =
+    {
+        UOMap::getMapFilePath(clientPath, fileIndex),
+        clientPath + "/statics" + index + ".mul",
+        clientPath + "/staidx" + index + ".mul",
+        clientPath + "/radarcol.mul",
+        clientPath + "/hues.mul",
+        clientPath + "/mapdifl" + index + ".mul",
+        clientPath + "/mapdif" + index + ".mul",
+        clientPath + "/stadifl" + index + ".mul",
+        clientPath + "/stadifi" + index + ".mul",
+        clientPath + "/stadif" + index + ".mul"
+    };
+    for (int i = 0; i < kFingerprintFilesCount; ++i)
+    {
+        unsigned long long size;
+        long long lastModified;
+        if (!getFileStats(filePaths[i], &size, &lastModified))
+        {
+            size = 0;
+            lastModified = 0;
+        }
+        header->fileSizes[i] = size;
+        header->fileLastModified[i] = lastModified;
+    }
+}
+
+static inline uint16_t encodePixel(QRgb rgb) noexcept
+{
+    // The radar colors are converted from 16 bit colors by multiplying each component by 8, so this is lossless.
+    return uint16_t(((rgb >> 9) & 0x7C00) | ((rgb >> 6) & 0x03E0) | ((rgb >> 3) & 0x001F));
+}
+
+static inline QRgb decodePixel(uint16_t val) noexcept
+{
+    return 0xFF000000u | ((QRgb(val) & 0x7C00) << 9) | ((QRgb(val) & 0x03E0) << 6) | ((QRgb(val) & 0x001F) << 3);
+}
+
+
+UOMapTilePyramid::UOMapTilePyramid(const std::string& clientPath, unsigned int fileIndex) :
+    m_clientPath(clientPath), m_fileIndex(fileIndex), m_mapWidth(0), m_mapHeight(0), m_levels{}, m_building(false), m_buildFailed(false)
+{
+}
+
+std::string UOMapTilePyramid::getFilePath() const
+{
+    // Stored in the working directory like our other settings files, with a different file for each client folder.
+    char fileName[64];
+    snprintf(fileName, sizeof(fileName), "MapTiles_%016llx_%u.cache", uopp::hashFileName(m_clientPath), m_fileIndex);
+    return fileName;
+}
+
+// static
+size_t UOMapTilePyramid::computeLevels(unsigned int mapWidth, unsigned int mapHeight, Level (&levels)[kLevelsCount])
+{
+    size_t offset = 0;
+    for (unsigned int scaleFactor = 0; scaleFactor < kLevelsCount; ++scaleFactor)
+    {
+        Level& level = levels[scaleFactor];
+        level.width = mapWidth, level.height = mapHeight;
+        UOMap::scaleCoordsMapToImage(scaleFactor, &level.width, &level.height);
+        level.tilesPerRow = (level.width + kTileSize - 1) / kTileSize;
+        level.tilesPerColumn = (level.height + kTileSize - 1) / kTileSize;
+        level.offset = offset;
+        offset += size_t(level.tilesPerRow) * level.tilesPerColumn * kTileBytes;
+    }
+    return offset;
+}
+
+bool UOMapTilePyramid::load()
+{
+    m_file.close();
+    if (!m_file.open(getFilePath()) || (m_file.size() < sizeof(MapTilePyramidHeader)))
+    {
+        m_file.close();
+        return false;
+    }
+
+    MapTilePyramidHeader header;
+    memcpy(&header, m_file.data(), sizeof(header));
+    bool valid = (memcmp(header.magic, kMapTilePyramidMagic, sizeof(header.magic)) == 0) && (header.version == kMapTilePyramidVersion) &&
+            (header.tileSize == kTileSize) && (header.levelsCount == kLevelsCount);
+
+    MapTilePyramidHeader currentFingerprint = {};
+    getFingerprint(m_clientPath, m_fileIndex, &currentFingerprint);
+    for (int i = 0; valid && (i < kFingerprintFilesCount); ++i)
+    {
+        if ((header.fileSizes[i] != currentFingerprint.fileSizes[i]) || (header.fileLastModified[i] != currentFingerprint.fileLastModified[i]))
+            valid = false;
+    }
+
+    Level levels[kLevelsCount];
+    if (valid && (m_file.size() != sizeof(MapTilePyramidHeader) + computeLevels(header.mapWidth, header.mapHeight, levels)))
+        valid = false;
+
+    if (!valid)
+    {
+        m_file.close();
+        return false;
+    }
+
+    m_mapWidth = header.mapWidth;
+    m_mapHeight = header.mapHeight;
+    std::copy(std::begin(levels), std::end(levels), std::begin(m_levels));
+    return true;
+}
+
+bool UOMapTilePyramid::build(std::function<void (int)> reportProgress)
+{
+    bool notBuilding = false;
+    if (!m_building.compare_exchange_strong(notBuilding, true))
+        return false;   // another thread is already doing it
+    struct BuildingFlagGuard
+    {
+        std::atomic<bool>& flag;
+        ~BuildingFlagGuard() { flag = false; }
+    } buildingFlagGuard{m_building};
+
+    MapTilePyramidHeader header = {};
+    memcpy(header.magic, kMapTilePyramidMagic, sizeof(header.magic));
+    header.version = kMapTilePyramidVersion;
+    header.tileSize = kTileSize;
+    header.levelsCount = kLevelsCount;
+    // Take the fingerprint before rendering: if the files change in the meantime, the next load will discard this file.
+    getFingerprint(m_clientPath, m_fileIndex, &header);
+
+    const std::string filePath = getFilePath();
+    const std::string tempFilePath = filePath + ".tmp";
+    try
+    {
+        // Use our own readers and block cache: we read every block only once, so a small budget is enough.
+        UOMapBlockCache blockCache(size_t(32) * 1024 * 1024);
+        UORadarCol radarcol(m_clientPath + "/radarcol.mul");
+        const auto hues = std::make_unique<UOHues>(m_clientPath + "/hues.mul");
+        UOMap map(m_clientPath, m_fileIndex, &blockCache);
+        std::unique_ptr<UOStatics> statics;
+        try
+        {
+            statics = std::make_unique<UOStatics>(m_clientPath, m_fileIndex, map.getWidth(), map.getHeight());
+        }
+        catch (const InvalidStreamException&)
+        {
+            // No statics file: draw only the terrain, as the map view does
+        }
+        map.setCachePointers(&radarcol, statics.get(), hues.get());
+
+        header.mapWidth = map.getWidth();
+        header.mapHeight = map.getHeight();
+        Level levels[kLevelsCount];
+        const size_t dataSize = computeLevels(header.mapWidth, header.mapHeight, levels);
+
+        std::ofstream fout(tempFilePath, std::ios::out | std::ios::binary | std::ios::trunc);
+        fout.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        fout.seekp(std::streamoff(sizeof(header) + dataSize - 1));
+        fout.put(0);
+        if (!fout.good())
+            throw InvalidStreamException("UOMapTilePyramid", "Can't write " + tempFilePath);
+
+        // Each level is filled a row of tiles at a time, then the row is written to the file.
+        std::vector<std::vector<uint16_t>> tileRows(kLevelsCount);
+        for (unsigned int scaleFactor = 0; scaleFactor < kLevelsCount; ++scaleFactor)
+            tileRows[scaleFactor].assign(size_t(levels[scaleFactor].tilesPerRow) * kTileSize * kTileSize, 0);
+
+        // Render the map at scale factor 0 in strips as high as a tile; the other levels sample the same pixels the
+        //  renderer would pick at their scale factor (one every 2^scaleFactor tiles).
+        QImage strip(int(header.mapWidth), int(kTileSize), QImage::Format_RGB32);
+        const unsigned int stripsCount = (header.mapHeight + kTileSize - 1) / kTileSize;
+        for (unsigned int strip_i = 0; strip_i < stripsCount; ++strip_i)
+        {
+            const unsigned int yStripStart = strip_i * kTileSize;
+            const unsigned int stripHeight = std::min(kTileSize, header.mapHeight - yStripStart);
+            map.drawRectInImage(&strip, 0, 0, nullptr, 0, yStripStart, header.mapWidth, stripHeight, 0, bool(statics));
+
+            for (unsigned int scaleFactor = 0; scaleFactor < kLevelsCount; ++scaleFactor)
+            {
+                const Level& level = levels[scaleFactor];
+                std::vector<uint16_t>& tileRow = tileRows[scaleFactor];
+                const unsigned int step = 1u << scaleFactor;
+                for (unsigned int yStrip = 0; yStrip < stripHeight; ++yStrip)
+                {
+                    const unsigned int yMap = yStripStart + yStrip;
+                    if (yMap & (step - 1))
+                        continue;
+                    const unsigned int yLevel = yMap >> scaleFactor;
+                    if (yLevel >= level.height)
+                        break;
+
+                    const QRgb* src = reinterpret_cast<const QRgb*>(strip.constScanLine(int(yStrip)));
+                    uint16_t* dst = tileRow.data() + (size_t(yLevel % kTileSize) * kTileSize);
+                    for (unsigned int xLevel = 0; xLevel < level.width; ++xLevel)
+                    {
+                        const size_t tileOffset = size_t(xLevel / kTileSize) * kTileSize * kTileSize;
+                        dst[tileOffset + (xLevel % kTileSize)] = encodePixel(src[xLevel << scaleFactor]);
+                    }
+
+                    // Is the row of tiles complete?
+                    if (((yLevel % kTileSize) == kTileSize - 1) || (yLevel == level.height - 1))
+                    {
+                        const size_t rowBytes = tileRow.size() * sizeof(uint16_t);
+                        fout.seekp(std::streamoff(sizeof(header) + level.offset + (size_t(yLevel / kTileSize) * rowBytes)));
+                        fout.write(reinterpret_cast<const char*>(tileRow.data()), std::streamsize(rowBytes));
+                        std::fill(tileRow.begin(), tileRow.end(), uint16_t(0));
+                    }
+                }
+            }
+
+            if (!fout.good())
+                throw InvalidStreamException("UOMapTilePyramid", "Can't write " + tempFilePath);
+            if (reportProgress)
+                reportProgress(int(((strip_i + 1) * 100ULL) / stripsCount));
+        }
+
+        fout.close();
+        if (fout.fail())
+            throw InvalidStreamException("UOMapTilePyramid", "Can't write " + tempFilePath);
+    }
+    catch (const UOCFException& e)
+    {
+        // Not fatal: the map will be rendered from the client files, as usual.
+        remove(tempFilePath.c_str());
+        LOG("Can't pre-render the radar tiles of map" + std::to_string(m_fileIndex) + ": " + e.what());
+        m_buildFailed = true;
+        return false;
+    }
+
+    remove(filePath.c_str());
+    if (rename(tempFilePath.c_str(), filePath.c_str()) != 0)
+    {
+        remove(tempFilePath.c_str());
+        LOG("Can't write the radar tiles cache " + filePath);
+        m_buildFailed = true;
+        return false;
+    }
+    return true;
+}
+
+bool UOMapTilePyramid::copyRectToImage(unsigned int scaleFactor, QImage* image, int xImageOffset, int yImageOffset,
+                                       unsigned int xLevel, unsigned int yLevel, unsigned int width, unsigned int height) const
+{
+    if (!isLoaded() || (scaleFactor >= kLevelsCount) || (image->depth() != 32))
+        return false;
+
+    const Level& level = m_levels[scaleFactor];
+    if ((xLevel >= level.width) || (yLevel >= level.height))
+        return true;
+    width = std::min(width, level.width - xLevel);
+    height = std::min(height, level.height - yLevel);
+
+    // Clip the rect to the destination image.
+    const int colFirst = std::max(0, -xImageOffset);
+    const int rowFirst = std::max(0, -yImageOffset);
+    const int colEnd = std::min(int(width), image->width() - xImageOffset);
+    const int rowEnd = std::min(int(height), image->height() - yImageOffset);
+    if ((colFirst >= colEnd) || (rowFirst >= rowEnd))
+        return true;
+
+    const char* levelData = m_file.data() + sizeof(MapTilePyramidHeader) + level.offset;
+    const size_t tileRowBytes = size_t(level.tilesPerRow) * kTileBytes;
+    uchar* imageBits = image->bits();
+    const int imageBytesPerLine = image->bytesPerLine();
+
+    #pragma omp parallel for schedule(static) if((rowEnd - rowFirst) * (colEnd - colFirst) > 1024 * 1024)
+    for (int row = rowFirst; row < rowEnd; ++row)
+    {
+        const unsigned int y = yLevel + unsigned(row);
+        const char* tilesRow = levelData + (size_t(y / kTileSize) * tileRowBytes) + (size_t(y % kTileSize) * kTileSize * sizeof(uint16_t));
+        QRgb* dst = reinterpret_cast<QRgb*>(imageBits + ((yImageOffset + row) * imageBytesPerLine)) + xImageOffset;
+
+        // Copy the row a tile at a time
+        for (int col = colFirst; col < colEnd; )
+        {
+            const unsigned int x = xLevel + unsigned(col);
+            const unsigned int xInTile = x % kTileSize;
+            const int run = std::min(colEnd - col, int(kTileSize - xInTile));
+            const uint16_t* src = reinterpret_cast<const uint16_t*>(tilesRow + (size_t(x / kTileSize) * kTileBytes)) + xInTile;
+            for (int i = 0; i < run; ++i)
+                dst[col + i] = decodePixel(src[i]);
+            col += run;
+        }
+    }
+
+    return true;
+}
+
+
+}
@@ -0,0 +1,80 @@
+#ifndef UOMAPTILEPYRAMID_H
+#define UOMAPTILEPYRAMID_H
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include "../cpputils/sysio.h"
+#include "uomap.h"
+
+class QImage;
+
+
+namespace uocf
+{
+
+
+// Radar images of a map plane pre-rendered at every scale factor, stored in a sidecar file and memory-mapped for display.
+// Each level is split in tiles of kTileSize x kTileSize pixels, stored one after the other, left to right, top to bottom.
+// Pixels are stored as 15 bit RGB: the radar colors come from 16 bit client colors, so no information is lost.
+// The file is tied to the size and modification time of the client files used to render it, and built again when they change.
+class UOMapTilePyramid
+{
+public:
+    static constexpr unsigned int kTileSize = 256;
+    static constexpr unsigned int kLevelsCount = UOMap::kScaleFactorMax + 1;    // one for each scale factor
+
+    UOMapTilePyramid(const std::string& clientPath, unsigned int fileIndex);
+
+    // Map the file, if it exists and the client files didn't change since it was built.
+    bool load();
+    inline bool isLoaded() const {
+        return m_file.isOpen();
+    }
+    inline unsigned int getMapWidth() const {
+        return m_mapWidth;
+    }
+    inline unsigned int getMapHeight() const {
+        return m_mapHeight;
+    }
+
+    // Render the whole map and write the file. It uses its own map, statics, radarcol and hues readers, so it can run in a
+    //  worker thread while the map is shown or the client files are reloaded, but only one build at a time can run.
+    // The result is available after calling load().
+    bool build(std::function<void (int)> reportProgress = nullptr);
+    inline bool isBuilding() const {
+        return m_building;
+    }
+    inline bool hasBuildFailed() const {    // if so, don't try again: it would likely fail again (e.g. read-only folder)
+        return m_buildFailed;
+    }
+
+    // Copy to a 32 bpp image the rect of the level for the given scale factor (coordinates are pixels of that level).
+    // Returns false if the pyramid isn't loaded.
+    bool copyRectToImage(unsigned int scaleFactor, QImage* image, int xImageOffset, int yImageOffset,
+                         unsigned int xLevel, unsigned int yLevel, unsigned int width, unsigned int height) const;
+
+private:
+    struct Level
+    {
+        unsigned int width, height;
+        unsigned int tilesPerRow, tilesPerColumn;
+        size_t offset;  // from the start of the tiles data
+    };
+    static size_t computeLevels(unsigned int mapWidth, unsigned int mapHeight, Level (&levels)[kLevelsCount]);
+
+    std::string getFilePath() const;
+
+    std::string m_clientPath;
+    unsigned int m_fileIndex;
+    unsigned int m_mapWidth, m_mapHeight;
+    Level m_levels[kLevelsCount];
+    MappedFile m_file;
+    std::atomic<bool> m_building;
+    std::atomic<bool> m_buildFailed;
+};
+
+
+}
+
+#endif // UOMAPTILEPYRAMID_H
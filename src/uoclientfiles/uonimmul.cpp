@@ -1,10 +1,14 @@
 #include "uoanimmul.h"
+#include "uoanim.h"     // for UOAnimFrameInfo
 
+#include <algorithm>    // for std::min
+#include <cstring>      // for memcpy
 #include <fstream>
-#include <sstream>
+#include <vector>
 #include <QImage>
 
-#include "../cpputils/strings.h"
+#include "exceptions.h"
+#include "uobodydef.h"
 #include "uoidx.h"
 #include "uohues.h"
 
@@ -15,261 +19,64 @@
 namespace uocf
 {
 
-UOAnimMUL::UOAnimMUL(const std::string &clientPath) :
-    m_UOHues(nullptr), m_clientPath(clientPath)
+UOAnimMUL::UOAnimMUL(const std::string &clientPath, const UOBodyDef* bodyDef) :
+    m_UOHues(nullptr), m_clientPath(clientPath), m_bodyDef(bodyDef)
 {
-    loadBodyDef();
-    loadBodyConvDef();
 }
 
 
-//--Body.def and BodyConv.def (source inspired by UOFiddler)
-
-
-bool UOAnimMUL::loadBodyDef()
-{
-    LOG("Loading Body.def");
-
-    std::ifstream fileStream;
-    // it's fundamental to open the file in binary mode, otherwise tellg and seekg won't work properly...
-    fileStream.open(m_clientPath + "Body.def", std::ifstream::in | std::ifstream::binary);
-    if (!fileStream.is_open())
-    {
-        LOG("Error opening file Body.def");
-        return false;
-    }
-
-    while ( !fileStream.eof() )
-    {
-        std::string line;
-        std::getline(fileStream, line);
-        if ( fileStream.bad() )
-            break;
-
-        strTrim(line);
-        if (line.empty())
-            continue;
-        if (line[0]=='#')   // commented line
-            continue;
-
-        // Format is: <ORIG BODY> {<NEW BODY>} <NEW HUE>
-        size_t index1 = line.find('{');
-        size_t index2 = line.find('}', index1 + 1);
-        size_t index3 = line.find('#', index2 + 1); // get rid of eventual comments at the end of the line
-        if ( (index1 == std::string::npos) || (index2 == std::string::npos) )
-            continue;
-
-        std::string param1 = line.substr(0, index1 - 1);
-        std::string param2 = line.substr(index1 + 1, index2 - index1 - 1);
-        std::string param3 = line.substr(index2 + 1, index3 - index2 - 1);
-        strTrim(param1);
-        strTrim(param2);
-        strTrim(param3);
-
-        size_t indexOf = param2.find(',');
-        if (indexOf != std::string::npos)
-        {
-            param2 = param2.substr(0, indexOf);
-            strTrim(param2);
-        }
-
-        int iParam1 = std::stoi(param1);
-        int iParam2 = std::stoi(param2);
-        int iParam3 = std::stoi(param3);
-
-        std::pair<int,BodyDefEntry> k (iParam1, BodyDefEntry(iParam2, iParam3));
-        m_bodyDef.insert(k);
-    }
-
-    fileStream.close();
-    return true;
-}
-
+/////
 
-bool UOAnimMUL::loadBodyConvDef()
+QImage* UOAnimMUL::drawAnimFrame(int bodyID, int action, int direction, int frame, unsigned int hueIndex, UOAnimFrameInfo* frameInfo)
 {
-    LOG("Loading BodyConv.def");
-
-/*
-    0 - 199 = Monsters
-    200 - 399 = Animals
-    400 + = Humans/Elves and Equipment
+    const UOBodyDef::BodyEntry body = m_bodyDef->getBody(bodyID);
+    bodyID = body.newBodyID;
+    const int animFileNumber = body.animFileNumber;
+    if (hueIndex == 0)
+        hueIndex = unsigned(body.newHue);
 
-    The maximum value for an index is 2048.
-*/
+    if (!m_bodyDef->isValidMULLookup(animFileNumber, bodyID) || (action < 0) || (direction < 0))
+        return nullptr;
+    const unsigned int bodyIndex = m_bodyDef->getMULLookupIndex(animFileNumber, bodyID, action, direction);
 
-    std::ifstream fileStream;
-    // it's fundamental to open the file in binary mode, otherwise tellg and seekg won't work properly...
-    fileStream.open(m_clientPath + "Bodyconv.def", std::ifstream::in | std::ifstream::binary);
-    if (!fileStream.is_open())
-    {
-        LOG("Error opening file Bodyconv.def");
-        return false;
-    }
+    AnimFile* animFile = getAnimFile(animFileNumber);
+    if (animFile == nullptr)
+        return nullptr;
 
-    while ( !fileStream.eof() )
+    UOIdx::Entry idxEntry = {};
+    if (!animFile->idx->getLookup(bodyIndex, &idxEntry) || (idxEntry.lookup == UOIdx::Entry::kInvalid) ||
+        (size_t(idxEntry.lookup) + idxEntry.size > animFile->mulSize))
     {
-        std::string line;
-        std::getline(fileStream, line);
-        if ( fileStream.bad() )
-            break;
-
-        strTrim(line);
-        if (line.empty())
-            continue;
-        if (line[0]=='#')   // commented line
-            continue;
-
-        // Format is: <Object> <LBR expansion (anim2)> <AoS (anim3)> <SE (anim4)> <Mondain's Legacy (anim5)>
-        std::vector<std::string> params;
-        strSplit(line, params, " \t", true);
-        if (params.size() < 5)
-            continue;
-
-        int iParams[5];
-        for (int i = 0; i < 5; ++i)
-            std::istringstream(params[i]) >> iParams[i];
-
-        if (iParams[1] == 68)   // anim2
-            iParams[1] = 122;
-
-        int newAnimfile = 0;        // the count starts from 0, not 1 (so 1 -> anim2)
-        for (int i = 1; i < 5; ++i)
-        {
-            if (iParams[i] != -1)
-            {
-                newAnimfile = i;
-                break;
-            }
-        }
-        if (newAnimfile == 0)
-            continue;
-
-        std::pair<int,BodyConvDefEntry> k (iParams[0], BodyConvDefEntry(iParams[newAnimfile], newAnimfile));
-        m_bodyConvDef.insert(k);
+        LOG( QString("Error looking up %1.idx (requested id %2).").arg(getAnimFileName(animFileNumber), QString::number(bodyID)).toStdString() );
+        return nullptr;
     }
 
-    fileStream.close();
-    return true;
-}
-
-
-unsigned int UOAnimMUL::getBodyLookupIndex(int body, int action, int direction, int animFileNumber)
-{
-    // Stygian Abyss stuff is stored in animationframe*.uop.
-    // Every animation before Stygian Abyss is stored in anim mul/idx.
-
-    unsigned index = 0;
-    switch (animFileNumber)
+    // The whole animation group is accessed straight from the mapped anim*.mul, or read from the file if it isn't mapped.
+    const char* groupData;
+    const size_t groupSize = idxEntry.size;
+    std::vector<char> groupBuffer;
+    if (animFile->mul.isOpen())
     {
-        default:
-        case 0:
-            if (body < 200)
-                index = body * 110;
-                // 200 * 110 = 22000 animation frame slots for hi detail animations
-            else if (body < 400)
-                index = 22000 + ((body - 200) * 65);
-                // 200 (which is 400 - 200) * 65 = 13000 slots for low detail anims
-            else
-                index = 35000 + ((body - 400) * 175);
-                // 35000 -> 22000 + 13000. Skip this much slots for equip anims
-            break;
-
-        case 1:
-            if (body < 200)
-                index = body * 110;
-            else
-                index = 22000 + ((body - 200) * 65);
-            break;
-
-        case 2:
-            if (body < 300)
-                index = body * 65;
-            else if (body < 400)
-                index = 33000 + ((body - 300) * 110);
-            else
-                index = 35000 + ((body - 400) * 175);
-            break;
-
-        case 3:
-            if (body < 200)
-                index = body * 110;
-            else if (body < 400)
-                index = 22000 + ((body - 200) * 65);
-            else
-                index = 35000 + ((body - 400) * 175);
-            break;
-
-        case 4:
-            if ((body < 200) && (body != 34)) // looks strange, though it works.
-                index = body * 110;
-            else if (body < 400)
-                index = 22000 + ((body - 200) * 65);
-            else
-                index = 35000 + ((body - 400) * 175);
-            break;
-    }
-
-    index += action * 5;
-
-    if (direction <= 4)
-        index += direction;
-    else
-        index += direction - (direction - 4) * 2;
-
-    return index;
-}
-
-
-/////
-
-QImage* UOAnimMUL::drawAnimFrame(int bodyID, int action, int direction, int frame, unsigned int hueIndex)
-{
-    int animFileNumber = 0;
-
-    auto bodyConvDef_it = m_bodyConvDef.find(bodyID);
-    if (bodyConvDef_it != m_bodyConvDef.end())  // key found
-    {
-        bodyID = bodyConvDef_it->second.newID;
-        animFileNumber = bodyConvDef_it->second.newFileNum;
+        groupData = animFile->mul.data() + idxEntry.lookup;
     }
     else
     {
-        auto bodyDef_it = m_bodyDef.find(bodyID);
-        if (bodyDef_it != m_bodyDef.end())      // key found
+        std::ifstream fs_anim;
+        fs_anim.open(animFile->mulPath, std::ifstream::in | std::ifstream::binary);
+        groupBuffer.resize(groupSize);
+        if (fs_anim.is_open())
         {
-            bodyID = bodyDef_it->second.newID;
-            if (hueIndex == 0)
-                hueIndex = bodyDef_it->second.newHue;
+            fs_anim.seekg(idxEntry.lookup, std::ios_base::beg);
+            fs_anim.read(groupBuffer.data(), std::streamsize(groupSize));
         }
+        if (!fs_anim.is_open() || fs_anim.fail())
+        {
+            LOG("Error reading " + animFile->mulPath);
+            return nullptr;
+        }
+        groupData = groupBuffer.data();
     }
 
-    std::string animFileStr;
-    switch (animFileNumber)
-    {
-        case 1:     animFileStr = "anim2";      break;
-        case 2:     animFileStr = "anim3";      break;
-        case 3:     animFileStr = "anim4";      break;
-        case 4:     animFileStr = "anim5";      break;
-        default:    animFileStr = "anim";       break;
-    }
-
-    unsigned bodyIndex = getBodyLookupIndex(bodyID, action, direction, animFileNumber);
-
-    UOIdx::Entry idxEntry;
-    if (! UOIdx::getLookup(m_clientPath + animFileStr + ".idx", bodyIndex, &idxEntry))
-    {
-        LOG( QString("Error looking up %1.idx (requested id %2).").arg(animFileStr.c_str(), QString::number(bodyID)).toStdString() );
-        return nullptr;
-    }
-
-    std::ifstream fs_anim;
-    fs_anim.open(m_clientPath + animFileStr + ".mul", std::ifstream::in | std::ifstream::binary);
-    if (!fs_anim.is_open())
-        return nullptr;
-    fs_anim.seekg(idxEntry.lookup, std::ios_base::beg);
-
-
     /*
     AnimationGroup
         WORD[256] Palette
@@ -294,40 +101,55 @@ QImage* UOAnimMUL::drawAnimFrame(int bodyID, int action, int direction, int fram
     If the current chunk header is 0x7FFF7FFF, the image is completed.
     */
 
+    static constexpr size_t kPaletteSize = 2 * 256;
+    if (groupSize < kPaletteSize + 4)
+        return nullptr;
+
     uint16_t palette[256];
-    fs_anim.read(reinterpret_cast<char*>(palette), 2 * 256);
+    memcpy(palette, groupData, kPaletteSize);
 
     uint32_t frame_count = 0;
-    fs_anim.read(reinterpret_cast<char*>(&frame_count), 4);
-    if (frame > (int)frame_count)
-    {
-        fs_anim.close();
+    memcpy(&frame_count, groupData + kPaletteSize, 4);
+    if ((frame < 0) || (uint32_t(frame) >= frame_count) || (kPaletteSize + 4 + (size_t(frame) + 1) * 4 > groupSize))
         return nullptr;
-    }
 
-    uint32_t* frame_offsets = new uint32_t[frame_count];
-    fs_anim.read(reinterpret_cast<char*>(frame_offsets), 4 * frame_count);
-    fs_anim.seekg(idxEntry.lookup + (2*256) + frame_offsets[frame], std::ios_base::beg);    // go to the selected frame
+    uint32_t frame_offset = 0;
+    memcpy(&frame_offset, groupData + kPaletteSize + 4 + (size_t(frame) * 4), 4);
+    size_t dataOff = kPaletteSize + frame_offset;    // go to the selected frame
+    if (dataOff + 8 > groupSize)
+        return nullptr;
 
     int16_t xCenter = 0, yCenter = 0;
     uint16_t width = 0, height = 0;
-    fs_anim.read(reinterpret_cast<char*>(&xCenter), 2);
-    fs_anim.read(reinterpret_cast<char*>(&yCenter), 2);
-    fs_anim.read(reinterpret_cast<char*>(&width),   2);
-    fs_anim.read(reinterpret_cast<char*>(&height),  2);
+    memcpy(&xCenter, groupData + dataOff,     2);
+    memcpy(&yCenter, groupData + dataOff + 2, 2);
+    memcpy(&width,   groupData + dataOff + 4, 2);
+    memcpy(&height,  groupData + dataOff + 6, 2);
+    dataOff += 8;
 
     if (height == 0 || width == 0)
-    {
-        fs_anim.close();
         return nullptr;
+    if (frameInfo)
+        *frameInfo = UOAnimFrameInfo{xCenter, yCenter, frame_count};
+
+    // Convert (and hue) the palette only once, instead of doing it for every pixel.
+    bool applyToGrayOnly = false;   //(hue_index & 0x8000) != 0;
+    uint32_t palette32[256];
+    for (int i = 0; i < 256; ++i)
+    {
+        ARGB16 color_argb16 = palette[i]; // ^ 0x8000;
+        if (hueIndex > 0) // client starts to count from 1 (0 means do not change the color)
+        {
+            const UOHueEntry& hue = m_UOHues->getHueEntry(hueIndex-1);
+            color_argb16 = hue.applyToColor16(color_argb16, applyToGrayOnly);
+        }
+        palette32[i] = convert_ARGB16_to_ARGB32(color_argb16).getVal();
     }
 
     QImage* img = new QImage((int)width, (int)height, QImage::Format_ARGB32);
     img->fill(0);
 
-    bool applyToGrayOnly = false;   //(hue_index & 0x8000) != 0;
-
-    while ( !fs_anim.eof() && !fs_anim.fail() )
+    while ( dataOff + 4 <= groupSize )
     {
         /*
         HEADER:
@@ -344,7 +166,8 @@ QImage* UOAnimMUL::drawAnimFrame(int bodyID, int action, int direction, int fram
         For this piece of code, the MulPatcher source helped A LOT!
         */
         uint32_t header = 0;
-        fs_anim.read(reinterpret_cast<char*>(&header), 4);
+        memcpy(&header, groupData + dataOff, 4);
+        dataOff += 4;
         if ( header == 0x7FFF7FFF )
             break;
 
@@ -360,30 +183,79 @@ QImage* UOAnimMUL::drawAnimFrame(int bodyID, int action, int direction, int fram
         int X = xOffset + xCenter;
         int Y = yOffset + yCenter + height;
 
+        if (dataOff + xRun > groupSize)
+            break;  // truncated data
         if (X < 0 || Y < 0 || Y >= (int)height || X >= (int)width)
-            continue;
-
-        for ( unsigned k = 0; k < xRun; ++k )
         {
-            uint8_t palette_index = 0;
-            fs_anim.read(reinterpret_cast<char*>(&palette_index), 1);
-            ARGB16 color_argb16 = palette[palette_index]; // ^ 0x8000;
-            if (hueIndex > 0) // client starts to count from 1 (0 means do not change the color)
-            {
-                const UOHueEntry& hue = m_UOHues->getHueEntry(hueIndex-1);
-                color_argb16 = hue.applyToColor16(color_argb16, applyToGrayOnly);
-            }
-            ARGB32 color_argb32 = convert_ARGB16_to_ARGB32(color_argb16);
-
-            img->setPixel(X + k, Y, color_argb32.getVal());
+            dataOff += xRun;    // skip this run's pixels
+            continue;
         }
-    }
 
-    fs_anim.close();
-    delete[] frame_offsets;
+        // Write the run directly in the image scanline
+        const unsigned int visibleRun = std::min(xRun, unsigned(width - X));
+        const uint8_t* palettePixels = reinterpret_cast<const uint8_t*>(groupData + dataOff);
+        QRgb* scanline = reinterpret_cast<QRgb*>(img->scanLine(Y)) + X;
+        for ( unsigned k = 0; k < visibleRun; ++k )
+            scanline[k] = palette32[palettePixels[k]];
+        dataOff += xRun;
+    }
 
     return img;
 }
 
+// static
+const char* UOAnimMUL::getAnimFileName(int animFileNumber)
+{
+    switch (animFileNumber)
+    {
+        case 1:     return "anim2";
+        case 2:     return "anim3";
+        case 3:     return "anim4";
+        case 4:     return "anim5";
+        default:    return "anim";
+    }
+}
+
+UOAnimMUL::AnimFile* UOAnimMUL::getAnimFile(int animFileNumber)
+{
+    // The idx is cached and the mul is mapped in memory the first time we draw from them, then they are kept open.
+    AnimFile& animFile = m_animFiles[animFileNumber];
+    if (animFile.idx)
+        return &animFile;
+    if (animFile.unavailable)
+        return nullptr;
+
+    const std::string basePath = m_clientPath + getAnimFileName(animFileNumber);
+    const std::string mulPath = basePath + ".mul";
+    unsigned long long mulSize = 0;
+    if (!isValidFile(basePath + ".idx") || !getFileStats(mulPath, &mulSize, nullptr))
+    {
+        LOG("Error loading " + basePath + ".mul/.idx");
+        animFile.unavailable = true;
+        return nullptr;
+    }
+
+    auto idx = std::make_unique<UOIdx>(basePath + ".idx");
+    try
+    {
+        idx->cacheData();
+    }
+    catch (const InvalidStreamException&)
+    {
+        LOG("Error reading " + basePath + ".idx");
+        animFile.unavailable = true;
+        return nullptr;
+    }
+
+    // Mapping may fail (e.g. address space exhausted on a 32 bits build): then we read each animation group from the file.
+    if (animFile.mul.open(mulPath))
+        mulSize = animFile.mul.size();
+    else
+        LOG("Can't map " + mulPath + " in memory, reading it from file.");
+    animFile.idx = std::move(idx);
+    animFile.mulPath = mulPath;
+    animFile.mulSize = size_t(mulSize);
+    return &animFile;
+}
 
 }
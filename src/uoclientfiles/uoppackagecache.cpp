@@ -0,0 +1,111 @@
+#include "uoppackagecache.h"
+
+#include <cstdio>   // for snprintf
+
+#include "../cpputils/sysio.h"
+#include "../uoppackage/uophash.h"
+#include "../uoppackage/uoppackage.h"
+
+
+namespace uocf
+{
+
+
+UOPPackageCache::UOPPackageCache() = default;
+
+// Not inlined: the destructor of unique_ptr needs UOPPackage to be a complete type.
+UOPPackageCache::~UOPPackageCache() = default;
+
+uopp::UOPPackage* UOPPackageCache::getPackage(const std::string& filePath, uopp::UOPError* errorQueue)
+{
+    Entry* entry = getEntry(filePath, errorQueue);
+    return entry ? entry->package.get() : nullptr;
+}
+
+UOPPackageCache::Entry* UOPPackageCache::getEntry(const std::string& filePath, uopp::UOPError* errorQueue)
+{
+    unsigned long long fileSize = 0;
+    long long lastModified = 0;
+    if (!getFileStats(filePath, &fileSize, &lastModified))
+    {
+        // The file was removed (or it never existed)
+        m_packages.erase(filePath);
+        return nullptr;
+    }
+
+    auto it = m_packages.find(filePath);
+    if (it != m_packages.end())
+    {
+        Entry& entry = it->second;
+        if ((entry.fileSize == fileSize) && (entry.lastModified == lastModified))
+            return &entry;
+        // The file has changed: reload it
+        m_packages.erase(it);
+    }
+
+    Entry entry;
+    entry.fileSize = fileSize;
+    entry.lastModified = lastModified;
+    entry.package = std::make_unique<uopp::UOPPackage>();
+    if (!entry.package->load(filePath, errorQueue))
+        return nullptr;
+    // Access the packed data through a memory mapping. If it fails (e.g. address space exhausted on a 32 bits build),
+    //  we can still read it from file streams, so it's not an error.
+    entry.package->mapPackageFile();
+
+    return &m_packages.emplace(filePath, std::move(entry)).first->second;
+}
+
+const UOPPackageCache::FileIdTable* UOPPackageCache::getFileIdTable(const std::string& filePath, const char* fileNameFormat, unsigned int idCount,
+                                                                   uopp::UOPPackage** package, uopp::UOPError* errorQueue)
+{
+    Entry* entry = getEntry(filePath, errorQueue);
+    if (package)
+        *package = entry ? entry->package.get() : nullptr;
+    if (entry == nullptr)
+        return nullptr;
+
+    // getEntry has just (re)loaded the entry if needed, so the tables we find are built over the current package.
+    auto it = entry->fileIdTables.find(fileNameFormat);
+    if (it == entry->fileIdTables.end())
+    {
+        it = entry->fileIdTables.emplace(fileNameFormat, FileIdTable()).first;
+        buildFileIdTable(entry->package.get(), fileNameFormat, idCount, &it->second);
+    }
+    return &it->second;
+}
+
+// static
+void UOPPackageCache::buildFileIdTable(uopp::UOPPackage* package, const char* fileNameFormat, unsigned int idCount, FileIdTable* table)
+{
+    table->assign(idCount, nullptr);
+
+    // Hashing the names is the expensive part, and each id is independent from the others.
+    #pragma omp parallel for schedule(static)
+    for (int id = 0; id < int(idCount); ++id)
+    {
+        char packedFileName[128];
+        snprintf(packedFileName, sizeof(packedFileName), fileNameFormat, unsigned(id));
+        unsigned int block, index;
+        if (package->searchByHash(uopp::hashFileName(packedFileName), &block, &index))
+            (*table)[size_t(id)] = package->getFileByIndex(block, index);
+    }
+}
+
+bool UOPPackageCache::isPackageLoaded(const std::string& filePath) const
+{
+    return (m_packages.find(filePath) != m_packages.end());
+}
+
+void UOPPackageCache::unloadPackage(const std::string& filePath)
+{
+    m_packages.erase(filePath);
+}
+
+void UOPPackageCache::clear()
+{
+    m_packages.clear();
+}
+
+
+}
@@ -0,0 +1,60 @@
+#ifndef UOPPACKAGECACHE_H
+#define UOPPACKAGECACHE_H
+
+#include <string>
+#include <map>
+#include <memory>
+#include <vector>
+
+
+namespace uopp
+{
+    class UOPError;
+    class UOPPackage;
+    class UOPFile;
+}
+
+
+namespace uocf
+{
+
+
+// Keeps the headers (blocks and files tables) of multiple UOP packages loaded at the same time, so that switching between
+//  them doesn't require parsing again the package. A package is reloaded only when its size or modification time change.
+class UOPPackageCache
+{
+public:
+    UOPPackageCache();
+    ~UOPPackageCache();
+
+    // Returns the loaded package, loading (or reloading, if modified) it when needed. Returns nullptr if the file
+    //  doesn't exist or it can't be loaded.
+    uopp::UOPPackage* getPackage(const std::string& filePath, uopp::UOPError* errorQueue = nullptr);
+    bool isPackageLoaded(const std::string& filePath) const;
+    void unloadPackage(const std::string& filePath);
+    void clear();
+
+    // Dense id -> file table, for packages whose files are named after a numeric id (like "build/worldart/%08u.dds").
+    //  It's built the first time it's requested and it lives as long as the package stays loaded, so looking up a file
+    //  by id doesn't require formatting and hashing its name anymore. Missing ids have a nullptr entry.
+    using FileIdTable = std::vector<uopp::UOPFile*>;
+    const FileIdTable* getFileIdTable(const std::string& filePath, const char* fileNameFormat, unsigned int idCount,
+                                      uopp::UOPPackage** package = nullptr, uopp::UOPError* errorQueue = nullptr);
+
+private:
+    struct Entry
+    {
+        unsigned long long fileSize;
+        long long lastModified;
+        std::unique_ptr<uopp::UOPPackage> package;
+        std::map<std::string, FileIdTable> fileIdTables;  // lookup key: file name format
+    };
+    Entry* getEntry(const std::string& filePath, uopp::UOPError* errorQueue);
+    static void buildFileIdTable(uopp::UOPPackage* package, const char* fileNameFormat, unsigned int idCount, FileIdTable* table);
+    std::map<std::string, Entry> m_packages;    // lookup key: package path
+};
+
+
+}
+
+#endif // UOPPACKAGECACHE_H
@@ -30,21 +30,40 @@ std::vector<StaticsEntry> StaticsBlock::getItemsAtOffsets(unsigned char xOffset,
     return retVec;
 }
 
-bool StaticsBlock::getTopItem(StaticsEntry *entry, unsigned char xOffset, unsigned char yOffset) const
+void StaticsBlock::buildTopItemsTable()
 {
-    /*
-    std::vector<StaticsEntry> entriesAtOff = getItemsAtOffsets(xOffset, yOffset);
-    if (entriesAtOff.empty())
-        return false;
+    topItems.reset(nullptr);
+    if ((entriesCount == 0) || (entriesCount >= kNoTopItem))
+        return;
+
+    topItems = std::make_unique<unsigned short[]>(kTilesPerBlock);
+    for (unsigned i = 0; i < kTilesPerBlock; ++i)
+        topItems[i] = kNoTopItem;
 
-    *entry = entriesAtOff[0];
     for (unsigned i = 0; i < entriesCount; ++i)
     {
         const StaticsEntry& cur = entries[i];
-        if (cur.z > entry->z)
-            *entry = cur;
+        if ((cur.xOffset >= kTilesPerRow) || (cur.yOffset >= kTilesPerColumn))
+            continue;
+        unsigned short& top = topItems[(cur.yOffset * kTilesPerRow) + cur.xOffset];
+        // On equal z, keep the first one (as the linear search did)
+        if ((top == kNoTopItem) || (cur.z > entries[top].z))
+            top = static_cast<unsigned short>(i);
+    }
+}
+
+bool StaticsBlock::getTopItem(StaticsEntry *entry, unsigned char xOffset, unsigned char yOffset) const
+{
+    if (topItems)
+    {
+        if ((xOffset >= kTilesPerRow) || (yOffset >= kTilesPerColumn))
+            return false;
+        const unsigned short top = topItems[(yOffset * kTilesPerRow) + xOffset];
+        if (top == kNoTopItem)
+            return false;
+        *entry = entries[top];
+        return true;
     }
-    */
 
     const StaticsEntry *highest = nullptr;
     for (unsigned i = 0; i < entriesCount; ++i)
@@ -64,16 +83,51 @@ bool StaticsBlock::getTopItem(StaticsEntry *entry, unsigned char xOffset, unsign
 
 UOStatics::UOStatics(const std::string &clientPath, unsigned int fileIndex, unsigned int mapWidth, unsigned int mapHeight) :
     m_clientPath(clientPath), m_fileIndex(fileIndex), m_mapWidth(mapWidth), m_mapHeight(mapHeight),
-    m_staidx(clientPath + "/staidx" + std::to_string(m_fileIndex) + ".mul")
+    m_staidx(clientPath + "/staidx" + std::to_string(m_fileIndex) + ".mul"),
+    m_difIdx(clientPath + "/stadifi" + std::to_string(m_fileIndex) + ".mul")
 {
     openStream();
     closeStream();
+
+    loadDifFiles();
+}
+
+void UOStatics::loadDifFiles()
+{
+    // Like the map patches, the difference files are small: the index is cached and the data is mapped, once and for all.
+    const std::string index = std::to_string(m_fileIndex);
+    const std::string listFilePath = m_clientPath + "/stadifl" + index + ".mul";
+    const std::string idxFilePath = m_clientPath + "/stadifi" + index + ".mul";
+    if (!isValidFile(listFilePath) || !isValidFile(idxFilePath) || !m_difMappedFile.open(m_clientPath + "/stadif" + index + ".mul"))
+        return;
+
+    try
+    {
+        m_difIdx.cacheData();
+    }
+    catch (InvalidStreamException&)
+    {
+        m_difMappedFile.close();
+        return;
+    }
+
+    const unsigned mapBlocks = (m_mapWidth / StaticsBlock::kTilesPerRow) * (m_mapHeight / StaticsBlock::kTilesPerColumn);
+    if (!m_difIndex.load(listFilePath, mapBlocks, m_difIdx.getCachedCount()) || m_difIndex.isEmpty())
+    {
+        m_difIndex.clear();
+        m_difIdx.clearCache();
+        m_difMappedFile.close();
+    }
+}
+
+static std::string getStaticsFilePath(const std::string& clientPath, unsigned int fileIndex)
+{
+    return clientPath + "/statics" + std::to_string(fileIndex) + ".mul";
 }
 
 void UOStatics::openStream()
 {
-    std::string filePath(m_clientPath + "/statics" + std::to_string(m_fileIndex) + ".mul");
-    m_stream.open(filePath, std::ifstream::in | std::ifstream::binary);
+    m_stream.open(getStaticsFilePath(m_clientPath, m_fileIndex), std::ifstream::in | std::ifstream::binary);
     if (!m_stream.is_open())
         throw InvalidStreamException("UOStatics", "Couldn't open file.");
 }
@@ -85,6 +139,18 @@ void UOStatics::closeStream()
     m_stream.close();
 }
 
+bool UOStatics::mapFile()
+{
+    if (m_mappedFile.isOpen())
+        return true;
+    return m_mappedFile.open(getStaticsFilePath(m_clientPath, m_fileIndex));
+}
+
+void UOStatics::unmapFile()
+{
+    m_mappedFile.close();
+}
+
 void UOStatics::clearIdxCache()
 {
     m_staidx.clearCache();
@@ -103,30 +169,42 @@ unsigned int UOStatics::getBlockIndex(unsigned int xTile, unsigned int yTile) co
     return (xBlock * yBlockCount) + yBlock;
 }
 
-UOIdx::Entry UOStatics::readIdxToBlock(unsigned int xTile, unsigned int yTile)
+UOIdx::Entry UOStatics::readIdxToBlock(unsigned int xTile, unsigned int yTile, bool* patched)
 {
-    const unsigned nBlock = getBlockIndex(xTile, yTile);
-    UOIdx::Entry idxEntry;
-    if (m_staidx.getLookup(nBlock, &idxEntry))
-        return idxEntry;
-    return {};
+    return readIdxToBlock(getBlockIndex(xTile, yTile), patched);
 }
 
-UOIdx::Entry UOStatics::readIdxToBlock(unsigned int index)
+UOIdx::Entry UOStatics::readIdxToBlock(unsigned int index, bool* patched)
 {
     UOIdx::Entry idxEntry;
+    const unsigned int difPatch = m_difIndex.getPatch(index);
+    if (patched)
+        *patched = (difPatch != UODifIndex::kNoPatch);
+    if (difPatch != UODifIndex::kNoPatch)
+    {
+        // the index contains only the patches with an entry in stadifi
+        if (m_difIdx.getLookup(difPatch, &idxEntry))
+            return idxEntry;
+        return {};
+    }
     if (m_staidx.getLookup(index, &idxEntry))
         return idxEntry;
     return {};
 }
 
-StaticsBlock UOStatics::readBlock(const UOIdx::Entry &idxEntry)
+StaticsBlock UOStatics::readBlock(const UOIdx::Entry &idxEntry, bool patched)
 {
-    if (!m_stream.is_open())
+    // The patched blocks are always read from the mapped difference file
+    const MappedFile* mappedFile = patched ? &m_difMappedFile : &m_mappedFile;
+    const bool mapped = mappedFile->isOpen();
+    if (!mapped && !m_stream.is_open())
         throw InvalidStreamException("UOStatics", "readBlock accessing closed stream.");
 
     StaticsBlock block;
-    const unsigned entriesCount = (idxEntry.size / StaticsEntry::kSize);
+    unsigned entriesCount = (idxEntry.size / StaticsEntry::kSize);
+    // A block pointing outside of the mapped file is treated as empty (the stream read would fail instead).
+    if (mapped && ((idxEntry.lookup >= mappedFile->size()) || (mappedFile->size() - idxEntry.lookup < idxEntry.size)))
+        entriesCount = 0;
     block.entriesCount = entriesCount;
     if (entriesCount == 0)
     {
@@ -136,7 +214,6 @@ StaticsBlock UOStatics::readBlock(const UOIdx::Entry &idxEntry)
     block.initialized = false;
     block.entries = std::make_unique<StaticsEntry[]>(entriesCount);
 
-    m_stream.seekg(idxEntry.lookup);
     /*
     for (unsigned i = 0; i < nEntries; ++i)
     {
@@ -147,9 +224,19 @@ StaticsBlock UOStatics::readBlock(const UOIdx::Entry &idxEntry)
         m_stream.read(reinterpret_cast<char*>(&block.entries[i].hue), 2);
     }
     */
-    std::unique_ptr<char[]> buf = std::make_unique<char[]>(idxEntry.size);
-    char* bufPtr = buf.get();
-    m_stream.read(bufPtr, std::streamsize(idxEntry.size));
+    std::unique_ptr<char[]> buf;
+    const char* bufPtr;
+    if (mapped)
+    {
+        bufPtr = mappedFile->data() + idxEntry.lookup;
+    }
+    else
+    {
+        m_stream.seekg(idxEntry.lookup);
+        buf = std::make_unique<char[]>(idxEntry.size);
+        m_stream.read(buf.get(), std::streamsize(idxEntry.size));
+        bufPtr = buf.get();
+    }
     for (unsigned i = 0; i < entriesCount; ++i)
     {
         StaticsEntry& entry = block.entries[i];
@@ -160,9 +247,10 @@ StaticsBlock UOStatics::readBlock(const UOIdx::Entry &idxEntry)
         memcpy(&entry.hue,       bufPtr, 2);  bufPtr += 2;
     }
 
-    if (!m_stream.good())
+    if (!mapped && !m_stream.good())
         throw InvalidStreamException("UOStatics", "readBlock I/O error");
 
+    block.buildTopItemsTable();
     block.initialized = true;
     return block;
 }
@@ -2,6 +2,8 @@
 #define UOSTATICS_H
 
 #include <vector>
+#include "../cpputils/sysio.h"
+#include "uodifindex.h"
 #include "uoidx.h"
 
 namespace uocf
@@ -25,10 +27,16 @@ struct StaticsBlock
     static constexpr unsigned int kTilesPerRow = 8;
     static constexpr unsigned int kTilesPerColumn = 8;
     static constexpr unsigned int kTilesPerBlock = kTilesPerRow * kTilesPerColumn;
+    static constexpr unsigned short kNoTopItem = 0xFFFF;
     bool initialized;
 
     unsigned int entriesCount;
     std::unique_ptr<StaticsEntry[]> entries;
+    // For each tile (yOffset * kTilesPerRow + xOffset), the index in entries of the highest item, or kNoTopItem.
+    // Built by buildTopItemsTable, it's null for empty blocks (or blocks too big to be indexed by an unsigned short).
+    std::unique_ptr<unsigned short[]> topItems;
+
+    void buildTopItemsTable();
 
     std::vector<StaticsEntry> getItemsAtOffsets(unsigned char xOffset, unsigned char yOffset) const;
     std::vector<StaticsEntry> getItemsAtOffsets(unsigned char xOffset, unsigned char yOffset, char z) const;
@@ -45,6 +53,12 @@ public:
     inline bool isStreamOpened() const {
         return m_stream.is_open();
     }
+    // While the file is mapped, readBlock reads from the mapping instead of the stream, and it can be called by multiple threads.
+    bool mapFile();
+    void unmapFile();
+    inline bool isFileMapped() const {
+        return m_mappedFile.isOpen();
+    }
 
     inline bool hasIdxCache() const noexcept {
         return m_staidx.hasCache();
@@ -53,20 +67,28 @@ public:
     void cacheIdxData();
 
     unsigned int getBlockIndex(unsigned int xTile, unsigned int yTile) const noexcept;
-    UOIdx::Entry readIdxToBlock(unsigned int index);
-    UOIdx::Entry readIdxToBlock(unsigned int xTile, unsigned int yTile);
-    StaticsBlock readBlock(const UOIdx::Entry& idxEntry);
+    // For the blocks patched by stadifl*.mul + stadifi*.mul + stadif*.mul, the entry points in the difference file instead:
+    //  patched is set to true, and it has to be passed to readBlock.
+    UOIdx::Entry readIdxToBlock(unsigned int index, bool* patched = nullptr);
+    UOIdx::Entry readIdxToBlock(unsigned int xTile, unsigned int yTile, bool* patched = nullptr);
+    StaticsBlock readBlock(const UOIdx::Entry& idxEntry, bool patched = false);
 
     std::vector<StaticsEntry> getItemsAtCoordsFromBlock(const StaticsBlock& block, unsigned int x, unsigned int y) const;
     std::vector<StaticsEntry> getItemsAtCoordsFromBlock(const StaticsBlock& block, unsigned int x, unsigned int y, char z) const;
     bool getTopItemFromBlock(StaticsEntry *entry, const StaticsBlock& block, unsigned int x, unsigned int y) const;
 
 private:
+    void loadDifFiles();
+
     std::string m_clientPath;
     unsigned int m_fileIndex;
     unsigned int m_mapWidth, m_mapHeight;
     std::ifstream m_stream;
+    MappedFile m_mappedFile;
     UOIdx m_staidx;
+    UODifIndex m_difIndex;          // blocks patched by the difference files
+    UOIdx m_difIdx;                 // stadifi*.mul, cached
+    MappedFile m_difMappedFile;     // stadif*.mul
 };
 
 
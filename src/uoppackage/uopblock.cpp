@@ -80,7 +80,7 @@ void UOPBlock::freePackedData()
 
 //--
 
-bool UOPBlock::addFile(std::ifstream& fin, unsigned long long fileHash, CompressionFlag compression, bool addDataHash, UOPError *errorQueue)
+bool UOPBlock::addFile(std::ifstream& fin, unsigned long long fileHash, CompressionFlag compression, bool addDataHash, UOPError *errorQueue, ZLibQuality quality)
 {
     std::stringstream ssHash; ssHash << std::hex << fileHash;
     const std::string strHash("0x" + ssHash.str());
@@ -103,7 +103,7 @@ bool UOPBlock::addFile(std::ifstream& fin, unsigned long long fileHash, Compress
     if (m_curFileIdx != 0)
         ++m_curFileIdx;
     UOPFile* file = new UOPFile(this, m_curFileIdx);
-    if (! file->createFile(fin, fileHash, compression, addDataHash, errorQueue) )
+    if (! file->createFile(fin, fileHash, compression, addDataHash, errorQueue, quality) )
     {
         delete file;
         return false;
@@ -115,7 +115,7 @@ bool UOPBlock::addFile(std::ifstream& fin, unsigned long long fileHash, Compress
     return true;
 }
 
-bool UOPBlock::addFile(std::ifstream& fin, const std::string& packedFileName, CompressionFlag compression, bool addDataHash, UOPError *errorQueue)
+bool UOPBlock::addFile(std::ifstream& fin, const std::string& packedFileName, CompressionFlag compression, bool addDataHash, UOPError *errorQueue, ZLibQuality quality)
 {
     if (packedFileName.empty())
     {
@@ -128,7 +128,35 @@ bool UOPBlock::addFile(std::ifstream& fin, const std::string& packedFileName, Co
         return false;
     }
     const unsigned long long fileHash = hashFileName(packedFileName);
-    return addFile(fin, fileHash, compression, addDataHash, errorQueue);
+    return addFile(fin, fileHash, compression, addDataHash, errorQueue, quality);
+}
+
+bool UOPBlock::addPendingFile(const std::string& sourceFilePath, unsigned long long fileHash, CompressionFlag compression, bool addDataHash, UOPError *errorQueue, ZLibQuality quality)
+{
+    UOPFile* file = new UOPFile(this, m_fileCount);
+    if (! file->createPendingFile(sourceFilePath, fileHash, compression, addDataHash, errorQueue, quality) )
+    {
+        delete file;
+        return false;
+    }
+
+    m_files.push_back(file);
+    ++m_fileCount;
+    return true;
+}
+
+bool UOPBlock::addPendingFile(const UOPDataProvider& sourceProvider, unsigned long long fileHash, CompressionFlag compression, bool addDataHash, UOPError *errorQueue, ZLibQuality quality)
+{
+    UOPFile* file = new UOPFile(this, m_fileCount);
+    if (! file->createPendingFile(sourceProvider, fileHash, compression, addDataHash, errorQueue, quality) )
+    {
+        delete file;
+        return false;
+    }
+
+    m_files.push_back(file);
+    ++m_fileCount;
+    return true;
 }
 
 
@@ -28,8 +28,10 @@ public:
     void freePackedData();
 
     unsigned int searchByHash(unsigned long long hash) const;
-    bool addFile(std::ifstream& fin, unsigned long long fileHash,       CompressionFlag compression, bool addDataHash, UOPError* errorQueue = nullptr);
-    bool addFile(std::ifstream& fin, const std::string& packedFileName, CompressionFlag compression, bool addDataHash, UOPError* errorQueue = nullptr);
+    bool addFile(std::ifstream& fin, unsigned long long fileHash,       CompressionFlag compression, bool addDataHash, UOPError* errorQueue = nullptr, ZLibQuality quality = ZLibQuality::Speed);
+    bool addFile(std::ifstream& fin, const std::string& packedFileName, CompressionFlag compression, bool addDataHash, UOPError* errorQueue = nullptr, ZLibQuality quality = ZLibQuality::Speed);
+    bool addPendingFile(const std::string& sourceFilePath, unsigned long long fileHash, CompressionFlag compression, bool addDataHash, UOPError* errorQueue = nullptr, ZLibQuality quality = ZLibQuality::Speed);
+    bool addPendingFile(const UOPDataProvider& sourceProvider, unsigned long long fileHash, CompressionFlag compression, bool addDataHash, UOPError* errorQueue = nullptr, ZLibQuality quality = ZLibQuality::Speed);
 
 // Block structure
 private:
@@ -18,6 +18,16 @@ enum class CompressionFlag : short
     ZLib = 1
 };
 
+// zlib compression level. Any value between 0 and 9 is accepted.
+enum class ZLibQuality : int
+{
+    Default     = -1,   // currently equivalent to 6
+    None        = 0,
+    Speed       = 1,
+    Medium      = 5,
+    Best        = 9
+};
+
 std::string translateZlibError(int z_result);
 
 }
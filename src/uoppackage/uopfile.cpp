@@ -4,25 +4,15 @@
 */
 #include "uopfile.h"
 
-#include <cstring> // for memset
+#include <cstring> // for memset, memcpy
 #include <sstream>
 #include "zlib.h"
 
-#include "uopblock.h"
+#include "uoppackage.h"
 #include "uophash.h"
 
 #define ADDERROR(str) UOPError::append((str), errorQueue)
 
-enum class ZLibQuality
-{
-    None		= 0,
-    Speed		= 1,
-    Medium      = 5,
-    Best		= 9//,
-    //Default	= -1,
-};
-
-
 namespace uopp
 {
 
@@ -31,7 +21,7 @@ UOPFile::UOPFile(UOPBlock *parent, unsigned int index) :
     m_parent(parent), m_index(index),
     m_dataBlockAddress(0), m_dataBlockLength(0), m_compressedSize(0), m_decompressedSize(0),
     m_fileHash(0), m_dataBlockHash(0), m_compression(CompressionFlag::Uninitialized),
-    m_added(false)
+    m_added(false), m_compressionLevel(ZLibQuality::Speed), m_addDataHash(false)
 {
 }
 
@@ -90,20 +80,66 @@ void UOPFile::freePackedData()
     m_data.shrink_to_fit();
 }
 
+UOPDataView UOPFile::getPackedDataView(UOPError* errorQueue) const
+{
+    if (!m_data.empty())
+        return UOPDataView{m_data.data(), m_data.size()};
+
+    const UOPPackage* package = (m_parent != nullptr) ? m_parent->m_parent : nullptr;
+    if ((package == nullptr) || !package->isMapped() || (m_compressedSize == 0))
+        return UOPDataView{nullptr, 0};
+
+    const unsigned long long dataStart = m_dataBlockAddress + m_dataBlockLength;
+    if ((dataStart > package->m_mappedSize) || (m_compressedSize > package->m_mappedSize - dataStart))
+    {
+        std::stringstream ss;
+        ss << "UOPFile::getPackedDataView: Packed data out of the mapped file (block= " << m_parent->m_index << ", index= " << m_index << ")";
+        ADDERROR(ss.str());
+        return UOPDataView{nullptr, 0};
+    }
+    return UOPDataView{package->m_mappedData + dataStart, m_compressedSize};
+}
+
+bool UOPFile::loadPackedDataIfPending(UOPError *errorQueue)
+{
+    // The packed data of an added file is freed after it's written by UOPPackage::finalizeAndSave, but we still have its source.
+    if (isPending())
+        return loadPendingFile(errorQueue);
+    return true;
+}
+
 bool UOPFile::unpack(std::vector<char>* decompressedData, UOPError *errorQueue)
 {
-    if (m_data.empty())
+    if (!loadPackedDataIfPending(errorQueue))
+        return false;
+    if (getPackedDataView(errorQueue).data == nullptr)
+        return false;
+
+    decompressedData->resize((m_compression == CompressionFlag::None) ? m_compressedSize : m_decompressedSize);
+    return unpack(decompressedData->data(), decompressedData->size(), errorQueue);
+}
+
+bool UOPFile::unpack(char* destination, size_t destinationSize, UOPError *errorQueue)
+{
+    if (!loadPackedDataIfPending(errorQueue))
+        return false;
+    const UOPDataView packed = getPackedDataView(errorQueue);
+    if (packed.data == nullptr)
         return false;
 
     switch ( m_compression )
     {
         case CompressionFlag::ZLib:
         {
-            decompressedData->resize(m_decompressedSize);
+            if (destinationSize < m_decompressedSize)
+            {
+                ADDERROR("UOPFile::unpack: Destination buffer too small (" + std::to_string(m_fileHash) + ")");
+                return false;
+            }
             uLongf destLength = m_decompressedSize;
 
-            int z_result = ::uncompress(reinterpret_cast<Bytef*>(decompressedData->data()), &destLength,
-                                        reinterpret_cast<const Bytef*>(m_data.data()), m_compressedSize );
+            int z_result = ::uncompress(reinterpret_cast<Bytef*>(destination), &destLength,
+                                        reinterpret_cast<const Bytef*>(packed.data), uLong(packed.size) );
 
             bool success = true;
             if (z_result != Z_OK)
@@ -119,7 +155,12 @@ bool UOPFile::unpack(std::vector<char>* decompressedData, UOPError *errorQueue)
         }
 
         case CompressionFlag::None:
-            *decompressedData = m_data;
+            if (destinationSize < packed.size)
+            {
+                ADDERROR("UOPFile::unpack: Destination buffer too small (" + std::to_string(m_fileHash) + ")");
+                return false;
+            }
+            memcpy(destination, packed.data, packed.size);
             return true;
 
         default:
@@ -128,16 +169,101 @@ bool UOPFile::unpack(std::vector<char>* decompressedData, UOPError *errorQueue)
     }
 }
 
+bool UOPFile::unpackView(std::vector<char>* buffer, UOPDataView* view, UOPError *errorQueue)
+{
+    // The returned view is valid as long as the package stays mapped (or the packed data is held in memory),
+    //  or, for compressed files, as long as the buffer isn't modified.
+    if (m_compression == CompressionFlag::None)
+    {
+        if (!loadPackedDataIfPending(errorQueue))
+        {
+            *view = UOPDataView{nullptr, 0};
+            return false;
+        }
+        *view = getPackedDataView(errorQueue);
+        return (view->data != nullptr);
+    }
+
+    if (!unpack(buffer, errorQueue))
+    {
+        *view = UOPDataView{nullptr, 0};
+        return false;
+    }
+    *view = UOPDataView{buffer->data(), buffer->size()};
+    return true;
+}
+
+bool UOPFile::verify(std::vector<char>* scratchBuffer, UOPError* errorQueue) const
+{
+    std::stringstream ssFile;
+    ssFile << "(block= " << (m_parent ? m_parent->m_index : unsigned(-1)) << ", index= " << m_index << ", fileHash= 0x" << std::hex << m_fileHash << ")";
+    const std::string strFile(ssFile.str());
+
+    const UOPDataView packed = getPackedDataView(errorQueue);
+    if ((packed.data == nullptr) && (m_compressedSize != 0))
+    {
+        ADDERROR("UOPFile::verify: Packed data not available " + strFile);
+        return false;
+    }
+
+    if ((m_dataBlockHash != 0) && (hashDataBlock(packed.data, packed.size) != m_dataBlockHash))
+    {
+        ADDERROR("UOPFile::verify: Data block hash mismatch " + strFile);
+        return false;
+    }
+
+    switch ( m_compression )
+    {
+        case CompressionFlag::ZLib:
+        {
+            scratchBuffer->resize(m_decompressedSize);
+            uLongf destLength = m_decompressedSize;
+            const int z_result = ::uncompress(reinterpret_cast<Bytef*>(scratchBuffer->data()), &destLength,
+                                              reinterpret_cast<const Bytef*>(packed.data), uLong(packed.size) );
+            if (z_result != Z_OK)
+            {
+                // Z_BUF_ERROR is returned also if the unpacked data is bigger than the stored decompressed size
+                ADDERROR("UOPFile::verify: ZLib decompression error: " + translateZlibError(z_result) + " " + strFile);
+                return false;
+            }
+            if (destLength != uLongf(m_decompressedSize))
+            {
+                ADDERROR("UOPFile::verify: Decompressed size mismatch (stored " + std::to_string(m_decompressedSize) +
+                         ", actual " + std::to_string(destLength) + ") " + strFile);
+                return false;
+            }
+            return true;
+        }
+
+        case CompressionFlag::None:
+            if (m_compressedSize != m_decompressedSize)
+            {
+                ADDERROR("UOPFile::verify: Compressed-decompressed size mismatch for uncompressed file " + strFile);
+                return false;
+            }
+            return true;
+
+        default:
+            ADDERROR("UOPFile::verify: Invalid compression flag: " + std::to_string(short(m_compression)) + " " + strFile);
+            return false;
+    }
+}
+
 
 //--
 
-bool UOPFile::compressAndReplaceData(const std::vector<char>* sourceDecompressed, CompressionFlag compression, bool addDataHash, UOPError* errorQueue)
+bool UOPFile::compressAndReplaceData(const std::vector<char>* sourceDecompressed, CompressionFlag compression, bool addDataHash, UOPError *errorQueue, ZLibQuality quality)
 {
     if (compression == CompressionFlag::Uninitialized)
     {
         ADDERROR("UOPFile::compressAndReplaceData: Invalid compression flag: " + std::to_string(short(m_compression)));
         return false;
     }
+    if ((int(quality) < int(ZLibQuality::Default)) || (int(quality) > int(ZLibQuality::Best)))
+    {
+        ADDERROR("UOPFile::compressAndReplaceData: Invalid compression level: " + std::to_string(int(quality)));
+        return false;
+    }
 
     m_compression = compression;
     m_decompressedSize = unsigned(sourceDecompressed->size());
@@ -155,8 +281,9 @@ bool UOPFile::compressAndReplaceData(const std::vector<char>* sourceDecompressed
     uLongf compressedSizeTemp = uLongf(m_data.size());
     int error = ::compress2(reinterpret_cast<Bytef*>(m_data.data()), &compressedSizeTemp,
                             reinterpret_cast<const Bytef*>(sourceDecompressed->data()), uLong(sourceDecompressed->size()),
-                            int(ZLibQuality::Speed) );
+                            int(quality) );
     m_compressedSize = unsigned(compressedSizeTemp);
+    m_data.resize(m_compressedSize);    // compressBound is only an upper limit
 
     if (error != Z_OK)
     {
@@ -173,7 +300,7 @@ bool UOPFile::compressAndReplaceData(const std::vector<char>* sourceDecompressed
     return true;
 }
 
-bool UOPFile::createFile(std::ifstream& fin, unsigned long long fileHash, CompressionFlag compression, bool addDataHash, UOPError *errorQueue)    // create file in memory
+bool UOPFile::createFile(std::ifstream& fin, unsigned long long fileHash, CompressionFlag compression, bool addDataHash, UOPError *errorQueue, ZLibQuality quality)    // create file in memory
 {
     std::stringstream ssHash; ssHash << std::hex << fileHash;
     const std::string strHash("0x" + ssHash.str());
@@ -211,10 +338,10 @@ bool UOPFile::createFile(std::ifstream& fin, unsigned long long fileHash, Compre
     //fin.exceptions(std::ios::badbit | std::ios::failbit | std::ios::eofbit);
     fin.read(finData.data(), finSizeToRead);
 
-    return compressAndReplaceData(&finData, compression, addDataHash, errorQueue);
+    return compressAndReplaceData(&finData, compression, addDataHash, errorQueue, quality);
 }
 
-bool UOPFile::createFile(std::ifstream& fin, const std::string& packedFileName, CompressionFlag compression, bool addDataHash, UOPError *errorQueue)  // create file in memory
+bool UOPFile::createFile(std::ifstream& fin, const std::string& packedFileName, CompressionFlag compression, bool addDataHash, UOPError *errorQueue, ZLibQuality quality)  // create file in memory
 {
     if (packedFileName.empty())
     {
@@ -228,7 +355,68 @@ bool UOPFile::createFile(std::ifstream& fin, const std::string& packedFileName,
     }
 
     const unsigned long long fileHash = hashFileName(packedFileName);
-    return createFile(fin, fileHash, compression, addDataHash, errorQueue);
+    return createFile(fin, fileHash, compression, addDataHash, errorQueue, quality);
+}
+
+bool UOPFile::createPendingFile(const std::string& sourceFilePath, unsigned long long fileHash, CompressionFlag compression, bool addDataHash, UOPError *errorQueue, ZLibQuality quality)
+{
+    if (sourceFilePath.empty())
+    {
+        ADDERROR("UOPFile::createPendingFile: Invalid source file path");
+        return false;
+    }
+    if (!createPendingFile(UOPDataProvider(), fileHash, compression, addDataHash, errorQueue, quality))
+        return false;
+    m_sourceFilePath = sourceFilePath;
+    return true;
+}
+
+bool UOPFile::createPendingFile(const UOPDataProvider& sourceProvider, unsigned long long fileHash, CompressionFlag compression, bool addDataHash, UOPError *errorQueue, ZLibQuality quality)
+{
+    std::stringstream ssHash; ssHash << std::hex << fileHash;
+    const std::string strHash("0x" + ssHash.str());
+    if (fileHash == 0)
+    {
+        ADDERROR("UOPFile::createPendingFile: Invalid fileHash: " + strHash);
+        return false;
+    }
+    if (compression == CompressionFlag::Uninitialized)
+    {
+        ADDERROR("UOPFile::createPendingFile: Invalid compression flag: " + std::to_string(short(compression)) + " (fileHash: " + strHash + ")");
+        return false;
+    }
+    m_added = true;
+
+    m_fileHash = fileHash;
+    m_compression = compression;
+    m_sourceProvider = sourceProvider;
+    m_compressionLevel = quality;
+    m_addDataHash = addDataHash;
+    return true;
+}
+
+bool UOPFile::loadPendingFile(UOPError* errorQueue)
+{
+    if (m_sourceProvider)
+    {
+        std::vector<char> sourceData;
+        if (!m_sourceProvider(&sourceData))
+        {
+            std::stringstream ssHash; ssHash << std::hex << m_fileHash;
+            ADDERROR("UOPFile::loadPendingFile: Cannot get the source data (fileHash: 0x" + ssHash.str() + ")");
+            return false;
+        }
+        return compressAndReplaceData(&sourceData, m_compression, m_addDataHash, errorQueue, m_compressionLevel);
+    }
+
+    std::ifstream fin;
+    fin.open(m_sourceFilePath, std::ios::in | std::ios::binary);
+    if (!fin.is_open())
+    {
+        ADDERROR("UOPFile::loadPendingFile: Cannot open (read) " + m_sourceFilePath);
+        return false;
+    }
+    return createFile(fin, m_fileHash, m_compression, m_addDataHash, errorQueue, m_compressionLevel);
 }
 
 
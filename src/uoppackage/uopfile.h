@@ -8,6 +8,7 @@
 #include "uoperror.h"
 #include "uopcompression.h"
 #include <fstream>
+#include <functional>
 #include <vector>
 
 
@@ -19,6 +20,16 @@ class UOPPackage;
 
 static constexpr unsigned int kInvalidIdx = static_cast<unsigned int>(-1);
 
+// Non-owning view over a chunk of bytes (we are on C++14, so no std::span).
+struct UOPDataView
+{
+    const char* data;
+    size_t size;
+};
+
+// Fills the vector with the (uncompressed) data of a file to be added to a package. It may be called by different threads at once.
+using UOPDataProvider = std::function<bool(std::vector<char>* data)>;
+
 
 class UOPFile
 {
@@ -37,10 +48,27 @@ public:
     bool readPackedData(std::ifstream& fin, UOPError* errorQueue = nullptr);
     void freePackedData();
     bool unpack(std::vector<char> *decompressedData, UOPError* errorQueue = nullptr);   // extract the file
+    bool unpack(char* destination, size_t destinationSize, UOPError* errorQueue = nullptr); // extract the file in a caller-owned buffer
+    bool unpackView(std::vector<char>* buffer, UOPDataView* view, UOPError* errorQueue = nullptr); // no copy for uncompressed files, otherwise extract in buffer
+
+    // Packed data held in memory (after readPackedData) or, if the package is memory-mapped, straight from the mapping.
+    UOPDataView getPackedDataView(UOPError* errorQueue = nullptr) const;
 
-    bool compressAndReplaceData(const std::vector<char>* sourceDecompressed,CompressionFlag compression, bool addDataHash, UOPError* errorQueue = nullptr);
-    bool createFile(std::ifstream& fin, unsigned long long fileHash,        CompressionFlag compression, bool addDataHash, UOPError* errorQueue = nullptr);    // create file in memory
-    bool createFile(std::ifstream& fin, const std::string& packedFileName,  CompressionFlag compression, bool addDataHash, UOPError* errorQueue = nullptr);    // create file in memory
+    // Integrity check: recompute the hash of the packed data (if stored) and check the unpacked size, inflating in the scratch buffer.
+    bool verify(std::vector<char>* scratchBuffer, UOPError* errorQueue = nullptr) const;
+
+    bool compressAndReplaceData(const std::vector<char>* sourceDecompressed,CompressionFlag compression, bool addDataHash, UOPError* errorQueue = nullptr, ZLibQuality quality = ZLibQuality::Speed);
+    bool createFile(std::ifstream& fin, unsigned long long fileHash,        CompressionFlag compression, bool addDataHash, UOPError* errorQueue = nullptr, ZLibQuality quality = ZLibQuality::Speed);    // create file in memory
+    bool createFile(std::ifstream& fin, const std::string& packedFileName,  CompressionFlag compression, bool addDataHash, UOPError* errorQueue = nullptr, ZLibQuality quality = ZLibQuality::Speed);    // create file in memory
+
+    // Pending file: only the source (path or data provider) and the compression settings are stored, the data is read and compressed
+    //  by loadPendingFile (called by UOPPackage::finalizeAndSave).
+    bool createPendingFile(const std::string& sourceFilePath, unsigned long long fileHash, CompressionFlag compression, bool addDataHash, UOPError* errorQueue = nullptr, ZLibQuality quality = ZLibQuality::Speed);
+    bool createPendingFile(const UOPDataProvider& sourceProvider, unsigned long long fileHash, CompressionFlag compression, bool addDataHash, UOPError* errorQueue = nullptr, ZLibQuality quality = ZLibQuality::Speed);
+    bool loadPendingFile(UOPError* errorQueue = nullptr);
+
+private:
+    bool loadPackedDataIfPending(UOPError* errorQueue);
 
 // File structure
 private:
@@ -58,6 +86,10 @@ private:
 
     // Used only when creating a package
     bool m_added;
+    std::string m_sourceFilePath;   // for pending files
+    UOPDataProvider m_sourceProvider;
+    ZLibQuality m_compressionLevel;
+    bool m_addDataHash;
 
 public:
     UOPBlock* getParent() const                     { return m_parent;              }
@@ -74,6 +106,7 @@ public:
     const std::vector<char>* getDataVec() const     { return &m_data;               }
     std::vector<char>* getDataVec()                 { return &m_data;               }
     bool isAdded() const                            { return m_added;               }
+    bool isPending() const                          { return (!m_sourceFilePath.empty() || m_sourceProvider) && m_data.empty(); }
 };
 
 
@@ -4,9 +4,13 @@
 */
 #include "uoppackage.h"
 
+#include <algorithm>    // for std::min
+#include <condition_variable>
+#include <cstdint>      // for SIZE_MAX
 #include <cstring>      // for strcmp
 #include <exception>    // for std::logic_error
 #include <iostream>
+#include <mutex>
 #include <sstream>
 
 // Headers needed to get the absolute path of a file
@@ -17,6 +21,18 @@
     #include <cstdlib>  // for realpath
 #endif
 
+#ifdef _OPENMP
+    #include <omp.h>
+#endif
+
+// Headers needed to memory-map a file
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
 #include "uophash.h"
 
 #define ADDERROR(str) UOPError::append((str), errorQueue)
@@ -30,7 +46,11 @@ UOPPackage::UOPPackage(unsigned int version, unsigned int maxFilesPerBlock) :
     m_version(version),
     m_misc(0xFD23EC43), m_startAddress(0),
     m_blockSize(maxFilesPerBlock), m_fileCount(0),
-    m_curBlockIdx(0)
+    m_curBlockIdx(0), m_hashTableCount(0),
+    m_mappedData(nullptr), m_mappedSize(0)
+#ifdef _WIN32
+    , m_mappingHandle(nullptr)
+#endif
 {
     if ((m_version < kMinSupportedVersion) || (m_version > kMaxSupportedVersion))
         throw std::logic_error("Trying to construct UOPPackage with unsupported version=" + std::to_string(m_version));
@@ -38,6 +58,7 @@ UOPPackage::UOPPackage(unsigned int version, unsigned int maxFilesPerBlock) :
 
 UOPPackage::~UOPPackage()
 {
+    unmapPackageFile();
     for (UOPBlock *block : m_blocks)
         delete block;
 }
@@ -45,7 +66,7 @@ UOPPackage::~UOPPackage()
 
 UOPFile* UOPPackage::getFileByIndex(unsigned int block, unsigned int index) const
 {
-    if ((m_blocks.size() < block) || (m_blocks[block]->getFilesCount() < index) )
+    if ((m_blocks.size() <= block) || (m_blocks[block]->getFilesCount() <= index) )
         return nullptr;
     return m_blocks[block]->m_files[index];
 }
@@ -61,6 +82,24 @@ UOPFile* UOPPackage::getFileByName(const std::string &filename)
 
 bool UOPPackage::searchByHash(unsigned long long hash, unsigned int *block, unsigned int *index) const
 {
+    if ((hash != 0) && !m_hashTable.empty())
+    {
+        // The file hashes are already well distributed, so we can use the lower bits to get the slot
+        const size_t mask = m_hashTable.size() - 1;
+        for (size_t slot = size_t(hash ^ (hash >> 32)) & mask; m_hashTable[slot].hash != 0; slot = (slot + 1) & mask)
+        {
+            const HashTableSlot& cur = m_hashTable[slot];
+            if (cur.hash == hash)
+            {
+                *block = cur.block;
+                *index = cur.index;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // No lookup table (or looking for an empty entry): scan the blocks
     unsigned int idx;
     for (unsigned int bl = 0, sz = unsigned(m_blocks.size()); bl < sz; ++bl)
     {
@@ -75,6 +114,50 @@ bool UOPPackage::searchByHash(unsigned long long hash, unsigned int *block, unsi
     return false;
 }
 
+void UOPPackage::buildHashTable()
+{
+    size_t filesCount = 0;
+    for (const UOPBlock* block : m_blocks)
+        filesCount += block->getFilesCount();
+
+    // Keep the load factor at most 0.5, so that the probe sequences stay short
+    size_t capacity = 16;
+    while (capacity < filesCount * 2)
+        capacity *= 2;
+
+    m_hashTable.assign(capacity, HashTableSlot{0, kInvalidIdx, kInvalidIdx});
+    m_hashTableCount = 0;
+    for (unsigned int bl = 0, blocksCount = unsigned(m_blocks.size()); bl < blocksCount; ++bl)
+    {
+        const UOPBlock* block = m_blocks[bl];
+        for (unsigned int idx = 0, filesInBlock = block->getFilesCount(); idx < filesInBlock; ++idx)
+            insertInHashTable(block->m_files[idx]->getFileHash(), bl, idx);
+    }
+}
+
+void UOPPackage::insertInHashTable(unsigned long long hash, unsigned int block, unsigned int index)
+{
+    if (hash == 0)
+        return;
+    if ((m_hashTableCount + 1) * 2 > m_hashTable.size())
+    {
+        // Table too full, rebuild it bigger (it will contain also the file we are adding, since it's already in the block)
+        m_hashTable.clear();
+        buildHashTable();
+        return;
+    }
+
+    const size_t mask = m_hashTable.size() - 1;
+    size_t slot = size_t(hash ^ (hash >> 32)) & mask;
+    for (; m_hashTable[slot].hash != 0; slot = (slot + 1) & mask)
+    {
+        if (m_hashTable[slot].hash == hash)
+            return;     // duplicated hash: keep the first file, like a sequential search would do
+    }
+    m_hashTable[slot] = HashTableSlot{hash, block, index};
+    ++m_hashTableCount;
+}
+
 
 //--
 
@@ -143,6 +226,7 @@ bool UOPPackage::load(const std::string& fileName, UOPError* errorQueue)
 
     fin.close();
 
+    buildHashTable();
     return true;
 }
 
@@ -151,7 +235,7 @@ bool UOPPackage::readPackedData(UOPError* errorQueue)
     std::ifstream fin = getOpenedStream();
     if (!fin.is_open())
     {
-        ADDERROR("UOPPackage::readPackedData: Can't open source package " + m_filePath);
+        ADDERROR("UOPPackage::readPackedData: Can't open source package " + m_packageName);
         return false;
     }
 
@@ -172,9 +256,150 @@ void UOPPackage::freePackedData()
     }
 }
 
+bool UOPPackage::mapPackageFile(UOPError* errorQueue)
+{
+    if (isMapped())
+        return true;
+    if (m_packageName.empty())
+    {
+        ADDERROR("UOPPackage::mapPackageFile: No package loaded");
+        return false;
+    }
+
+#ifdef _WIN32
+    HANDLE hFile = CreateFileA(m_packageName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        ADDERROR("UOPPackage::mapPackageFile: Cannot open (read) " + m_packageName);
+        return false;
+    }
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(hFile, &fileSize) || (fileSize.QuadPart <= 0) || (static_cast<unsigned long long>(fileSize.QuadPart) > SIZE_MAX))
+    {
+        CloseHandle(hFile);
+        ADDERROR("UOPPackage::mapPackageFile: Invalid file size " + m_packageName);
+        return false;
+    }
+    HANDLE hMapping = CreateFileMappingA(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(hFile); // the mapping object keeps its own reference to the file
+    void* view = (hMapping != nullptr) ? MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    if (view == nullptr)
+    {
+        if (hMapping != nullptr)
+            CloseHandle(hMapping);
+        ADDERROR("UOPPackage::mapPackageFile: Cannot map " + m_packageName);
+        return false;
+    }
+    m_mappingHandle = hMapping;
+    m_mappedSize = static_cast<unsigned long long>(fileSize.QuadPart);
+#else
+    const int fd = open(m_packageName.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        ADDERROR("UOPPackage::mapPackageFile: Cannot open (read) " + m_packageName);
+        return false;
+    }
+    struct stat fileStat;
+    if ((fstat(fd, &fileStat) != 0) || (fileStat.st_size <= 0) || (static_cast<unsigned long long>(fileStat.st_size) > SIZE_MAX))
+    {
+        close(fd);
+        ADDERROR("UOPPackage::mapPackageFile: Invalid file size " + m_packageName);
+        return false;
+    }
+    void* view = mmap(nullptr, size_t(fileStat.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);  // the mapping stays valid after closing the descriptor
+    if (view == MAP_FAILED)
+    {
+        ADDERROR("UOPPackage::mapPackageFile: Cannot map " + m_packageName);
+        return false;
+    }
+    m_mappedSize = static_cast<unsigned long long>(fileStat.st_size);
+#endif
+
+    m_mappedData = static_cast<const char*>(view);
+    return true;
+}
+
+void UOPPackage::unmapPackageFile()
+{
+    if (!isMapped())
+        return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(m_mappedData);
+    CloseHandle(m_mappingHandle);
+    m_mappingHandle = nullptr;
+#else
+    munmap(const_cast<char*>(m_mappedData), size_t(m_mappedSize));
+#endif
+    m_mappedData = nullptr;
+    m_mappedSize = 0;
+}
+
+bool UOPPackage::verify(UOPError* errorQueue, unsigned int* badFilesCount)
+{
+    // Read the packed data through a memory mapping if we can, so that every thread can access it without copies.
+    // Otherwise, each thread reads it with its own stream.
+    const bool wasMapped = isMapped();
+    if (!wasMapped)
+        mapPackageFile();
+
+    const long long blocksCount = (long long)m_blocks.size();
+    std::vector<UOPError> blockErrors(m_blocks.size());
+    std::vector<unsigned int> blockBadFiles(m_blocks.size(), 0);
+
+    #pragma omp parallel
+    {
+        std::vector<char> scratchBuffer;    // per-thread buffer to inflate the data
+        std::ifstream fin;
+
+        #pragma omp for schedule(dynamic)
+        for (long long bl = 0; bl < blocksCount; ++bl)
+        {
+            UOPError* blockErrorQueue = &blockErrors[size_t(bl)];
+            for (UOPFile* file : m_blocks[size_t(bl)]->m_files)
+            {
+                const bool readData = !isMapped() && !file->hasData() && (file->getCompressedSize() != 0);
+                if (readData)
+                {
+                    if (!fin.is_open())
+                        fin.open(m_packageName, std::ios::in | std::ios::binary);
+                    fin.clear();
+                    if (!file->readPackedData(fin, blockErrorQueue))
+                    {
+                        file->freePackedData();
+                        ++blockBadFiles[size_t(bl)];
+                        continue;
+                    }
+                }
+
+                if (!file->verify(&scratchBuffer, blockErrorQueue))
+                    ++blockBadFiles[size_t(bl)];
+
+                if (readData)
+                    file->freePackedData();
+            }
+        }
+    }
+
+    if (!wasMapped)
+        unmapPackageFile();
+
+    unsigned int badFiles = 0;
+    for (size_t bl = 0; bl < m_blocks.size(); ++bl)
+    {
+        badFiles += blockBadFiles[bl];
+        for (const std::string& str : blockErrors[bl].getErrorQueue())
+            ADDERROR(str);
+    }
+    if (badFilesCount)
+        *badFilesCount = badFiles;
+    return (badFiles == 0);
+}
+
 //--
 
-bool UOPPackage::addFile(const std::string& filePath, unsigned long long fileHash, CompressionFlag compression, bool addDataHash, UOPError *errorQueue)
+bool UOPPackage::addFile(const std::string& filePath, unsigned long long fileHash, CompressionFlag compression, bool addDataHash, UOPError *errorQueue, ZLibQuality quality)
 {
     std::stringstream ssHash; ssHash << std::hex << fileHash;
     std::string strHash("0x" + ssHash.str());
@@ -189,6 +414,7 @@ bool UOPPackage::addFile(const std::string& filePath, unsigned long long fileHas
         return false;
     }
 
+    // Only check that we can read the file: its content will be read and compressed later, when saving the package
     std::ifstream fin;
     fin.open(filePath, std::ios::in | std::ios::binary );
     if ( !fin.is_open() )
@@ -196,28 +422,45 @@ bool UOPPackage::addFile(const std::string& filePath, unsigned long long fileHas
         ADDERROR("UOPPackage::addFile: Cannot open (read) " + filePath);
         return false;
     }
+    fin.close();
 
-    UOPBlock* curBlock;
-    if ( !m_blocks.empty() && (m_blocks[m_curBlockIdx]->getFilesCount() < m_blockSize))
-    {
-        curBlock = m_blocks[m_curBlockIdx];
-    }
-    else
+    UOPBlock* curBlock = getBlockForNewFile();
+    if (!curBlock->addPendingFile(filePath, fileHash, compression, addDataHash, errorQueue, quality))
+        return false;
+    insertInHashTable(fileHash, m_curBlockIdx, curBlock->getFilesCount() - 1);
+
+    return true;
+}
+
+bool UOPPackage::addFile(const UOPDataProvider& sourceProvider, unsigned long long fileHash, CompressionFlag compression, bool addDataHash, UOPError *errorQueue, ZLibQuality quality)
+{
+    if (!sourceProvider)
     {
-        curBlock = new UOPBlock(this, m_curBlockIdx);
-        curBlock->m_parent = this;
-        m_blocks.push_back(curBlock);
-        m_curBlockIdx = unsigned(m_blocks.size()) - 1;
+        ADDERROR("UOPPackage::addFile: Invalid data provider");
+        return false;
     }
 
-    if (!curBlock->addFile(fin, fileHash, compression, addDataHash, errorQueue))
+    UOPBlock* curBlock = getBlockForNewFile();
+    if (!curBlock->addPendingFile(sourceProvider, fileHash, compression, addDataHash, errorQueue, quality))
         return false;
+    insertInHashTable(fileHash, m_curBlockIdx, curBlock->getFilesCount() - 1);
 
-    fin.close();
     return true;
 }
 
-bool UOPPackage::addFile(const std::string& filePath, const std::string& packedFileName, CompressionFlag compression, bool addDataHash, UOPError *errorQueue)
+UOPBlock* UOPPackage::getBlockForNewFile()
+{
+    if ( !m_blocks.empty() && (m_blocks[m_curBlockIdx]->getFilesCount() < m_blockSize))
+        return m_blocks[m_curBlockIdx];
+
+    UOPBlock* newBlock = new UOPBlock(this, unsigned(m_blocks.size()));
+    newBlock->m_parent = this;
+    m_blocks.push_back(newBlock);
+    m_curBlockIdx = unsigned(m_blocks.size()) - 1;
+    return newBlock;
+}
+
+bool UOPPackage::addFile(const std::string& filePath, const std::string& packedFileName, CompressionFlag compression, bool addDataHash, UOPError *errorQueue, ZLibQuality quality)
 {
     if (packedFileName.empty())
     {
@@ -231,7 +474,7 @@ bool UOPPackage::addFile(const std::string& filePath, const std::string& packedF
     }
 
     unsigned long long fileHash = hashFileName(packedFileName);
-    return addFile(filePath, fileHash, compression, addDataHash, errorQueue);
+    return addFile(filePath, fileHash, compression, addDataHash, errorQueue, quality);
 }
 
 bool UOPPackage::finalizeAndSave(const std::string& uopPath, UOPError* errorQueue)
@@ -242,7 +485,7 @@ bool UOPPackage::finalizeAndSave(const std::string& uopPath, UOPError* errorQueu
         return false;
     }
 
-    if (!m_filePath.empty())
+    if (!m_packageName.empty())
     {
         // This isn't a new file. Ensure that we aren't overwriting the source file.
         bool sameSrcDest = false;
@@ -251,14 +494,14 @@ bool UOPPackage::finalizeAndSave(const std::string& uopPath, UOPError* errorQueu
     #ifdef _WIN32
         char srcPathBuf[256];
         char destPathBuf[256];
-        GetFullPathNameA(m_filePath.c_str(), sizeof(srcPathBuf),  srcPathBuf, nullptr);
+        GetFullPathNameA(m_packageName.c_str(), sizeof(srcPathBuf),  srcPathBuf, nullptr);
         GetFullPathNameA(uopPath.c_str(),    sizeof(destPathBuf), destPathBuf, nullptr);
         if (strcmp(srcPathBuf, destPathBuf) == 0)
             sameSrcDest = true;
     #else
-        char *srcPathBuf  = realpath(m_filePath.c_str(), nullptr);
-        char *destPathBuf = realpath(uopPath.c_str(),    nullptr);
-        if (strcmp(srcPathBuf, destPathBuf) == 0)
+        char *srcPathBuf  = realpath(m_packageName.c_str(), nullptr);
+        char *destPathBuf = realpath(uopPath.c_str(),    nullptr);   // nullptr if the destination file doesn't exist yet
+        if (srcPathBuf && destPathBuf && (strcmp(srcPathBuf, destPathBuf) == 0))
             sameSrcDest = true;
         if (srcPathBuf)  free(srcPathBuf);
         if (destPathBuf) free(destPathBuf);
@@ -276,7 +519,7 @@ bool UOPPackage::finalizeAndSave(const std::string& uopPath, UOPError* errorQueu
     fout.open(uopPath, std::ios::out | std::ios::binary );
     if ( !fout.is_open() )
     {
-        ADDERROR("UOPPackage::save: Cannot open (write) " + m_packageName);
+        ADDERROR("UOPPackage::save: Cannot open (write) " + uopPath);
         return false;
     }
 
@@ -326,9 +569,12 @@ bool UOPPackage::finalizeAndSave(const std::string& uopPath, UOPError* errorQueu
     std::vector<std::streamoff> blockInfoStartAddresses;
     blockInfoStartAddresses.reserve(m_blocks.size());
     std::vector<std::streamoff> fileInfoStartAddresses;
-    fileInfoStartAddresses.reserve(m_blocks.size() * m_blockSize);
+    fileInfoStartAddresses.reserve(m_fileCount);
+    std::vector<UOPFile*> files;
+    files.reserve(m_fileCount);
 
     // Loop through the blocks
+    static constexpr char emptyFileHeader[34] = {0};
     fout.seekp(std::streamoff(m_startAddress));
     for (UOPBlock *curBlock : m_blocks)
     {
@@ -338,22 +584,14 @@ bool UOPPackage::finalizeAndSave(const std::string& uopPath, UOPError* errorQueu
         fout.write(reinterpret_cast<char*>(&curBlock->m_fileCount), 4);
         fout.write(reinterpret_cast<char*>(&curBlock->m_nextBlockAddress), 8);  // i don't have this yet, just write 0.
                                                                                 // also 0 is the legit value if it's the last block
+        // Reserve the space for the headers of the files of this block: we'll write them after the file data,
+        //  since only then we'll know their address and (for the files added to the package) their size.
         unsigned int iFile = 0;
-        // Loop through all the files of this block
         for (UOPFile *curFile : curBlock->m_files)
         {
             fileInfoStartAddresses.push_back(fout.tellp());
-
-            // Write data for this single UOP file
-            curFile->m_dataBlockAddress = 0;
-            fout.write(reinterpret_cast<char*>(&curFile->m_dataBlockAddress), 8); // i don't have this yet, just write 0
-            curFile->m_dataBlockLength = 0;
-            fout.write(reinterpret_cast<char*>(&curFile->m_dataBlockLength), 4);
-            fout.write(reinterpret_cast<char*>(&curFile->m_compressedSize), 4);
-            fout.write(reinterpret_cast<char*>(&curFile->m_decompressedSize), 4);
-            fout.write(reinterpret_cast<char*>(&curFile->m_fileHash), 8);
-            fout.write(reinterpret_cast<char*>(&curFile->m_dataBlockHash), 4);
-            fout.write(reinterpret_cast<char*>(&curFile->m_compression), 2);
+            files.push_back(curFile);
+            fout.write(emptyFileHeader, sizeof(emptyFileHeader));
             ++iFile;
         }
 
@@ -361,7 +599,6 @@ bool UOPPackage::finalizeAndSave(const std::string& uopPath, UOPError* errorQueu
         //  Each block must have a number of headers equal to blockSize.
         while (iFile < m_blockSize)
         {
-            static constexpr char emptyFileHeader[34] = {0};
             fout.write(emptyFileHeader, sizeof(emptyFileHeader));
             ++iFile;
         }
@@ -382,58 +619,167 @@ bool UOPPackage::finalizeAndSave(const std::string& uopPath, UOPError* errorQueu
     /* End of the Header Data */
 
 
-    // Now write the actual file data separately from the info zone, and write back the m_dataBlockAddress in the file header
+    // Now write the actual file data separately from the info zone, then write the file header.
+    // The files added to the package are read and compressed here by a pool of threads, while the first thread writes them
+    //  to disk in order, each one as soon as it's ready. The workers can get only queueSize files ahead of the one being written,
+    //  so we keep in memory only the compressed data of those files.
+#ifdef _OPENMP
+    const size_t queueSize = size_t(omp_get_max_threads()) * 4;
+#else
+    const size_t queueSize = 1;
+#endif
+    struct QueueSlot
+    {
+        UOPError errors;
+        bool loaded;    // was the file pending and did we read it?
+        bool success;
+        bool ready;     // set by the worker which loaded it
+    };
+    std::vector<QueueSlot> queue(queueSize);
+    std::mutex queueMutex;
+    std::condition_variable slotReady, slotFreed;
+    size_t nextToLoad = 0, writtenCount = 0;
+    bool stopWorkers = false;
+
+    auto loadFile = [&files, &queue, queueSize](size_t iFile)
+    {
+        QueueSlot& slot = queue[iFile % queueSize];
+        slot.errors.clear();
+        slot.loaded = files[iFile]->isPending();
+        slot.success = !slot.loaded || files[iFile]->loadPendingFile(&slot.errors);
+    };
+
+    bool writeSuccess = true;
     std::ifstream finSourceUOP;
-    unsigned int iFile = 0;
-    for (UOPBlock* curBlock : m_blocks)
+    #pragma omp parallel
     {
-        for (UOPFile* curFile : curBlock->m_files)
+#ifdef _OPENMP
+        const bool isWriter = (omp_get_thread_num() == 0);
+#else
+        const bool isWriter = true;
+#endif
+        if (!isWriter)
+        {
+            // Worker: take the next file to compress, if it isn't too far ahead of the writer
+            for (;;)
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                slotFreed.wait(lock, [&]() {
+                    return stopWorkers || (nextToLoad >= files.size()) || (nextToLoad < writtenCount + queueSize);
+                });
+                if (stopWorkers || (nextToLoad >= files.size()))
+                    break;
+                const size_t iFile = nextToLoad++;
+                lock.unlock();
+
+                loadFile(iFile);
+
+                lock.lock();
+                queue[iFile % queueSize].ready = true;
+                slotReady.notify_one();     // only the writer waits for it
+            }
+        }
+        else
         {
-            bool freeFileData = false;
-            if ((curFile->getDecompressedSize() != 0) && curFile->m_data.empty() && !m_filePath.empty())
+            // Writer: if no worker has taken the next file yet (or if we are the only thread), compress it ourselves
+            for (size_t iFile = 0; iFile < files.size(); ++iFile)
             {
-                // If the data size is != 0 but the data vector is empty, then i have read only the header of this file but not the packed data: let's fix that.
-                if (!finSourceUOP.is_open())
+                QueueSlot& slot = queue[iFile % queueSize];
                 {
-                    finSourceUOP = getOpenedStream();
-                    if (!finSourceUOP.is_open() || finSourceUOP.bad())
+                    std::unique_lock<std::mutex> lock(queueMutex);
+                    if (nextToLoad == iFile)
+                    {
+                        ++nextToLoad;
+                        lock.unlock();
+                        loadFile(iFile);
+                    }
+                    else
                     {
-                        ADDERROR("UOPPackage::save: Error opening source package " + m_filePath);
-                        return false;
+                        slotReady.wait(lock, [&slot]() { return slot.ready; });
                     }
                 }
 
-                if (!curFile->readPackedData(finSourceUOP, errorQueue))
+                UOPFile* curFile = files[iFile];
+                for (const std::string& str : slot.errors.getErrorQueue())
+                    ADDERROR(str);
+                if (!slot.success)
                 {
-                    ADDERROR("UOPPackage::save: Error reading source package " + m_filePath);
-                    return false;
+                    std::stringstream ssHash; ssHash << std::hex << curFile->getFileHash();
+                    ADDERROR("UOPPackage::save: Error compressing file (fileHash: 0x" + ssHash.str() + ")");
+                    writeSuccess = false;
+                    break;
                 }
-                freeFileData = true;
-            }
 
-            // Write UOP file raw data
-            unsigned long long beforeDataPos = static_cast<unsigned long long>(fout.tellp());
-            fout.write( curFile->m_data.data(), std::streamsize(curFile->m_data.size()) );
-            const std::streampos afterDataPos = fout.tellp();
+                // If we have added the file or the package is memory-mapped, we already have the packed data
+                bool freeFileData = slot.loaded;
+                UOPDataView fileData = curFile->getPackedDataView(errorQueue);
+                if ((fileData.data == nullptr) && (curFile->getCompressedSize() != 0) && !m_packageName.empty())
+                {
+                    // If the data size is != 0 but we don't have the data, then i have read only the header of this file but not the packed data: let's fix that.
+                    if (!finSourceUOP.is_open())
+                    {
+                        finSourceUOP = getOpenedStream();
+                        if (!finSourceUOP.is_open() || finSourceUOP.bad())
+                        {
+                            ADDERROR("UOPPackage::save: Error opening source package " + m_packageName);
+                            writeSuccess = false;
+                            break;
+                        }
+                    }
 
-            if (freeFileData)
-            {
-                // If we don't do this, at the end of the saving process we'll have the whole content of the package loaded into memory
-                curFile->freePackedData();
-            }
+                    if (!curFile->readPackedData(finSourceUOP, errorQueue))
+                    {
+                        ADDERROR("UOPPackage::save: Error reading source package " + m_packageName);
+                        writeSuccess = false;
+                        break;
+                    }
+                    freeFileData = true;
+                    fileData = curFile->getPackedDataView(errorQueue);
+                }
 
-            // Write back m_dataBlockAddress
-            fout.seekp(fileInfoStartAddresses[iFile]);
-            fout.write(reinterpret_cast<char*>(&beforeDataPos), 8);
-            fout.seekp(afterDataPos);
+                // Write UOP file raw data
+                const unsigned long long beforeDataPos = static_cast<unsigned long long>(fout.tellp());
+                if (fileData.data != nullptr)
+                    fout.write( fileData.data, std::streamsize(fileData.size) );
+                const std::streampos afterDataPos = fout.tellp();
 
-            ++iFile;
+                if (freeFileData)
+                {
+                    // If we don't do this, at the end of the saving process we'll have the whole content of the package loaded into memory.
+                    //  The added files keep their source, so their data is read and compressed again by unpack or by another save.
+                    curFile->freePackedData();
+                }
+
+                // Write the file header. Don't update the addresses stored in UOPFile: they have to keep referring to the source package.
+                const unsigned int dataBlockLength = 0;
+                fout.seekp(fileInfoStartAddresses[iFile]);
+                fout.write(reinterpret_cast<const char*>(&beforeDataPos), 8);
+                fout.write(reinterpret_cast<const char*>(&dataBlockLength), 4);
+                fout.write(reinterpret_cast<char*>(&curFile->m_compressedSize), 4);
+                fout.write(reinterpret_cast<char*>(&curFile->m_decompressedSize), 4);
+                fout.write(reinterpret_cast<char*>(&curFile->m_fileHash), 8);
+                fout.write(reinterpret_cast<char*>(&curFile->m_dataBlockHash), 4);
+                fout.write(reinterpret_cast<char*>(&curFile->m_compression), 2);
+                fout.seekp(afterDataPos);
+
+                std::lock_guard<std::mutex> lock(queueMutex);
+                slot.ready = false;
+                ++writtenCount;
+                slotFreed.notify_all();
+            }
+
+            // Done or failed: let the workers go
+            std::lock_guard<std::mutex> lock(queueMutex);
+            stopWorkers = true;
+            slotFreed.notify_all();
         }
     }
+    if (!writeSuccess)
+        return false;
 
     // Done
     bool ret = !fout.bad();
-    if (ret)
+    if (!ret)
     {
         ADDERROR("UOPPackage::save: Bad ofstream");
     }
@@ -44,13 +44,25 @@ public:
     bool readPackedData(UOPError* errorQueue = nullptr);
     void freePackedData();
 
-    bool addFile(const std::string &filePath, unsigned long long fileHash,          CompressionFlag compression, bool addDataHash, UOPError* errorQueue = nullptr);
-    bool addFile(const std::string &filePath, const std::string &packedFileName,    CompressionFlag compression, bool addDataHash, UOPError* errorQueue = nullptr);
+    // Memory-mapped mode: the files' packed data is accessed straight from the mapping, without using streams.
+    bool mapPackageFile(UOPError* errorQueue = nullptr);
+    void unmapPackageFile();
+    bool isMapped() const   { return (m_mappedData != nullptr); }
+
+    // Check the integrity of every file in the package (see UOPFile::verify), processing the blocks in parallel.
+    // An error is added to the queue for each bad file.
+    bool verify(UOPError* errorQueue = nullptr, unsigned int* badFilesCount = nullptr);
+
+    // The added files are read and compressed only when saving the package, in parallel, by finalizeAndSave.
+    // addFile only checks that the source file can be opened: until the package is saved, the compressed and decompressed
+    //  sizes of the added files are 0, and errors reading the sources (or from a data provider) are reported by finalizeAndSave.
+    bool addFile(const std::string &filePath, unsigned long long fileHash,          CompressionFlag compression, bool addDataHash, UOPError* errorQueue = nullptr, ZLibQuality quality = ZLibQuality::Speed);
+    bool addFile(const std::string &filePath, const std::string &packedFileName,    CompressionFlag compression, bool addDataHash, UOPError* errorQueue = nullptr, ZLibQuality quality = ZLibQuality::Speed);
+    bool addFile(const UOPDataProvider &sourceProvider, unsigned long long fileHash, CompressionFlag compression, bool addDataHash, UOPError* errorQueue = nullptr, ZLibQuality quality = ZLibQuality::Speed);
     bool finalizeAndSave(const std::string& uopPath, UOPError* errorQueue = nullptr);
 
 // Package header data
 private:
-    std::string m_filePath;
     unsigned int m_version;
     unsigned int m_misc;
     unsigned long long m_startAddress;
@@ -71,6 +83,27 @@ private:
 
     // Used only when creating a package
     unsigned int m_curBlockIdx;
+    UOPBlock* getBlockForNewFile();
+
+    // Lookup table to find a file by its hash in O(1): open addressing with linear probing, capacity is a power of 2.
+    struct HashTableSlot
+    {
+        unsigned long long hash;    // 0 means empty slot
+        unsigned int block;
+        unsigned int index;
+    };
+    std::vector<HashTableSlot> m_hashTable;
+    unsigned int m_hashTableCount;
+
+    void buildHashTable();
+    void insertInHashTable(unsigned long long hash, unsigned int block, unsigned int index);
+
+    // Read-only memory mapping of the whole package file
+    const char* m_mappedData;
+    unsigned long long m_mappedSize;
+#ifdef _WIN32
+    void* m_mappingHandle;
+#endif
 
 public:
     const std::string& getPackageName() const           { return m_packageName; }